@@ -0,0 +1,1349 @@
+/* Copyright (c) 2013-2015, Drew Thoreson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include "ufiber.h"
+
+#ifdef __linux__
+#include "ufiber_io.h"
+#endif
+
+struct bench {
+	const char *name;
+	void (*run)(unsigned long iters);
+	unsigned long iters;
+	int reports; // run() reports its own results
+};
+
+/* largest number of fibers for benchmarks that scale up the fiber count */
+static unsigned long max_fibers = 100000;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* resident set size in KiB (peak RSS where the current RSS isn't known) */
+static long rss_kib(void)
+{
+#ifdef __linux__
+	long size, resident = 0;
+	FILE *f;
+
+	if ((f = fopen("/proc/self/statm", "r")) != NULL) {
+		if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+			resident = 0;
+		fclose(f);
+	}
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+#else
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_maxrss;
+#endif
+}
+
+/* Print a result: name, iterations, ns per iteration, bytes of RSS growth per
+ * iteration and RSS in KiB.  The RSS figures are taken from 'rss_before' and
+ * 'rss_after'. */
+static void report(const char *name, unsigned long iters,
+		unsigned long long ns, long rss_before, long rss_after)
+{
+	long growth = rss_after > rss_before ? rss_after - rss_before : 0;
+
+	printf("%s\t%lu\t%.1f\t%.1f\t%ld\n", name, iters, (double) ns / iters,
+			growth * 1024.0 / iters, rss_after);
+	fflush(stdout);
+}
+
+static void die(const char *msg)
+{
+	fprintf(stderr, "%s\n", msg);
+	exit(EXIT_FAILURE);
+}
+
+static void *bench_nop(void *arg)
+{
+	return arg;
+}
+
+/* create a fiber and join it immediately: one TCB is recycled every time */
+static void bench_create_join(unsigned long iters)
+{
+	ufiber_t fiber;
+
+	for (unsigned long i = 0; i < iters; i++) {
+		if (ufiber_create(&fiber, 0, bench_nop, NULL))
+			die("ufiber_create() failed");
+		ufiber_join(fiber, NULL);
+	}
+}
+
+static void create_batch(unsigned long iters, const ufiber_attr_t *attr)
+{
+	ufiber_t fibers[64];
+
+	for (unsigned long i = 0; i < iters; i += 64) {
+		for (int j = 0; j < 64; j++) {
+			if (ufiber_create_attr(&fibers[j], attr, bench_nop, NULL))
+				die("ufiber_create() failed");
+		}
+		for (int j = 0; j < 64; j++)
+			ufiber_join(fibers[j], NULL);
+	}
+}
+
+/* create fibers in batches of 64 and let them all exit: exercises the cache */
+static void bench_create_batch(unsigned long iters)
+{
+	create_batch(iters, NULL);
+}
+
+/* as above, with 16 KiB stacks and no guard pages */
+static void bench_create_small(unsigned long iters)
+{
+	ufiber_attr_t attr;
+
+	ufiber_attr_init(&attr);
+	ufiber_attr_setstacksize(&attr, 16 * 1024);
+	ufiber_attr_setguardsize(&attr, 0);
+	create_batch(iters, &attr);
+	ufiber_attr_destroy(&attr);
+}
+
+/* as above, but with a TCB cache too small to hold a batch */
+static void bench_create_batch_uncached(unsigned long iters)
+{
+	ufiber_set_cache_size(1);
+	create_batch(iters, NULL);
+	ufiber_set_cache_size(64);
+}
+
+/* as create_batch, with the tasks run by a pool of 64 workers */
+static void bench_pool_batch(unsigned long iters)
+{
+	ufiber_task_t tasks[64];
+	ufiber_pool_t pool;
+
+	if (ufiber_pool_init(&pool, 64, NULL))
+		die("ufiber_pool_init() failed");
+	for (unsigned long i = 0; i < iters; i += 64) {
+		for (int j = 0; j < 64; j++)
+			ufiber_pool_submit(&pool, &tasks[j], bench_nop, NULL);
+		for (int j = 0; j < 64; j++)
+			ufiber_task_join(&tasks[j], NULL);
+	}
+	ufiber_pool_destroy(&pool);
+}
+
+/* Fan-out: create 'iters' detached fibers with 16 KiB stacks and no guard
+ * pages, then let them all run and exit.  Since they are queued behind us,
+ * a single yield does. */
+static void fanout(unsigned long iters, int bulk)
+{
+	ufiber_attr_t attr;
+
+	ufiber_attr_init(&attr);
+	ufiber_attr_setstacksize(&attr, 16 * 1024);
+	ufiber_attr_setguardsize(&attr, 0);
+	if (bulk) {
+		if (ufiber_create_n(NULL, iters, &attr, bench_nop, NULL, 0))
+			die("ufiber_create_n() failed");
+	} else {
+		for (unsigned long i = 0; i < iters; i++) {
+			if (ufiber_create_attr(NULL, &attr, bench_nop, NULL))
+				die("ufiber_create() failed");
+		}
+	}
+	ufiber_yield();
+	ufiber_attr_destroy(&attr);
+}
+
+/* one ufiber_create_attr() per fiber */
+static void bench_fanout_loop(unsigned long iters)
+{
+	fanout(iters, 0);
+}
+
+/* a single ufiber_create_n() */
+static void bench_fanout_n(unsigned long iters)
+{
+	fanout(iters, 1);
+}
+
+#define FANIN_CHILDREN 10000
+
+static ufiber_waitgroup_t fanin_wg;
+
+static void *fanin_child(void *arg)
+{
+	ufiber_waitgroup_done(&fanin_wg);
+	return NULL;
+}
+
+/* Fan-out/fan-in: rounds of FANIN_CHILDREN children (16 KiB stacks, no guard
+ * pages), collected either by joining each of them, or by a wait group.  The
+ * TCB cache holds a whole round, so that stacks are recycled instead of
+ * being mapped and unmapped every time. */
+static void fanin(unsigned long iters, int wg)
+{
+	ufiber_t *children;
+	ufiber_attr_t attr;
+
+	if ((children = malloc(FANIN_CHILDREN * sizeof(*children))) == NULL)
+		die("out of memory");
+	ufiber_attr_init(&attr);
+	ufiber_attr_setstacksize(&attr, 16 * 1024);
+	ufiber_attr_setguardsize(&attr, 0);
+	ufiber_waitgroup_init(&fanin_wg);
+	ufiber_set_cache_size(FANIN_CHILDREN);
+
+	for (unsigned long i = 0; i < iters; i += FANIN_CHILDREN) {
+		for (int j = 0; j < FANIN_CHILDREN; j++) {
+			ufiber_waitgroup_add(&fanin_wg, 1);
+			if (ufiber_create_attr(wg ? NULL : &children[j], &attr,
+						fanin_child, NULL))
+				die("ufiber_create() failed");
+		}
+		if (wg) {
+			ufiber_waitgroup_wait(&fanin_wg);
+		} else {
+			for (int j = 0; j < FANIN_CHILDREN; j++)
+				ufiber_join(children[j], NULL);
+		}
+	}
+
+	ufiber_set_cache_size(64);
+	ufiber_waitgroup_destroy(&fanin_wg);
+	ufiber_attr_destroy(&attr);
+	free(children);
+}
+
+static void bench_fanin_join(unsigned long iters)
+{
+	fanin(iters, 0);
+}
+
+static void bench_fanin_waitgroup(unsigned long iters)
+{
+	fanin(iters, 1);
+}
+
+struct ping_pong {
+	ufiber_t peer;
+	unsigned long iters;
+};
+
+static void *ping_pong(void *arg)
+{
+	struct ping_pong *pp = arg;
+
+	for (unsigned long i = 0; i < pp->iters; i++)
+		ufiber_yield_to(pp->peer);
+	return NULL;
+}
+
+/* ufiber_yield_to() round trips between two fibers: two context switches */
+static void bench_yield_to(unsigned long iters)
+{
+	struct ping_pong pp = { ufiber_self(), iters };
+	ufiber_t peer;
+
+	ufiber_create(&peer, 0, ping_pong, &pp);
+	for (unsigned long i = 0; i < iters; i++)
+		ufiber_yield_to(peer);
+	ufiber_join(peer, NULL);
+}
+
+static void *yield_peer(void *arg)
+{
+	for (unsigned long i = *(unsigned long*)arg; i > 0; i--)
+		ufiber_yield();
+	return NULL;
+}
+
+/* ufiber_yield() round trips between two fibers, via the ready queue */
+static void bench_yield(unsigned long iters)
+{
+	ufiber_t peer;
+
+	ufiber_create(&peer, 0, yield_peer, &iters);
+	for (unsigned long i = 0; i < iters; i++)
+		ufiber_yield();
+	ufiber_join(peer, NULL);
+}
+
+/* fiber-local storage lookups, for a key stored in the TCB and one stored in
+ * the spill block */
+#define YIELD_FIBERS 16384
+
+/* YIELD_FIBERS fibers yielding round-robin, so that each switch goes to a
+ * TCB and stack that have not been touched for YIELD_FIBERS switches */
+static void yield_many(unsigned long iters, const ufiber_attr_t *attr)
+{
+	unsigned long each = iters / YIELD_FIBERS;
+	ufiber_t *fibers;
+
+	if ((fibers = malloc(YIELD_FIBERS * sizeof(*fibers))) == NULL)
+		die("out of memory");
+
+	for (int i = 0; i < YIELD_FIBERS; i++)
+		if (ufiber_create_attr(&fibers[i], attr, yield_peer, &each))
+			die("ufiber_create_attr() failed");
+	for (int i = 0; i < YIELD_FIBERS; i++)
+		ufiber_join(fibers[i], NULL);
+	free(fibers);
+}
+
+static void bench_yield_many(unsigned long iters)
+{
+	ufiber_attr_t attr;
+
+	ufiber_attr_init(&attr);
+	ufiber_attr_setstacksize(&attr, 16 * 1024);
+	ufiber_attr_setguardsize(&attr, 0);
+	yield_many(iters, &attr);
+	ufiber_attr_destroy(&attr);
+}
+
+/* the same on shared stacks, where every switch copies a stack out and
+ * another in */
+static void bench_yield_shared(unsigned long iters)
+{
+	ufiber_attr_t attr;
+
+	ufiber_attr_init(&attr);
+	ufiber_attr_setsharedstack(&attr, 1);
+	yield_many(iters, &attr);
+	ufiber_attr_destroy(&attr);
+}
+
+static void bench_getspecific(unsigned long iters)
+{
+	static int value;
+	ufiber_key_t keys[16];
+	volatile unsigned long hits = 0;
+
+	for (int i = 0; i < 16; i++) {
+		if (ufiber_key_create(&keys[i], NULL))
+			die("ufiber_key_create() failed");
+		ufiber_setspecific(keys[i], &value);
+	}
+	for (unsigned long i = 0; i < iters / 2; i++) {
+		hits += ufiber_getspecific(keys[0]) == &value;
+		hits += ufiber_getspecific(keys[15]) == &value;
+	}
+	for (int i = 0; i < 16; i++) {
+		ufiber_setspecific(keys[i], NULL);
+		ufiber_key_delete(keys[i]);
+	}
+}
+
+#define CONTENDERS 16
+
+static ufiber_mutex_t mutex;
+static ufiber_cond_t cond;
+
+struct mutex_bench {
+	unsigned long iters;
+	unsigned long hold_every;
+};
+
+static void *mutex_contender(void *arg)
+{
+	struct mutex_bench *mb = arg;
+
+	for (unsigned long i = 1; i <= mb->iters; i++) {
+		ufiber_mutex_lock(&mutex);
+		if (i % mb->hold_every == 0)
+			ufiber_yield();
+		ufiber_mutex_unlock(&mutex);
+		if (i % mb->hold_every != 0)
+			ufiber_yield();
+	}
+	return NULL;
+}
+
+/* CONTENDERS fibers taking turns on a mutex, yielding once per iteration:
+ * while holding the mutex every 'hold_every' iterations, and after unlocking
+ * it otherwise */
+static void mutex_bench(unsigned long iters, int policy,
+		unsigned long hold_every)
+{
+	struct mutex_bench mb = { iters / CONTENDERS, hold_every };
+	ufiber_t fibers[CONTENDERS];
+
+	ufiber_mutex_init(&mutex);
+	ufiber_mutex_setpolicy(&mutex, policy);
+	for (int i = 0; i < CONTENDERS; i++)
+		ufiber_create(&fibers[i], 0, mutex_contender, &mb);
+	for (int i = 0; i < CONTENDERS; i++)
+		ufiber_join(fibers[i], NULL);
+	ufiber_mutex_destroy(&mutex);
+}
+
+/* the holder always yields, so the mutex is always contended */
+static void bench_mutex(unsigned long iters)
+{
+	mutex_bench(iters, UFIBER_MUTEX_FIFO, 1);
+}
+
+static void bench_mutex_handoff(unsigned long iters)
+{
+	mutex_bench(iters, UFIBER_MUTEX_HANDOFF, 1);
+}
+
+static void bench_mutex_steal(unsigned long iters)
+{
+	mutex_bench(iters, UFIBER_MUTEX_STEAL, 1);
+}
+
+/* the holder yields in one critical section out of 8: contention comes and
+ * goes, and a FIFO mutex stays owned by fibers that are not running */
+static void bench_mutex_mixed(unsigned long iters)
+{
+	mutex_bench(iters, UFIBER_MUTEX_FIFO, 8);
+}
+
+static void bench_mutex_mixed_handoff(unsigned long iters)
+{
+	mutex_bench(iters, UFIBER_MUTEX_HANDOFF, 8);
+}
+
+static void bench_mutex_mixed_steal(unsigned long iters)
+{
+	mutex_bench(iters, UFIBER_MUTEX_STEAL, 8);
+}
+
+struct cond_bench {
+	unsigned long turn;
+	unsigned long iters;
+};
+
+static void *cond_pinger(void *arg)
+{
+	struct cond_bench *cb = arg;
+
+	ufiber_mutex_lock(&mutex);
+	while (cb->turn < cb->iters) {
+		if (cb->turn % 2 == 0) {
+			cb->turn++;
+			ufiber_cond_signal(&cond);
+		}
+		ufiber_cond_wait(&cond, &mutex);
+	}
+	ufiber_cond_signal(&cond);
+	ufiber_mutex_unlock(&mutex);
+	return NULL;
+}
+
+/* two fibers taking turns, signalling each other with a condition variable */
+static void bench_cond_signal(unsigned long iters)
+{
+	struct cond_bench cb = { 0, iters };
+	ufiber_t peer;
+
+	ufiber_mutex_init(&mutex);
+	ufiber_cond_init(&cond);
+	ufiber_create(&peer, 0, cond_pinger, &cb);
+
+	ufiber_mutex_lock(&mutex);
+	while (cb.turn < iters) {
+		if (cb.turn % 2 == 1) {
+			cb.turn++;
+			ufiber_cond_signal(&cond);
+		}
+		ufiber_cond_wait(&cond, &mutex);
+	}
+	ufiber_cond_signal(&cond);
+	ufiber_mutex_unlock(&mutex);
+	ufiber_join(peer, NULL);
+}
+
+#define FAN_OUT 1000
+
+static void *cond_waiter(void *arg)
+{
+	for (unsigned long i = *(unsigned long*)arg; i > 0; i--)
+		ufiber_cond_wait(&cond, NULL);
+	return NULL;
+}
+
+/* broadcasts to FAN_OUT waiting fibers; one iteration is one fiber woken */
+static void bench_cond_broadcast(unsigned long iters)
+{
+	unsigned long rounds = iters / FAN_OUT;
+	ufiber_t *fibers;
+
+	if ((fibers = malloc(FAN_OUT * sizeof(*fibers))) == NULL)
+		die("out of memory");
+
+	ufiber_cond_init(&cond);
+	for (int i = 0; i < FAN_OUT; i++)
+		ufiber_create(&fibers[i], 0, cond_waiter, &rounds);
+	for (unsigned long i = 0; i < rounds; i++) {
+		ufiber_yield(); // let every waiter block
+		ufiber_cond_broadcast(&cond);
+	}
+	for (int i = 0; i < FAN_OUT; i++)
+		ufiber_join(fibers[i], NULL);
+	free(fibers);
+}
+
+#define QUEUE_SIZE 64
+
+/* the mutex+cond equivalent of a buffered channel */
+static struct {
+	ufiber_mutex_t lock;
+	ufiber_cond_t not_empty;
+	ufiber_cond_t not_full;
+	void *buf[QUEUE_SIZE];
+	unsigned head;
+	unsigned count;
+} queue;
+
+static void *queue_producer(void *arg)
+{
+	for (unsigned long i = *(unsigned long*)arg; i > 0; i--) {
+		ufiber_mutex_lock(&queue.lock);
+		while (queue.count == QUEUE_SIZE)
+			ufiber_cond_wait(&queue.not_full, &queue.lock);
+		queue.buf[(queue.head + queue.count++) % QUEUE_SIZE] = arg;
+		ufiber_cond_signal(&queue.not_empty);
+		ufiber_mutex_unlock(&queue.lock);
+	}
+	return NULL;
+}
+
+/* one producer and one consumer passing values through a bounded queue
+ * protected by a mutex, with condition variables to wait on */
+static void bench_queue_cond(unsigned long iters)
+{
+	ufiber_t producer;
+
+	ufiber_mutex_init(&queue.lock);
+	ufiber_cond_init(&queue.not_empty);
+	ufiber_cond_init(&queue.not_full);
+	queue.head = queue.count = 0;
+	ufiber_create(&producer, 0, queue_producer, &iters);
+
+	for (unsigned long i = 0; i < iters; i++) {
+		ufiber_mutex_lock(&queue.lock);
+		while (queue.count == 0)
+			ufiber_cond_wait(&queue.not_empty, &queue.lock);
+		queue.head = (queue.head + 1) % QUEUE_SIZE;
+		queue.count--;
+		ufiber_cond_signal(&queue.not_full);
+		ufiber_mutex_unlock(&queue.lock);
+	}
+	ufiber_join(producer, NULL);
+}
+
+#define SEM_FIBERS  8
+#define SEM_PERMITS 2
+
+/* a counting semaphore built from a mutex and a condition variable */
+static struct {
+	ufiber_mutex_t lock;
+	ufiber_cond_t cond;
+	unsigned long count;
+} csem;
+
+static ufiber_sem_t sem;
+
+static void *sem_worker(void *arg)
+{
+	for (unsigned long i = *(unsigned long*)arg; i > 0; i--) {
+		ufiber_sem_wait(&sem);
+		ufiber_yield();
+		ufiber_sem_post(&sem);
+	}
+	return NULL;
+}
+
+static void *csem_worker(void *arg)
+{
+	for (unsigned long i = *(unsigned long*)arg; i > 0; i--) {
+		ufiber_mutex_lock(&csem.lock);
+		while (csem.count == 0)
+			ufiber_cond_wait(&csem.cond, &csem.lock);
+		csem.count--;
+		ufiber_mutex_unlock(&csem.lock);
+		ufiber_yield();
+		ufiber_mutex_lock(&csem.lock);
+		csem.count++;
+		ufiber_cond_signal(&csem.cond);
+		ufiber_mutex_unlock(&csem.lock);
+	}
+	return NULL;
+}
+
+/* SEM_FIBERS fibers limited to SEM_PERMITS at a time, each yielding while
+ * it holds a permit */
+static void sem_limit(unsigned long iters, void *(*worker)(void*))
+{
+	unsigned long rounds = iters / SEM_FIBERS;
+	ufiber_t fibers[SEM_FIBERS];
+
+	ufiber_sem_init(&sem, SEM_PERMITS);
+	ufiber_mutex_init(&csem.lock);
+	ufiber_cond_init(&csem.cond);
+	csem.count = SEM_PERMITS;
+	for (int i = 0; i < SEM_FIBERS; i++)
+		ufiber_create(&fibers[i], 0, worker, &rounds);
+	for (int i = 0; i < SEM_FIBERS; i++)
+		ufiber_join(fibers[i], NULL);
+	ufiber_sem_destroy(&sem);
+}
+
+static void bench_sem_limit(unsigned long iters)
+{
+	sem_limit(iters, sem_worker);
+}
+
+static void bench_sem_limit_cond(unsigned long iters)
+{
+	sem_limit(iters, csem_worker);
+}
+
+static void *sem_waiter(void *arg)
+{
+	for (unsigned long i = *(unsigned long*)arg; i > 0; i--)
+		ufiber_sem_wait(&sem);
+	return NULL;
+}
+
+/* FAN_OUT waiters released together by ufiber_sem_post_n() */
+static void bench_sem_batch(unsigned long iters)
+{
+	unsigned long rounds = iters / FAN_OUT;
+	ufiber_t *fibers;
+
+	if ((fibers = malloc(FAN_OUT * sizeof(*fibers))) == NULL)
+		die("out of memory");
+
+	ufiber_sem_init(&sem, 0);
+	for (int i = 0; i < FAN_OUT; i++)
+		ufiber_create(&fibers[i], 0, sem_waiter, &rounds);
+	for (unsigned long i = 0; i < rounds; i++) {
+		ufiber_yield(); // let every waiter block
+		ufiber_sem_post_n(&sem, FAN_OUT);
+	}
+	for (int i = 0; i < FAN_OUT; i++)
+		ufiber_join(fibers[i], NULL);
+	ufiber_sem_destroy(&sem);
+	free(fibers);
+}
+
+static ufiber_chan_t chan;
+
+static void *chan_producer(void *arg)
+{
+	for (unsigned long i = *(unsigned long*)arg; i > 0; i--)
+		ufiber_chan_send(&chan, arg);
+	return NULL;
+}
+
+/* the same, passing values through a channel */
+static void chan_bench(unsigned long iters, unsigned size, unsigned flags)
+{
+	ufiber_t producer;
+	void *value;
+
+	ufiber_chan_init(&chan, size, flags);
+	ufiber_create(&producer, 0, chan_producer, &iters);
+	for (unsigned long i = 0; i < iters; i++)
+		ufiber_chan_recv(&chan, &value);
+	ufiber_join(producer, NULL);
+	ufiber_chan_destroy(&chan);
+}
+
+static void bench_chan_buffered(unsigned long iters)
+{
+	chan_bench(iters, QUEUE_SIZE, 0);
+}
+
+static void bench_chan_unbuffered(unsigned long iters)
+{
+	chan_bench(iters, 0, 0);
+}
+
+/* switching to the receiver on every send takes two context switches per
+ * value, where an unbuffered channel without UFIBER_CHAN_SWITCH lets the
+ * receiver pick up a blocked sender's value without one */
+static void bench_chan_switch(unsigned long iters)
+{
+	chan_bench(iters, 0, UFIBER_CHAN_SWITCH);
+}
+
+#define NR_PROMISES 8
+
+static ufiber_promise_t promises[NR_PROMISES];
+
+/* each round, set one promise (or all of them) and let the waiter run */
+static void *promise_setter(void *arg)
+{
+	unsigned long iters = *(unsigned long*)arg >> 1;
+	int all = *(unsigned long*)arg & 1;
+
+	for (unsigned long i = 0; i < iters; i++) {
+		for (int j = 0; j < NR_PROMISES; j++) {
+			if (all || j == (int) (i % NR_PROMISES))
+				ufiber_promise_set(&promises[j], NULL);
+		}
+		ufiber_yield();
+	}
+	return NULL;
+}
+
+/* rounds of waiting on NR_PROMISES futures, for any or all of them */
+static void future_bench(unsigned long iters, int all)
+{
+	ufiber_future_t *futures[NR_PROMISES];
+	unsigned long arg = iters << 1 | all;
+	ufiber_t setter;
+	unsigned index;
+
+	for (int j = 0; j < NR_PROMISES; j++)
+		futures[j] = ufiber_promise_future(&promises[j]);
+	ufiber_create(&setter, 0, promise_setter, &arg);
+	for (unsigned long i = 0; i < iters; i++) {
+		for (int j = 0; j < NR_PROMISES; j++)
+			ufiber_promise_init(&promises[j]);
+		if (all)
+			ufiber_wait_all(futures, NR_PROMISES);
+		else
+			ufiber_wait_any(futures, NR_PROMISES, &index);
+	}
+	ufiber_join(setter, NULL);
+}
+
+static void bench_future_any(unsigned long iters)
+{
+	future_bench(iters, 0);
+}
+
+static void bench_future_all(unsigned long iters)
+{
+	future_bench(iters, 1);
+}
+
+#define REMOTE_FIBERS 64
+
+/* A thread completes 'iters' jobs for REMOTE_FIBERS fibers, in turn.  Each
+ * fiber is either woken with ufiber_wake_remote(), or polls a flag between
+ * yields; the thread backs off while a fiber has yet to see its last
+ * result. */
+static struct {
+	ufiber_t fibers[REMOTE_FIBERS];
+	int flags[REMOTE_FIBERS];
+	unsigned long iters;
+} remote;
+
+static void *remote_waker(void *arg)
+{
+	for (unsigned long i = 0; i < remote.iters; i++) {
+		while (ufiber_wake_remote(remote.fibers[i % REMOTE_FIBERS],
+					NULL) == EBUSY)
+			sched_yield();
+	}
+	return NULL;
+}
+
+static void *remote_flagger(void *arg)
+{
+	int *flag;
+
+	for (unsigned long i = 0; i < remote.iters; i++) {
+		flag = &remote.flags[i % REMOTE_FIBERS];
+		while (__atomic_load_n(flag, __ATOMIC_ACQUIRE))
+			sched_yield();
+		__atomic_store_n(flag, 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+static void *remote_wait_fiber(void *arg)
+{
+	for (unsigned long i = remote.iters / REMOTE_FIBERS; i > 0; i--)
+		ufiber_wait_remote(NULL);
+	return NULL;
+}
+
+static void *remote_poll_fiber(void *arg)
+{
+	int *flag = arg;
+
+	for (unsigned long i = remote.iters / REMOTE_FIBERS; i > 0; i--) {
+		while (!__atomic_load_n(flag, __ATOMIC_ACQUIRE))
+			ufiber_yield();
+		__atomic_store_n(flag, 0, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+static void remote_bench(unsigned long iters, int poll)
+{
+	pthread_t thread;
+
+	remote.iters = iters - iters % REMOTE_FIBERS;
+	for (int i = 0; i < REMOTE_FIBERS; i++) {
+		remote.flags[i] = 0;
+		ufiber_create(&remote.fibers[i], 0,
+				poll ? remote_poll_fiber : remote_wait_fiber,
+				&remote.flags[i]);
+	}
+	if (pthread_create(&thread, NULL, poll ? remote_flagger : remote_waker,
+				NULL))
+		die("pthread_create() failed");
+	for (int i = 0; i < REMOTE_FIBERS; i++)
+		ufiber_join(remote.fibers[i], NULL);
+	pthread_join(thread, NULL);
+}
+
+static void bench_remote_wake(unsigned long iters)
+{
+	remote_bench(iters, 0);
+}
+
+static void bench_remote_poll(unsigned long iters)
+{
+	remote_bench(iters, 1);
+}
+
+static void *offload_fiber(void *arg)
+{
+	for (unsigned long i = *(unsigned long*)arg; i > 0; i--)
+		ufiber_offload(bench_nop, NULL, NULL);
+	return NULL;
+}
+
+/* 'n' fibers making calls to a no-op through ufiber_offload() */
+static void offload_bench(unsigned long iters, unsigned n)
+{
+	unsigned long rounds = iters / n;
+	ufiber_t fibers[REMOTE_FIBERS];
+
+	for (unsigned i = 0; i < n; i++)
+		ufiber_create(&fibers[i], 0, offload_fiber, &rounds);
+	for (unsigned i = 0; i < n; i++)
+		ufiber_join(fibers[i], NULL);
+}
+
+static void bench_offload(unsigned long iters)
+{
+	offload_bench(iters, REMOTE_FIBERS);
+}
+
+static void bench_offload_serial(unsigned long iters)
+{
+	offload_bench(iters, 1);
+}
+
+#define BACKLOG       1000
+#define BULK_SPIN     200
+#define PRIO_SAMPLES  200
+
+/* Bulk fibers spin and yield in a loop, keeping BACKLOG fibers ready at all
+ * times.  One of them periodically wakes an urgent fiber, which records how
+ * long it took to get to run. */
+static struct {
+	ufiber_cond_t wake;
+	unsigned long long stamp;
+	unsigned long long lat[PRIO_SAMPLES];
+	int waiting;
+	int done;
+} prio;
+
+static void *bulk_worker(void *arg)
+{
+	volatile unsigned long spin;
+	unsigned long slices = 0;
+
+	while (!prio.done) {
+		for (spin = 0; spin < BULK_SPIN; spin++)
+			/* nothing */;
+		if (arg && prio.waiting && ++slices % 4 == 0) {
+			prio.waiting = 0;
+			prio.stamp = now_ns();
+			ufiber_cond_signal(&prio.wake);
+		}
+		ufiber_yield();
+	}
+	return NULL;
+}
+
+static void *urgent_fiber(void *arg)
+{
+	for (int i = 0; i < PRIO_SAMPLES; i++) {
+		prio.waiting = 1;
+		ufiber_cond_wait(&prio.wake, NULL);
+		prio.lat[i] = now_ns() - prio.stamp;
+	}
+	prio.done = 1;
+	return NULL;
+}
+
+static int cmp_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long*)a;
+	unsigned long long y = *(const unsigned long long*)b;
+	return (x > y) - (x < y);
+}
+
+static void prio_round(const char *name, int urgent_prio)
+{
+	static const struct { const char *name; int permille; } pct[] = {
+		{ "p50", 500 }, { "p99", 990 }, { "max", 1000 },
+	};
+	ufiber_t *fibers, urgent;
+	ufiber_attr_t attr;
+	char buf[64];
+	long rss;
+
+	if ((fibers = malloc(BACKLOG * sizeof(*fibers))) == NULL)
+		die("out of memory");
+
+	prio.waiting = prio.done = 0;
+	ufiber_cond_init(&prio.wake);
+	ufiber_attr_init(&attr);
+	ufiber_attr_setprio(&attr, urgent_prio);
+	ufiber_create_attr(&urgent, &attr, urgent_fiber, NULL);
+
+	ufiber_attr_setprio(&attr, UFIBER_PRIO_DEFAULT);
+	ufiber_attr_setstacksize(&attr, 16 * 1024);
+	for (int i = 0; i < BACKLOG; i++)
+		if (ufiber_create_attr(&fibers[i], &attr, bulk_worker,
+					i ? NULL : &prio))
+			die("ufiber_create() failed");
+	ufiber_attr_destroy(&attr);
+
+	ufiber_join(urgent, NULL);
+	for (int i = 0; i < BACKLOG; i++)
+		ufiber_join(fibers[i], NULL);
+	free(fibers);
+	rss = rss_kib();
+
+	qsort(prio.lat, PRIO_SAMPLES, sizeof(*prio.lat), cmp_ull);
+	for (unsigned i = 0; i < sizeof(pct) / sizeof(*pct); i++) {
+		snprintf(buf, sizeof(buf), "%s/%s", name, pct[i].name);
+		report(buf, 1, prio.lat[(PRIO_SAMPLES - 1) * pct[i].permille
+				/ 1000], rss, rss);
+	}
+}
+
+/*
+ * Wake-up latency of a fiber behind a backlog of BACKLOG ready fibers, with
+ * the same priority as the backlog (prio_latency/fifo/...) and with a higher
+ * priority (prio_latency/high/...).  The ns/op column is the latency.
+ */
+static void bench_prio_latency(unsigned long iters)
+{
+	prio_round("prio_latency/fifo", UFIBER_PRIO_DEFAULT);
+	prio_round("prio_latency/high", UFIBER_PRIO_MAX);
+}
+
+static ufiber_barrier_t barrier;
+
+static void *barrier_waiter(void *arg)
+{
+	ufiber_barrier_wait(&barrier);
+	return NULL;
+}
+
+/* Create 'n' fibers and have them meet at a barrier.  Each iteration is one
+ * fiber created, blocked, woken and joined; the RSS is measured while all of
+ * the fibers are blocked, so the RSS growth per iteration is the memory cost
+ * of a blocked fiber. */
+static void barrier_round(const char *name, unsigned long n,
+		const ufiber_attr_t *attr)
+{
+	unsigned long long start;
+	long rss_before, rss_peak;
+	ufiber_t *fibers;
+
+	if ((fibers = malloc(n * sizeof(*fibers))) == NULL)
+		die("out of memory");
+
+	rss_before = rss_kib();
+	start = now_ns();
+	ufiber_barrier_init(&barrier, n + 1);
+	for (unsigned long i = 0; i < n; i++)
+		if (ufiber_create_attr(&fibers[i], attr, barrier_waiter, NULL))
+			die("ufiber_create() failed");
+	ufiber_yield(); // let every fiber block
+	rss_peak = rss_kib();
+
+	ufiber_barrier_wait(&barrier);
+	for (unsigned long i = 0; i < n; i++)
+		ufiber_join(fibers[i], NULL);
+	report(name, n, now_ns() - start, rss_before, rss_peak);
+	free(fibers);
+}
+
+/* from 1000 to max_fibers fibers with 16 KiB stacks and no guard pages */
+static void bench_barrier(unsigned long iters)
+{
+	ufiber_attr_t attr;
+	char name[32];
+
+	ufiber_attr_init(&attr);
+	ufiber_attr_setstacksize(&attr, 16 * 1024);
+	ufiber_attr_setguardsize(&attr, 0);
+	for (unsigned long n = 1000; n <= max_fibers; n *= 10) {
+		snprintf(name, sizeof(name), "barrier/%lu", n);
+		barrier_round(name, n, &attr);
+	}
+	ufiber_attr_destroy(&attr);
+}
+
+/* the same with fibers on shared stacks */
+static void bench_barrier_shared(unsigned long iters)
+{
+	ufiber_attr_t attr;
+	char name[32];
+
+	ufiber_attr_init(&attr);
+	ufiber_attr_setsharedstack(&attr, 1);
+	for (unsigned long n = 1000; n <= max_fibers; n *= 10) {
+		snprintf(name, sizeof(name), "barrier_shared/%lu", n);
+		barrier_round(name, n, &attr);
+	}
+	ufiber_attr_destroy(&attr);
+}
+
+#define STATS_FIBERS 1024
+
+static unsigned long stats_visited;
+static unsigned long long stats_sink;
+
+static void *stats_waiter(void *arg)
+{
+	ufiber_barrier_wait(arg);
+	return NULL;
+}
+
+static int stats_one(ufiber_t fiber, void *arg)
+{
+	struct ufiber_stats stats;
+
+	if (!ufiber_stats(fiber, &stats))
+		stats_sink += stats.switches;
+	stats_visited++;
+	return 0;
+}
+
+/* read the accounting figures of every fiber, STATS_FIBERS of them blocked:
+ * one iteration is one fiber (without stats=y, only the walk is measured) */
+static void bench_stats(unsigned long iters)
+{
+	ufiber_barrier_t barrier;
+
+	ufiber_barrier_init(&barrier, STATS_FIBERS + 1);
+	for (int i = 0; i < STATS_FIBERS; i++) {
+		if (ufiber_create(NULL, UFIBER_DETACHED, stats_waiter,
+					&barrier))
+			die("ufiber_create() failed");
+	}
+	ufiber_yield();
+
+	stats_visited = 0;
+	while (stats_visited < iters)
+		ufiber_foreach(stats_one, NULL);
+	ufiber_barrier_wait(&barrier);
+	ufiber_barrier_destroy(&barrier);
+}
+
+/* memory cost of fibers with the default attributes */
+static void bench_memory(unsigned long iters)
+{
+	barrier_round("memory", iters < max_fibers ? iters : max_fibers, NULL);
+}
+
+#define WORKER_FIBERS 16
+
+static void *yield_loop(void *arg)
+{
+	for (unsigned long i = *(unsigned long*)arg; i > 0; i--)
+		ufiber_yield();
+	return NULL;
+}
+
+/* WORKER_FIBERS fibers per worker, each yielding iters/WORKER_FIBERS times */
+static void *worker_yield(void *arg)
+{
+	unsigned long iters = *(unsigned long*)arg / WORKER_FIBERS;
+	ufiber_t fibers[WORKER_FIBERS];
+
+	for (int i = 0; i < WORKER_FIBERS; i++)
+		ufiber_create(&fibers[i], 0, yield_loop, &iters);
+	for (int i = 0; i < WORKER_FIBERS; i++)
+		ufiber_join(fibers[i], NULL);
+	return NULL;
+}
+
+/*
+ * Scaling from 1 to N worker threads: every worker does the same amount of
+ * work, so with perfect scaling the time per yield (over all workers) halves
+ * each time the number of workers doubles.
+ */
+static void bench_workers(unsigned long iters)
+{
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned long long start;
+	char name[32];
+	long rss;
+	int error;
+
+	for (long n = 1; n <= nr_cpus; n++) {
+		rss = rss_kib();
+		start = now_ns();
+		if ((error = ufiber_run_workers(n, worker_yield, &iters))) {
+			if (error != ENOSYS)
+				fprintf(stderr, "ufiber_run_workers() failed\n");
+			return;
+		}
+		snprintf(name, sizeof(name), "workers/%ld", n);
+		report(name, iters * n, now_ns() - start, rss, rss_kib());
+	}
+}
+
+struct steal_bench {
+	unsigned long iters; // yields per fiber
+	long fibers;
+};
+
+/* all of the work is spawned by worker 0, and the others steal it */
+static void *worker_spawn(void *arg)
+{
+	struct steal_bench *sb = arg;
+
+	for (long i = 0; ufiber_worker_id() == 0 && i < sb->fibers; i++)
+		ufiber_create(NULL, UFIBER_STEALABLE, yield_loop, &sb->iters);
+	return NULL;
+}
+
+/* as workers, but with the work spread by stealing */
+static void bench_steal(unsigned long iters)
+{
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	struct steal_bench sb = { iters / WORKER_FIBERS, 0 };
+	unsigned long long start;
+	char name[32];
+	long rss;
+	int error;
+
+	for (long n = 1; n <= nr_cpus; n++) {
+		sb.fibers = WORKER_FIBERS * n;
+		rss = rss_kib();
+		start = now_ns();
+		if ((error = ufiber_run_workers(n, worker_spawn, &sb))) {
+			if (error != ENOSYS)
+				fprintf(stderr, "ufiber_run_workers() failed\n");
+			return;
+		}
+		snprintf(name, sizeof(name), "steal/%ld", n);
+		report(name, iters * n, now_ns() - start, rss, rss_kib());
+	}
+}
+
+#ifdef __linux__
+#define IO_FIBERS    64
+#define IO_BLOCK     4096
+#define IO_FILE_SIZE (16 * 1024 * 1024)
+
+struct io_bench {
+	int fd;
+	unsigned long iters;
+	ssize_t (*pread)(int fd, void *buf, size_t count, off_t offset);
+};
+
+static void *io_reader(void *arg)
+{
+	struct io_bench *io = arg;
+	unsigned long seed = (unsigned long) &seed;
+	char buf[IO_BLOCK];
+
+	for (unsigned long i = 0; i < io->iters; i++) {
+		seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+		if (io->pread(io->fd, buf, IO_BLOCK, (seed >> 33)
+					% (IO_FILE_SIZE / IO_BLOCK) * IO_BLOCK)
+				!= IO_BLOCK)
+			die("pread() failed");
+	}
+	return NULL;
+}
+
+/* IO_FIBERS fibers doing random 4 KiB reads from a (cached) 16 MiB file */
+static void io_bench(unsigned long iters,
+		ssize_t (*pread_fn)(int, void*, size_t, off_t))
+{
+	char name[] = "/tmp/ufiber-bench-XXXXXX";
+	ufiber_t fibers[IO_FIBERS];
+	struct io_bench io;
+	char *buf;
+
+	if ((io.fd = mkstemp(name)) < 0 || (buf = calloc(1, IO_FILE_SIZE)) == NULL
+			|| write(io.fd, buf, IO_FILE_SIZE) != IO_FILE_SIZE)
+		die("failed to create temporary file");
+	unlink(name);
+	free(buf);
+
+	io.iters = iters / IO_FIBERS;
+	io.pread = pread_fn;
+	for (int i = 0; i < IO_FIBERS; i++)
+		ufiber_create(&fibers[i], 0, io_reader, &io);
+	for (int i = 0; i < IO_FIBERS; i++)
+		ufiber_join(fibers[i], NULL);
+	close(io.fd);
+}
+
+static void bench_pread_blocking(unsigned long iters)
+{
+	io_bench(iters, pread);
+}
+
+static void bench_pread_fiber(unsigned long iters)
+{
+	io_bench(iters, ufiber_pread);
+}
+#endif
+
+static const struct bench benches[] = {
+	{ "yield",                 bench_yield,                 10000000, 0 },
+	{ "yield_to",              bench_yield_to,              10000000, 0 },
+	{ "yield_many",            bench_yield_many,            10000000, 0 },
+	{ "yield_shared",          bench_yield_shared,          10000000, 0 },
+	{ "create_join",           bench_create_join,           100000,   0 },
+	{ "create_batch",          bench_create_batch,          100000,   0 },
+	{ "create_batch_uncached", bench_create_batch_uncached, 10000,    0 },
+	{ "create_small",          bench_create_small,          100000,   0 },
+	{ "pool_batch",            bench_pool_batch,            100000,   0 },
+	{ "fanin_join",            bench_fanin_join,            100000,   0 },
+	{ "fanin_waitgroup",       bench_fanin_waitgroup,       100000,   0 },
+	{ "fanout_loop",           bench_fanout_loop,           100000,   0 },
+	{ "fanout_n",              bench_fanout_n,              100000,   0 },
+	{ "getspecific",           bench_getspecific,           10000000, 0 },
+	{ "mutex",                 bench_mutex,                 1000000,  0 },
+	{ "mutex_handoff",         bench_mutex_handoff,         1000000,  0 },
+	{ "mutex_steal",           bench_mutex_steal,           1000000,  0 },
+	{ "mutex_mixed",           bench_mutex_mixed,           1000000,  0 },
+	{ "mutex_mixed_handoff",   bench_mutex_mixed_handoff,   1000000,  0 },
+	{ "mutex_mixed_steal",     bench_mutex_mixed_steal,     1000000,  0 },
+	{ "cond_signal",           bench_cond_signal,           1000000,  0 },
+	{ "cond_broadcast",        bench_cond_broadcast,        1000000,  0 },
+	{ "queue_cond",            bench_queue_cond,            1000000,  0 },
+	{ "sem_limit",             bench_sem_limit,             1000000,  0 },
+	{ "sem_limit_cond",        bench_sem_limit_cond,        1000000,  0 },
+	{ "sem_batch",             bench_sem_batch,             1000000,  0 },
+	{ "chan_buffered",         bench_chan_buffered,         1000000,  0 },
+	{ "chan_unbuffered",       bench_chan_unbuffered,       1000000,  0 },
+	{ "chan_switch",           bench_chan_switch,           1000000,  0 },
+	{ "future_any",            bench_future_any,            1000000,  0 },
+	{ "future_all",            bench_future_all,            1000000,  0 },
+	{ "remote_wake",           bench_remote_wake,           1000000,  0 },
+	{ "remote_poll",           bench_remote_poll,           100000,   0 },
+	{ "offload",               bench_offload,               1000000,  0 },
+	{ "offload_serial",        bench_offload_serial,        100000,   0 },
+	{ "stats",                 bench_stats,                 1000000,  0 },
+	{ "barrier",               bench_barrier,               0,        1 },
+	{ "barrier_shared",        bench_barrier_shared,        0,        1 },
+	{ "prio_latency",          bench_prio_latency,          0,        1 },
+	{ "memory",                bench_memory,                10000,    1 },
+	{ "workers",               bench_workers,               1000000,  1 },
+	{ "steal",                 bench_steal,                 1000000,  1 },
+#ifdef __linux__
+	{ "pread_blocking",        bench_pread_blocking,        256000,   0 },
+	{ "pread_fiber",           bench_pread_fiber,           256000,   0 },
+#endif
+};
+
+#define NR_BENCHES (sizeof(benches) / sizeof(*benches))
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-f max_fibers] [benchmark...]\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Output is a header line followed by one line per benchmark, with fields
+ * separated by tabs: name, iterations, nanoseconds per iteration, bytes of
+ * RSS growth per iteration and RSS in KiB at the end of the benchmark.
+ * Benchmarks to run may be named on the command line; by default, all of them
+ * are run.  The -f option sets the largest number of fibers that the barrier
+ * and memory benchmarks may create (default 100000).
+ */
+int main(int argc, char *argv[])
+{
+	unsigned long long start, end;
+	long rss;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "f:")) != -1) {
+		if (opt != 'f' || (max_fibers = strtoul(optarg, NULL, 0)) == 0)
+			usage(argv[0]);
+	}
+
+	ufiber_init();
+	printf("# name\titers\tns/op\tbytes/op\trss_kib\n");
+	for (unsigned i = 0; i < NR_BENCHES; i++) {
+		const struct bench *b = &benches[i];
+		int selected = optind == argc;
+
+		for (int j = optind; j < argc; j++)
+			if (!strcmp(argv[j], b->name))
+				selected = 1;
+		if (!selected)
+			continue;
+
+		rss = rss_kib();
+		start = now_ns();
+		b->run(b->iters);
+		end = now_ns();
+		if (!b->reports)
+			report(b->name, b->iters, end - start, rss, rss_kib());
+	}
+	return EXIT_SUCCESS;
+}
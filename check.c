@@ -28,11 +28,30 @@
  * POSSIBILITY OF SUCH DAMAGE.
 */
 
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
 #include <check.h>
 #include "ufiber.h"
 
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#include <stdint.h>
+#include <limits.h>
+#include "ufiber_io.h"
+#include "internal.h"
+#endif
+
 #define NR_FIBERS 30
 
 #ifndef ck_assert_ptr_eq
@@ -79,6 +98,67 @@ START_TEST(test_ufiber_create)
 }
 END_TEST
 
+static int started[NR_FIBERS];
+
+static void *uf_create_n(void *data)
+{
+	started[counter++] = *(int*)data;
+	return data;
+}
+
+START_TEST(test_ufiber_create_n)
+{
+	static char stack[64 * 1024];
+	int uid[NR_FIBERS];
+	ufiber_t fid[NR_FIBERS];
+	ufiber_attr_t attr;
+	void *retval;
+
+	for (int i = 0; i < NR_FIBERS; i++)
+		uid[i] = i;
+
+	/* joinable, default attributes: fibers start in order */
+	counter = 0;
+	ck_assert_int_eq(ufiber_create_n(fid, NR_FIBERS, NULL, uf_create_n,
+				uid, sizeof(*uid)), 0);
+	for (int i = 0; i < NR_FIBERS; i++) {
+		ck_ufiber_join(fid[i], &retval);
+		ck_assert_ptr_eq(retval, &uid[i]);
+	}
+	ck_assert_int_eq(counter, NR_FIBERS);
+	for (int i = 0; i < NR_FIBERS; i++)
+		ck_assert_int_eq(started[i], i);
+
+	/* no IDs: the fibers are detached, and all run before we do again */
+	ufiber_attr_init(&attr);
+	ufiber_attr_setstacksize(&attr, 16 * 1024);
+	ufiber_attr_setguardsize(&attr, 0);
+	counter = 0;
+	ck_assert_int_eq(ufiber_create_n(NULL, NR_FIBERS, &attr, uf_create_n,
+				uid, sizeof(*uid)), 0);
+	ufiber_yield();
+	ck_assert_int_eq(counter, NR_FIBERS);
+
+	/* one argument for all, on shared stacks */
+	ufiber_attr_setsharedstack(&attr, 1);
+	counter = 0;
+	ck_assert_int_eq(ufiber_create_n(fid, NR_FIBERS, &attr, uf_create_n,
+				&uid[3], 0), 0);
+	for (int i = 0; i < NR_FIBERS; i++) {
+		ck_ufiber_join(fid[i], &retval);
+		ck_assert_ptr_eq(retval, &uid[3]);
+	}
+	ck_assert_int_eq(counter, NR_FIBERS);
+
+	ck_assert_int_eq(ufiber_create_n(fid, 0, NULL, uf_create_n, uid, 0), 0);
+	ufiber_attr_setstack(&attr, stack, sizeof(stack));
+	ufiber_attr_setsharedstack(&attr, 0);
+	ck_assert_int_eq(ufiber_create_n(fid, 2, &attr, uf_create_n, uid, 0),
+			EINVAL);
+	ufiber_attr_destroy(&attr);
+}
+END_TEST
+
 static void *uf_join(void *data)
 {
 	for (int i = 0; i < 3; i++)
@@ -218,6 +298,96 @@ START_TEST(test_ufiber_mutex)
 }
 END_TEST
 
+static int mutex_owner;
+
+static void *uf_mutex_policy(void *data)
+{
+	for (int i = 0; i < NR_FIBERS; i++) {
+		ck_assert_int_eq(ufiber_mutex_lock(&mutex), 0);
+		mutex_owner = *((int*)data);
+		ufiber_yield();
+		ck_assert_int_eq(mutex_owner, *((int*)data));
+		ufiber_mutex_unlock(&mutex);
+		ufiber_yield();
+	}
+	return NULL;
+}
+
+static void *uf_mutex_waiter(void *data)
+{
+	ufiber_mutex_lock(&mutex);
+	mutex_owner = 1;
+	ufiber_mutex_unlock(&mutex);
+	return NULL;
+}
+
+START_TEST(test_ufiber_mutex_policy)
+{
+	static const int policies[] = {
+		UFIBER_MUTEX_FIFO, UFIBER_MUTEX_HANDOFF, UFIBER_MUTEX_STEAL
+	};
+	int uid[NR_FIBERS];
+	ufiber_t fid[NR_FIBERS];
+	int policy;
+
+	ufiber_mutex_init(&mutex);
+	ufiber_mutex_getpolicy(&mutex, &policy);
+	ck_assert_int_eq(policy, UFIBER_MUTEX_FIFO);
+	ck_assert_int_eq(ufiber_mutex_setpolicy(&mutex, -1), EINVAL);
+
+	/* mutual exclusion holds under every policy */
+	for (int p = 0; p < 3; p++) {
+		ufiber_mutex_init(&mutex);
+		ck_assert_int_eq(ufiber_mutex_setpolicy(&mutex, policies[p]),
+				0);
+		for (int i = 0; i < NR_FIBERS; i++) {
+			uid[i] = i;
+			ck_ufiber_create(&fid[i], 0, uf_mutex_policy, &uid[i]);
+		}
+		for (int i = 0; i < NR_FIBERS; i++)
+			ck_ufiber_join(fid[i], NULL);
+	}
+
+	/* FIFO: the waiter owns the mutex, but has not run */
+	ufiber_mutex_init(&mutex);
+	ufiber_mutex_lock(&mutex);
+	mutex_owner = 0;
+	ck_ufiber_create(&fid[0], 0, uf_mutex_waiter, NULL);
+	ufiber_yield();
+	ufiber_mutex_unlock(&mutex);
+	ck_assert_int_eq(mutex_owner, 0);
+	ck_assert_int_eq(ufiber_mutex_trylock(&mutex), EBUSY);
+	ck_ufiber_join(fid[0], NULL);
+	ck_assert_int_eq(mutex_owner, 1);
+
+	/* HANDOFF: the waiter runs before unlock returns */
+	ufiber_mutex_init(&mutex);
+	ufiber_mutex_setpolicy(&mutex, UFIBER_MUTEX_HANDOFF);
+	ufiber_mutex_lock(&mutex);
+	mutex_owner = 0;
+	ck_ufiber_create(&fid[0], 0, uf_mutex_waiter, NULL);
+	ufiber_yield();
+	ufiber_mutex_unlock(&mutex);
+	ck_assert_int_eq(mutex_owner, 1);
+	ck_ufiber_join(fid[0], NULL);
+
+	/* STEAL: the unlocker can take the mutex back before the waiter runs */
+	ufiber_mutex_init(&mutex);
+	ufiber_mutex_setpolicy(&mutex, UFIBER_MUTEX_STEAL);
+	ufiber_mutex_lock(&mutex);
+	mutex_owner = 0;
+	ck_ufiber_create(&fid[0], 0, uf_mutex_waiter, NULL);
+	ufiber_yield();
+	ufiber_mutex_unlock(&mutex);
+	ck_assert_int_eq(ufiber_mutex_trylock(&mutex), 0);
+	ufiber_yield();
+	ck_assert_int_eq(mutex_owner, 0);
+	ufiber_mutex_unlock(&mutex);
+	ck_ufiber_join(fid[0], NULL);
+	ck_assert_int_eq(mutex_owner, 1);
+}
+END_TEST
+
 static void *uf_barrier(void *data)
 {
 	ufiber_barrier_wait(&barrier);
@@ -248,6 +418,61 @@ START_TEST(test_ufiber_barrier)
 }
 END_TEST
 
+static ufiber_waitgroup_t waitgroup;
+
+static void *uf_wg_child(void *data)
+{
+	for (int i = *(int*)data % 3; i > 0; i--)
+		ufiber_yield();
+	counter++;
+	ck_assert_int_eq(ufiber_waitgroup_done(&waitgroup), 0);
+	return NULL;
+}
+
+static void *uf_wg_waiter(void *data)
+{
+	ck_assert_int_eq(ufiber_waitgroup_wait(&waitgroup), 0);
+	ck_assert_int_eq(counter, NR_FIBERS);
+	return NULL;
+}
+
+START_TEST(test_ufiber_waitgroup)
+{
+	int uid[NR_FIBERS];
+	ufiber_t fid;
+
+	ufiber_waitgroup_init(&waitgroup);
+	ck_assert_int_eq(ufiber_waitgroup_wait(&waitgroup), 0);
+	ck_assert_int_eq(ufiber_waitgroup_done(&waitgroup), EINVAL);
+
+	/* detached children; two waiters, woken together */
+	counter = 0;
+	ck_ufiber_create(&fid, 0, uf_wg_waiter, NULL);
+	for (int i = 0; i < NR_FIBERS; i++) {
+		uid[i] = i;
+		ck_assert_int_eq(ufiber_waitgroup_add(&waitgroup, 1), 0);
+		ck_ufiber_create(NULL, UFIBER_DETACHED, uf_wg_child, &uid[i]);
+	}
+	ufiber_yield();
+	ck_assert_int_eq(ufiber_waitgroup_destroy(&waitgroup), EBUSY);
+	ck_assert_int_eq(ufiber_waitgroup_wait(&waitgroup), 0);
+	ck_assert_int_eq(counter, NR_FIBERS);
+	ck_ufiber_join(fid, NULL);
+
+	/* add all at once, and reuse */
+	counter = 0;
+	ck_assert_int_eq(ufiber_waitgroup_add(&waitgroup, NR_FIBERS), 0);
+	ck_assert_int_eq(ufiber_create_n(NULL, NR_FIBERS, NULL, uf_wg_child,
+				uid, sizeof(*uid)), 0);
+	ck_assert_int_eq(ufiber_waitgroup_wait(&waitgroup), 0);
+	ck_assert_int_eq(counter, NR_FIBERS);
+	ck_assert_int_eq(ufiber_waitgroup_add(&waitgroup, 1), 0);
+	ck_assert_int_eq(ufiber_waitgroup_add(&waitgroup, ~0U), EOVERFLOW);
+	ck_assert_int_eq(ufiber_waitgroup_done(&waitgroup), 0);
+	ck_assert_int_eq(ufiber_waitgroup_destroy(&waitgroup), 0);
+}
+END_TEST
+
 static void *uf_rwlock_reader(void *data)
 {
 	ufiber_rwlock_rdlock(&rwlock);
@@ -294,6 +519,15 @@ static void *uf_cond(void *data)
 	return NULL;
 }
 
+static void *uf_cond_signaller(void *data)
+{
+	ufiber_mutex_lock(&mutex);
+	counter = 1;
+	ufiber_cond_signal(&cond);
+	ufiber_mutex_unlock(&mutex);
+	return NULL;
+}
+
 START_TEST(test_ufiber_cond)
 {
 	ufiber_t fid[NR_FIBERS];
@@ -316,37 +550,1691 @@ START_TEST(test_ufiber_cond)
 		ufiber_join(fid[i], NULL);
 
 	ck_assert_int_eq(counter, NR_FIBERS);
+
+	/* the new owner of a HANDOFF mutex released by a waiter can signal
+	 * the waiter */
+	counter = 0;
+	ufiber_mutex_init(&mutex);
+	ufiber_mutex_setpolicy(&mutex, UFIBER_MUTEX_HANDOFF);
+	ufiber_mutex_lock(&mutex);
+	ck_ufiber_create(&fid[0], 0, uf_cond_signaller, NULL);
+	ufiber_yield();
+	while (!counter)
+		ck_assert_int_eq(ufiber_cond_wait(&cond, &mutex), 0);
+	ufiber_mutex_unlock(&mutex);
+	ck_ufiber_join(fid[0], NULL);
 }
 END_TEST
 
-START_TEST(test_deadlock)
+static long elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000
+		+ (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* absolute CLOCK_MONOTONIC time 'msec' milliseconds from now */
+static struct timespec deadline(long msec)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += msec / 1000;
+	ts.tv_nsec += (msec % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	return ts;
+}
+
+static void *uf_sleep(void *data)
+{
+	ufiber_sleep((long) data);
+	counter = counter * 10 + (long) data / 10;
+	return NULL;
+}
+
+START_TEST(test_ufiber_sleep)
 {
+	static const long msec[] = { 30, 10, 90, 20 };
+	struct timespec start;
+	ufiber_t fid[4];
+
+	counter = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < 4; i++)
+		ck_ufiber_create(&fid[i], 0, uf_sleep, (void*) msec[i]);
+	for (int i = 0; i < 4; i++)
+		ck_ufiber_join(fid[i], NULL);
+
+	/* woken in order of expiry, and never early */
+	ck_assert_int_eq(counter, 1239);
+	ck_assert(elapsed_ms(&start) >= 90);
+
+	ck_assert_int_eq(ufiber_sleep(0), 0);
+}
+END_TEST
+
+static void *uf_timed_rdlock(void *data)
+{
+	ck_assert_int_eq(ufiber_rwlock_rdlock(&rwlock), 0);
+	counter++;
+	ufiber_rwlock_unlock(&rwlock);
+	return NULL;
+}
+
+START_TEST(test_ufiber_timed)
+{
+	struct timespec ts, start;
+	ufiber_t fid;
+	void *rv;
+
+	/* mutex */
 	ufiber_mutex_init(&mutex);
 	ufiber_mutex_lock(&mutex);
-	ck_assert(ufiber_mutex_lock(&mutex) == EDEADLK);
+	ts = deadline(20);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ck_assert_int_eq(ufiber_mutex_timedlock(&mutex, &ts), ETIMEDOUT);
+	ck_assert(elapsed_ms(&start) >= 19);
+	ck_assert_int_eq(ufiber_mutex_timedlock(&mutex, &ts), ETIMEDOUT);
+	ufiber_mutex_unlock(&mutex);
+	ck_assert_int_eq(ufiber_mutex_timedlock(&mutex, &ts), 0);
+	ufiber_mutex_unlock(&mutex);
+
+	/* condition variable: the mutex is held again after a timeout */
+	ufiber_cond_init(&cond);
+	ufiber_mutex_lock(&mutex);
+	ts = deadline(10);
+	ck_assert_int_eq(ufiber_cond_timedwait(&cond, &mutex, &ts), ETIMEDOUT);
+	ck_assert_int_eq(ufiber_mutex_trylock(&mutex), EBUSY);
+	ufiber_mutex_unlock(&mutex);
+
+	/* join */
+	ck_ufiber_create(&fid, 0, uf_sleep, (void*) 30L);
+	ts = deadline(5);
+	ck_assert_int_eq(ufiber_timedjoin(fid, &rv, &ts), ETIMEDOUT);
+	ts = deadline(1000);
+	rv = &rv;
+	ck_assert_int_eq(ufiber_timedjoin(fid, &rv, &ts), 0);
+	ck_assert_ptr_eq(rv, NULL);
+
+	/* a reader queued behind a writer that times out gets the lock */
+	counter = 0;
+	ufiber_rwlock_init(&rwlock);
+	ufiber_rwlock_rdlock(&rwlock);
+	ck_ufiber_create(&fid, 0, uf_timed_rdlock, NULL);
+	ts = deadline(10);
+	ck_assert_int_eq(ufiber_rwlock_timedwrlock(&rwlock, &ts), ETIMEDOUT);
+	ufiber_rwlock_unlock(&rwlock);
+	ck_ufiber_join(fid, NULL);
+	ck_assert_int_eq(counter, 1);
+
+	ufiber_rwlock_wrlock(&rwlock);
+	ts = deadline(10);
+	ck_assert_int_eq(ufiber_rwlock_timedrdlock(&rwlock, &ts), ETIMEDOUT);
+	ufiber_rwlock_unlock(&rwlock);
+	ck_assert_int_eq(ufiber_rwlock_timedrdlock(&rwlock, &ts), 0);
+	ufiber_rwlock_unlock(&rwlock);
+
+	ts.tv_nsec = 1000000000L;
+	ufiber_mutex_lock(&mutex);
+	ck_assert_int_eq(ufiber_mutex_timedlock(&mutex, &ts), EINVAL);
+	ufiber_mutex_unlock(&mutex);
 }
 END_TEST
 
-int main(void)
+static ufiber_sem_t sem;
+
+/* take 'data' permits; if 'data' is over 100, time out after 10 ms waiting
+ * for 'data' - 100 */
+static void *uf_sem(void *data)
 {
-	int failed;
-	TCase *tc;
-	Suite *s;
-	SRunner *sr;
+	unsigned long n = (unsigned long) data;
+	struct timespec ts;
 
-	ufiber_init();
-	s = suite_create("ufibers");
-	tc = tcase_create("core");
-	tcase_add_test(tc, test_ufiber_create);
-	tcase_add_test(tc, test_ufiber_join);
-	tcase_add_test(tc, test_ufiber_self);
-	tcase_add_test(tc, test_ufiber_yield);
-	tcase_add_test(tc, test_ufiber_yield_to);
-	tcase_add_test(tc, test_ufiber_exit);
-	tcase_add_test(tc, test_ufiber_mutex);
-	tcase_add_test(tc, test_ufiber_barrier);
-	tcase_add_test(tc, test_ufiber_rwlock);
-	tcase_add_test(tc, test_ufiber_cond);
+	if (n > 100) {
+		ts = deadline(10);
+		ck_assert_int_eq(ufiber_sem_timedwait_n(&sem, n - 100, &ts),
+				ETIMEDOUT);
+	} else {
+		ck_assert_int_eq(ufiber_sem_wait_n(&sem, n), 0);
+	}
+	counter = counter * 10 + n % 100;
+	return NULL;
+}
+
+START_TEST(test_ufiber_sem)
+{
+	unsigned long value;
+	ufiber_t fid[2];
+
+	ufiber_sem_init(&sem, 2);
+	ck_assert_int_eq(ufiber_sem_trywait(&sem), 0);
+	ck_assert_int_eq(ufiber_sem_wait(&sem), 0);
+	ck_assert_int_eq(ufiber_sem_trywait(&sem), EAGAIN);
+	ufiber_sem_getvalue(&sem, &value);
+	ck_assert_int_eq(value, 0);
+
+	/* FIFO: a small request can't overtake a large one, and one post
+	 * serves both */
+	counter = 0;
+	ck_ufiber_create(&fid[0], 0, uf_sem, (void*) 3L);
+	ck_ufiber_create(&fid[1], 0, uf_sem, (void*) 1L);
+	ufiber_yield();
+	ck_assert_int_eq(ufiber_sem_post(&sem), 0);
+	ck_assert_int_eq(ufiber_sem_trywait(&sem), EAGAIN);
+	ck_assert_int_eq(ufiber_sem_destroy(&sem), EBUSY);
+	ufiber_yield();
+	ck_assert_int_eq(counter, 0);
+	ck_assert_int_eq(ufiber_sem_post_n(&sem, 4), 0);
+	ck_ufiber_join(fid[0], NULL);
+	ck_ufiber_join(fid[1], NULL);
+	ck_assert_int_eq(counter, 31);
+	ufiber_sem_getvalue(&sem, &value);
+	ck_assert_int_eq(value, 1);
+
+	/* a waiter that times out at the head lets those behind it through */
+	counter = 0;
+	ck_ufiber_create(&fid[0], 0, uf_sem, (void*) 105L);
+	ck_ufiber_create(&fid[1], 0, uf_sem, (void*) 1L);
+	ufiber_yield();
+	ck_assert_int_eq(counter, 0);
+	ck_ufiber_join(fid[1], NULL);
+	ck_assert_int_eq(counter, 51);
+	ck_ufiber_join(fid[0], NULL);
+	ufiber_sem_getvalue(&sem, &value);
+	ck_assert_int_eq(value, 0);
+
+	ck_assert_int_eq(ufiber_sem_post(&sem), 0);
+	ck_assert_int_eq(ufiber_sem_post_n(&sem, ~0UL), EOVERFLOW);
+	ck_assert_int_eq(ufiber_sem_destroy(&sem), 0);
+}
+END_TEST
+
+#define NR_REMOTE 16
+
+/* wake the fiber in 'data' from another thread, after a while */
+static void *remote_waker(void *data)
+{
+	struct timespec ts = { 0, 5000000 };
+
+	nanosleep(&ts, NULL);
+	ufiber_wake_remote(data, (void*) 42L);
+	return NULL;
+}
+
+/* wake each of the NR_REMOTE fibers in 'data' with its index */
+static void *remote_waker_n(void *data)
+{
+	ufiber_t *fibers = data;
+
+	for (long i = 0; i < NR_REMOTE; i++)
+		ufiber_wake_remote(fibers[i], (void*) i);
+	return NULL;
+}
+
+static void *uf_remote(void *data)
+{
+	pthread_t thread;
+	void *value = NULL;
+
+	ck_assert_int_eq(pthread_create(&thread, NULL, remote_waker,
+				ufiber_self()), 0);
+	ck_assert_int_eq(ufiber_wait_remote(&value), 0);
+	pthread_join(thread, NULL);
+	return value;
+}
+
+static void *uf_remote_wait(void *data)
+{
+	void *value;
+
+	ck_assert_int_eq(ufiber_wait_remote(&value), 0);
+	counter++;
+	return value;
+}
+
+START_TEST(test_ufiber_remote)
+{
+	ufiber_t fid[NR_REMOTE];
+	pthread_t thread;
+	void *rv;
+
+	/* nothing else to run: the scheduler sleeps until the wakeup */
+	ck_ufiber_create(&fid[0], 0, uf_remote, NULL);
+	ck_ufiber_join(fid[0], &rv);
+	ck_assert_ptr_eq(rv, (void*) 42L);
+
+	/* a wakeup that comes first is kept for the next wait */
+	ck_assert_int_eq(ufiber_wake_remote(ufiber_self(), (void*) 1L), 0);
+	ck_assert_int_eq(ufiber_wake_remote(ufiber_self(), (void*) 2L), EBUSY);
+	ck_assert_int_eq(ufiber_wait_remote(&rv), 0);
+	ck_assert_ptr_eq(rv, (void*) 1L);
+
+	/* wakeups are taken in while other fibers keep running */
+	counter = 0;
+	for (int i = 0; i < NR_REMOTE; i++)
+		ck_ufiber_create(&fid[i], 0, uf_remote_wait, NULL);
+	ck_assert_int_eq(pthread_create(&thread, NULL, remote_waker_n, fid), 0);
+	while (counter < NR_REMOTE)
+		ufiber_yield();
+	pthread_join(thread, NULL);
+	for (long i = 0; i < NR_REMOTE; i++) {
+		ck_ufiber_join(fid[i], &rv);
+		ck_assert_ptr_eq(rv, (void*) i);
+	}
+}
+END_TEST
+
+static pthread_mutex_t offload_gate = PTHREAD_MUTEX_INITIALIZER;
+
+/* runs on an offload thread: wait for the gate to open */
+static void *offload_fn(void *data)
+{
+	pthread_mutex_lock(&offload_gate);
+	pthread_mutex_unlock(&offload_gate);
+	return (char*) data + 1;
+}
+
+static void *uf_offload(void *data)
+{
+	void *rv;
+
+	ck_assert_int_eq(ufiber_offload(offload_fn, data, &rv), 0);
+	return rv;
+}
+
+/* make a call, then return the next two remote wakeups added up */
+static void *uf_offload_remote(void *data)
+{
+	void *rv, *rv2;
+
+	ck_assert_int_eq(ufiber_offload(offload_fn, data, &rv), 0);
+	ck_assert_ptr_eq(rv, (void*) ((char*) data + 1));
+	ck_assert_int_eq(ufiber_wait_remote(&rv), 0);
+	ck_assert_ptr_eq(rv, (void*) 42L);
+	ck_assert_int_eq(ufiber_wait_remote(&rv2), 0);
+	ck_assert_ptr_eq(rv2, (void*) 43L);
+	return (char*) rv + (long) rv2;
+}
+
+static int offload_sent;
+
+/* runs on a thread of its own: send two wakeups, the second as soon as the
+ * first has been taken */
+static void *offload_sender(void *data)
+{
+	int error;
+
+	ck_assert_int_eq(ufiber_wake_remote(data, (void*) 42L), 0);
+	__atomic_store_n(&offload_sent, 1, __ATOMIC_RELEASE);
+	while ((error = ufiber_wake_remote(data, (void*) 43L)) == EBUSY)
+		sched_yield();
+	ck_assert_int_eq(error, 0);
+	return NULL;
+}
+
+static unsigned offload_running(void)
+{
+	struct ufiber_offload_stats stats;
+
+	ufiber_offload_stats(&stats);
+	return stats.running;
+}
+
+START_TEST(test_ufiber_offload)
+{
+	struct ufiber_offload_stats stats;
+	ufiber_t fid[NR_FIBERS];
+	pthread_t thread;
+	void *rv;
+
+	ck_assert_int_eq(ufiber_offload_setsize(0, 1), EINVAL);
+	ck_assert_int_eq(ufiber_offload(offload_fn, (void*) 1L, &rv), 0);
+	ck_assert_ptr_eq(rv, (void*) 2L);
+
+	/* a call made from a shared stack can't be kept on it */
+	ck_ufiber_create(&fid[0], UFIBER_SHARED_STACK, uf_offload, (void*) 5L);
+	ck_ufiber_join(fid[0], &rv);
+	ck_assert_ptr_eq(rv, (void*) 6L);
+
+	/* the scheduler keeps running fibers while calls are blocked */
+	pthread_mutex_lock(&offload_gate);
+	for (long i = 0; i < NR_FIBERS; i++)
+		ck_ufiber_create(&fid[i], 0, uf_offload, (void*) (i * 10));
+	counter = 0;
+	while (offload_running() < 4) {
+		counter++;
+		ufiber_yield();
+	}
+	ck_assert_int_gt(counter, 0);
+	pthread_mutex_unlock(&offload_gate);
+	for (long i = 0; i < NR_FIBERS; i++) {
+		ck_ufiber_join(fid[i], &rv);
+		ck_assert_ptr_eq(rv, (void*) (i * 10 + 1));
+	}
+
+	/* with one thread busy and the queue full, calls are refused */
+	ck_assert_int_eq(ufiber_offload_setsize(1, 1), 0);
+	pthread_mutex_lock(&offload_gate);
+	ck_ufiber_create(&fid[0], 0, uf_offload, NULL);
+	while (offload_running() < 1)
+		ufiber_yield();
+	ck_ufiber_create(&fid[1], 0, uf_offload, NULL);
+	ufiber_yield();
+	ck_assert_int_eq(ufiber_offload(offload_fn, NULL, &rv), EAGAIN);
+	pthread_mutex_unlock(&offload_gate);
+	ck_ufiber_join(fid[0], NULL);
+	ck_ufiber_join(fid[1], NULL);
+
+	ufiber_offload_stats(&stats);
+	ck_assert_int_eq(stats.calls, NR_FIBERS + 4);
+	ck_assert_int_eq(stats.rejected, 1);
+	ck_assert_int_eq(stats.threads, 1);
+	ck_assert_int_eq(stats.depth, 1);
+	ck_assert_int_eq(stats.queued + stats.running, 0);
+	ck_assert(stats.max_latency_ns >= stats.max_run_ns);
+	ck_assert(stats.latency_ns >= stats.wait_ns + stats.run_ns);
+	ck_assert_int_eq(ufiber_offload_setsize(4, 256), 0);
+
+	/* remote wakeups sent during a call are left for the fiber to take;
+	 * none of them is used up or lost */
+	pthread_mutex_lock(&offload_gate);
+	ck_ufiber_create(&fid[0], 0, uf_offload_remote, (void*) 7L);
+	while (offload_running() < 1)
+		ufiber_yield();
+	ck_assert_int_eq(pthread_create(&thread, NULL, offload_sender, fid[0]),
+			0);
+	while (!__atomic_load_n(&offload_sent, __ATOMIC_ACQUIRE))
+		ufiber_yield();
+	ufiber_yield();
+	ck_assert_int_eq(ufiber_wake_remote(fid[0], (void*) 1L), EBUSY);
+	pthread_mutex_unlock(&offload_gate);
+	ck_ufiber_join(fid[0], &rv);
+	ck_assert_ptr_eq(rv, (void*) 85L);
+	pthread_join(thread, NULL);
+}
+END_TEST
+
+static char prio_order[8];
+static int prio_pos;
+
+static void *uf_prio(void *data)
+{
+	prio_order[prio_pos++] = (long) data;
+	return NULL;
+}
+
+static void *uf_prio_wait(void *data)
+{
+	ufiber_cond_wait(&cond, NULL);
+	return uf_prio(data);
+}
+
+static ufiber_t ck_ufiber_create_prio(int prio, void *(*fn)(void*),
+		long data)
+{
+	ufiber_attr_t attr;
+	ufiber_t fiber;
+
+	ufiber_attr_init(&attr);
+	ck_assert_int_eq(ufiber_attr_setprio(&attr, prio), 0);
+	ck_assert_int_eq(ufiber_create_attr(&fiber, &attr, fn, (void*) data),
+			0);
+	ufiber_attr_destroy(&attr);
+	return fiber;
+}
+
+START_TEST(test_ufiber_prio)
+{
+	ufiber_attr_t attr;
+	ufiber_t fid[3];
+
+	/* the highest priority ready fiber runs first; lower priority fibers
+	 * only run when nothing of higher priority is ready */
+	memset(prio_order, 0, sizeof(prio_order));
+	prio_pos = 0;
+	fid[0] = ck_ufiber_create_prio(5, uf_prio, 'l');
+	fid[1] = ck_ufiber_create_prio(UFIBER_PRIO_DEFAULT, uf_prio, 'd');
+	fid[2] = ck_ufiber_create_prio(20, uf_prio, 'h');
+	ufiber_yield();
+	ck_assert(!strcmp(prio_order, "hd"));
+	for (int i = 0; i < 3; i++)
+		ck_ufiber_join(fid[i], NULL);
+	ck_assert(!strcmp(prio_order, "hdl"));
+
+	/* woken fibers are queued by priority */
+	memset(prio_order, 0, sizeof(prio_order));
+	prio_pos = 0;
+	ufiber_cond_init(&cond);
+	fid[0] = ck_ufiber_create_prio(1, uf_prio_wait, 'l');
+	fid[1] = ck_ufiber_create_prio(10, uf_prio_wait, 'm');
+	fid[2] = ck_ufiber_create_prio(30, uf_prio_wait, 'h');
+	for (int i = 0; i < 3; i++)
+		ufiber_yield_to(fid[i]);
+	ufiber_cond_broadcast(&cond);
+	for (int i = 0; i < 3; i++)
+		ck_ufiber_join(fid[i], NULL);
+	ck_assert(!strcmp(prio_order, "hml"));
+
+	/* changing the priority of a ready fiber moves it */
+	memset(prio_order, 0, sizeof(prio_order));
+	prio_pos = 0;
+	ck_ufiber_create(&fid[0], 0, uf_prio, (void*) 'a');
+	ck_ufiber_create(&fid[1], 0, uf_prio, (void*) 'b');
+	ck_assert_int_eq(ufiber_getprio(fid[1]), UFIBER_PRIO_DEFAULT);
+	ck_assert_int_eq(ufiber_setprio(fid[1], UFIBER_PRIO_MAX), 0);
+	ck_assert_int_eq(ufiber_getprio(fid[1]), UFIBER_PRIO_MAX);
+	ck_assert_int_eq(ufiber_setprio(fid[1], UFIBER_PRIO_MAX + 1), EINVAL);
+	ck_ufiber_join(fid[0], NULL);
+	ck_ufiber_join(fid[1], NULL);
+	ck_assert(!strcmp(prio_order, "ba"));
+
+	ufiber_attr_init(&attr);
+	ck_assert_int_eq(ufiber_attr_setprio(&attr, -1), EINVAL);
+	ufiber_attr_destroy(&attr);
+}
+END_TEST
+
+static ufiber_key_t fls_keys[12];
+static int fls_destroyed;
+
+static void fls_destructor(void *value)
+{
+	fls_destroyed += *(int*)value;
+}
+
+static void *uf_fls(void *data)
+{
+	for (int i = 0; i < 12; i++)
+		ck_assert_ptr_eq(ufiber_getspecific(fls_keys[i]), NULL);
+	for (int i = 0; i < 12; i++)
+		ck_assert_int_eq(ufiber_setspecific(fls_keys[i], data), 0);
+	ufiber_yield();
+	for (int i = 0; i < 12; i++)
+		ck_assert_ptr_eq(ufiber_getspecific(fls_keys[i]), data);
+	return NULL;
+}
+
+START_TEST(test_ufiber_fls)
+{
+	int values[NR_FIBERS];
+	ufiber_t fid[NR_FIBERS];
+	ufiber_key_t key;
+
+	/* some keys live in the TCB, and some in the spill block */
+	fls_destroyed = 0;
+	for (int i = 0; i < 12; i++)
+		ck_assert_int_eq(ufiber_key_create(&fls_keys[i],
+					fls_destructor), 0);
+	for (int i = 0; i < NR_FIBERS; i++) {
+		values[i] = 1;
+		ck_ufiber_create(&fid[i], 0, uf_fls, &values[i]);
+	}
+	for (int i = 0; i < NR_FIBERS; i++)
+		ck_ufiber_join(fid[i], NULL);
+	ck_assert_int_eq(fls_destroyed, 12 * NR_FIBERS);
+
+	/* cached TCBs come back with their values cleared, and destructors
+	 * of deleted keys are not run */
+	fls_destroyed = 0;
+	ck_assert_int_eq(ufiber_key_delete(fls_keys[11]), 0);
+	ck_assert_int_eq(ufiber_key_delete(fls_keys[11]), EINVAL);
+	ck_ufiber_create(&fid[0], 0, uf_fls, &values[0]);
+	ck_ufiber_join(fid[0], NULL);
+	ck_assert_int_eq(fls_destroyed, 11);
+
+	/* new keys never reuse the index of a deleted key */
+	ck_assert_int_eq(ufiber_key_create(&key, NULL), 0);
+	ck_assert(key != fls_keys[11]);
+	ck_assert_ptr_eq(ufiber_getspecific(key), NULL);
+	ck_assert_int_eq(ufiber_setspecific(UFIBER_KEYS_MAX, NULL), EINVAL);
+}
+END_TEST
+
+#define NR_MESSAGES 1000
+
+static ufiber_chan_t chan;
+
+static void *uf_chan_send(void *data)
+{
+	for (long i = 0; i < NR_MESSAGES; i++)
+		ck_assert_int_eq(ufiber_chan_send(&chan, (void*) i), 0);
+	ufiber_chan_close(&chan);
+	return NULL;
+}
+
+static void *uf_chan_recv(void *data)
+{
+	void *value;
+	long i;
+
+	for (i = 0; ufiber_chan_recv(&chan, &value) == 0; i++)
+		ck_assert_ptr_eq(value, (void*) i);
+	ck_assert_int_eq(i, NR_MESSAGES);
+	return NULL;
+}
+
+static void *uf_chan_closed(void *data)
+{
+	void *value;
+
+	ck_assert_int_eq(ufiber_chan_recv(&chan, &value), EPIPE);
+	return NULL;
+}
+
+START_TEST(test_ufiber_chan)
+{
+	static const unsigned sizes[] = { 0, 1, 16 };
+	ufiber_t fid[2];
+	void *value;
+
+	/* values arrive in order, whichever side blocks */
+	for (unsigned i = 0; i < 3; i++) {
+		for (unsigned flags = 0; flags <= UFIBER_CHAN_SWITCH; flags++) {
+			ck_assert_int_eq(ufiber_chan_init(&chan, sizes[i],
+						flags), 0);
+			ck_ufiber_create(&fid[0], 0, uf_chan_recv, NULL);
+			ck_ufiber_create(&fid[1], 0, uf_chan_send, NULL);
+			ck_ufiber_join(fid[0], NULL);
+			ck_ufiber_join(fid[1], NULL);
+			ufiber_chan_destroy(&chan);
+		}
+	}
+
+	/* non-blocking operations, and draining a closed channel */
+	ck_assert_int_eq(ufiber_chan_init(&chan, 2, 0), 0);
+	ck_assert_int_eq(ufiber_chan_tryrecv(&chan, &value), EAGAIN);
+	ck_assert_int_eq(ufiber_chan_trysend(&chan, (void*) 1L), 0);
+	ck_assert_int_eq(ufiber_chan_trysend(&chan, (void*) 2L), 0);
+	ck_assert_int_eq(ufiber_chan_trysend(&chan, (void*) 3L), EAGAIN);
+	ufiber_chan_close(&chan);
+	ck_assert_int_eq(ufiber_chan_send(&chan, (void*) 3L), EPIPE);
+	ck_assert_int_eq(ufiber_chan_recv(&chan, &value), 0);
+	ck_assert_ptr_eq(value, (void*) 1L);
+	ck_assert_int_eq(ufiber_chan_tryrecv(&chan, &value), 0);
+	ck_assert_ptr_eq(value, (void*) 2L);
+	ck_assert_int_eq(ufiber_chan_recv(&chan, &value), EPIPE);
+	ufiber_chan_destroy(&chan);
+
+	/* closing wakes blocked receivers */
+	ck_assert_int_eq(ufiber_chan_init(&chan, 0, 0), 0);
+	ck_assert_int_eq(ufiber_chan_trysend(&chan, NULL), EAGAIN);
+	ck_ufiber_create(&fid[0], 0, uf_chan_closed, NULL);
+	ufiber_yield();
+	ufiber_chan_close(&chan);
+	ck_ufiber_join(fid[0], NULL);
+	ufiber_chan_destroy(&chan);
+}
+END_TEST
+
+static void *uf_attr(void *data)
+{
+	char buf[32 * 1024];
+
+	memset(buf, 0, sizeof(buf));
+	ck_assert(!strcmp(ufiber_getname(ufiber_self()), "attr"));
+	counter = 1;
+	return data;
+}
+
+START_TEST(test_ufiber_attr)
+{
+	static long stack[64 * 1024 / sizeof(long)];
+	ufiber_attr_t attr;
+	ufiber_t fid;
+	size_t size;
+	void *retval;
+	int detached;
+
+	ufiber_attr_init(&attr);
+	ck_assert_int_eq(ufiber_attr_setstacksize(&attr, 1), EINVAL);
+	ck_assert_int_eq(ufiber_attr_setstacksize(&attr, 48 * 1024), 0);
+	ufiber_attr_getstacksize(&attr, &size);
+	ck_assert_int_eq(size, 48 * 1024);
+	ufiber_attr_setname(&attr, "attr");
+
+	counter = 0;
+	if (ufiber_create_attr(&fid, &attr, uf_attr, &counter))
+		ck_abort_msg("ufiber_create_attr() failed");
+	ck_ufiber_join(fid, &retval);
+	ck_assert_int_eq(counter, 1);
+	ck_assert_ptr_eq(retval, &counter);
+
+	/* caller-supplied stack */
+	ck_assert_int_eq(ufiber_attr_setstack(&attr, stack, sizeof(stack)), 0);
+	counter = 0;
+	if (ufiber_create_attr(&fid, &attr, uf_attr, &counter))
+		ck_abort_msg("ufiber_create_attr() failed");
+	ck_ufiber_join(fid, NULL);
+	ck_assert_int_eq(counter, 1);
+
+	/* detached */
+	ck_assert_int_eq(ufiber_attr_setdetachstate(&attr, UFIBER_DETACHED), 0);
+	ufiber_attr_getdetachstate(&attr, &detached);
+	ck_assert_int_eq(detached, UFIBER_DETACHED);
+	counter = 0;
+	if (ufiber_create_attr(NULL, &attr, uf_attr, &counter))
+		ck_abort_msg("ufiber_create_attr() failed");
+	ufiber_yield();
+	ck_assert_int_eq(counter, 1);
+	ufiber_attr_destroy(&attr);
+}
+END_TEST
+
+START_TEST(test_ufiber_cache)
+{
+	ufiber_t fid[NR_FIBERS];
+
+	ck_assert_int_eq(ufiber_set_cache_size(0), EINVAL);
+	ck_assert_int_eq(ufiber_set_cache_size(2), 0);
+	for (int i = 0; i < NR_FIBERS; i++)
+		ck_ufiber_create(&fid[i], 0, uf_yield, NULL);
+	for (int i = 0; i < NR_FIBERS; i++)
+		ck_ufiber_join(fid[i], NULL);
+	ck_assert_int_eq(ufiber_set_cache_size(1), 0);
+	ck_ufiber_create(&fid[0], 0, uf_yield, NULL);
+	ck_ufiber_join(fid[0], NULL);
+}
+END_TEST
+
+static char *volatile stack_sink;
+
+static void *uf_stack(void *data)
+{
+	char buf[32 * 1024];
+
+	memset(buf, 1, sizeof(buf));
+	stack_sink = buf;
+	ufiber_yield();
+	return NULL;
+}
+
+START_TEST(test_ufiber_mem_stats)
+{
+	struct ufiber_mem_stats before, after;
+	ufiber_attr_t attr;
+	ufiber_t fid;
+	size_t used;
+	int error;
+
+	/* the default stack size is smaller with splitstack=y */
+	ufiber_attr_init(&attr);
+	ufiber_attr_setstacksize(&attr, 8 * 1024 * 1024);
+
+	ck_assert_int_eq(ufiber_mem_stats(&before), 0);
+	if (ufiber_create_attr(&fid, &attr, uf_stack, NULL))
+		ck_abort_msg("ufiber_create_attr() failed");
+	ufiber_yield();
+	ck_assert_int_eq(ufiber_mem_stats(&after), 0);
+	ck_assert_int_eq(after.fibers, before.fibers + 1);
+	ck_assert_int_eq(after.tcbs_live, before.tcbs_live + 1);
+	ck_assert(after.stack_reserved >= 8 * 1024 * 1024);
+	ck_assert(after.stack_committed >= 32 * 1024);
+	ck_assert(after.stack_committed <= after.stack_reserved);
+
+	/* without stackpaint=y, there is no usage to report */
+	error = ufiber_stack_usage(fid, &used);
+	if (error == ENOSYS) {
+		ck_ufiber_join(fid, NULL);
+		return;
+	}
+	ck_assert_int_eq(error, 0);
+	ck_assert(used >= 32 * 1024 && used < 64 * 1024);
+	ck_assert_int_eq(ufiber_stack_usage(ufiber_self(), &used), EINVAL);
+	ck_ufiber_join(fid, NULL);
+
+	ufiber_mem_stats(&after);
+	ck_assert(after.stack_max_usage >= 32 * 1024);
+	ck_assert_int_eq(after.tcbs_cached, 1);
+
+	/* a reused stack is repainted */
+	if (ufiber_create_attr(&fid, &attr, uf_yield, NULL))
+		ck_abort_msg("ufiber_create_attr() failed");
+	ck_assert_int_eq(ufiber_stack_usage(fid, &used), 0);
+	ck_assert(used < 4 * 1024);
+	ck_ufiber_join(fid, NULL);
+	ufiber_attr_destroy(&attr);
+}
+END_TEST
+
+static int count_fiber(ufiber_t fiber, void *data)
+{
+	(*(int*)data)++;
+	return 0;
+}
+
+static int find_fiber(ufiber_t fiber, void *data)
+{
+	return fiber == data;
+}
+
+static void *uf_stats(void *data)
+{
+	ufiber_mutex_t *m = data;
+
+	for (int i = 0; i < 3; i++)
+		ufiber_yield();
+	ufiber_sleep(10);
+	ufiber_mutex_lock(m);
+	ufiber_mutex_unlock(m);
+	return NULL;
+}
+
+START_TEST(test_ufiber_stats)
+{
+	struct ufiber_stats stats;
+	ufiber_mutex_t m;
+	ufiber_t fid;
+	int before = 0, after = 0;
+	int error;
+
+	ufiber_mutex_init(&m);
+	ufiber_mutex_lock(&m);
+	ufiber_foreach(count_fiber, &before);
+	ck_ufiber_create(&fid, 0, uf_stats, &m);
+	ufiber_foreach(count_fiber, &after);
+	ck_assert_int_eq(after, before + 1);
+	ck_assert_int_eq(ufiber_foreach(find_fiber, fid), 1);
+
+	/* without stats=y, there is nothing to report */
+	error = ufiber_stats(fid, &stats);
+	if (error == ENOSYS) {
+		ufiber_mutex_unlock(&m);
+		ck_ufiber_join(fid, NULL);
+		return;
+	}
+	ck_assert_int_eq(error, 0);
+	ck_assert_int_eq(stats.switches, 0);
+	ck_assert_int_eq(stats.waiting, -1);
+
+	/* let it yield, sleep, and block on the mutex */
+	ufiber_sleep(30);
+	ufiber_stats(fid, &stats);
+	ck_assert_int_eq(stats.yields, 3);
+	ck_assert_int_eq(stats.blocks, 2);
+	ck_assert_int_eq(stats.waiting, UFIBER_WAIT_MUTEX);
+	ck_assert_int_eq(stats.switches, 1); // it woke from its sleep in place
+	ck_assert(stats.run_ns > 0);
+	ck_assert(stats.blocked_ns[UFIBER_WAIT_SLEEP] >= 10000000);
+	ck_assert(stats.blocked_ns[UFIBER_WAIT_MUTEX] > 0);
+
+	ufiber_mutex_unlock(&m);
+	ck_ufiber_join(fid, NULL);
+	ck_assert_int_eq(ufiber_foreach(find_fiber, fid), 0);
+	ufiber_stats(ufiber_self(), &stats);
+	ck_assert_int_eq(stats.waiting, -1);
+	ck_assert(stats.blocked_ns[UFIBER_WAIT_SLEEP] >= 30000000);
+	ck_assert(stats.run_ns > 0);
+}
+END_TEST
+
+static void *uf_traced(void *data)
+{
+	ufiber_yield();
+	return data;
+}
+
+START_TEST(test_ufiber_trace)
+{
+	struct ufiber_trace_header hdr;
+	struct ufiber_trace_event *events;
+	struct ufiber_trace_name name;
+	unsigned id = UFIBER_TRACE_NONE;
+	int created = 0, ran = 0, blocked = 0, exited = 0;
+	ufiber_attr_t attr;
+	ufiber_t fid;
+	FILE *f;
+	int error;
+
+	ufiber_attr_init(&attr);
+	ufiber_attr_setname(&attr, "traced");
+	ck_assert_int_eq(ufiber_create_attr(&fid, &attr, uf_traced, NULL), 0);
+	ck_ufiber_join(fid, NULL);
+	ufiber_attr_destroy(&attr);
+
+	ck_assert((f = tmpfile()) != NULL);
+	error = ufiber_trace_dump(fileno(f));
+	if (error == ENOSYS) { // built without trace=y
+		fclose(f);
+		return;
+	}
+	ck_assert_int_eq(error, 0);
+
+	rewind(f);
+	ck_assert_int_eq(fread(&hdr, sizeof(hdr), 1, f), 1);
+	ck_assert(!memcmp(hdr.magic, UFIBER_TRACE_MAGIC, sizeof(hdr.magic)));
+	ck_assert_int_eq(hdr.version, UFIBER_TRACE_VERSION);
+	ck_assert(hdr.nr_events > 0);
+	ck_assert(hdr.ns_per_tick > 0);
+	ck_assert((events = malloc(hdr.nr_events * sizeof(*events))) != NULL);
+	ck_assert_int_eq(fread(events, sizeof(*events), hdr.nr_events, f),
+			hdr.nr_events);
+	for (unsigned long long i = 0; i < hdr.nr_names; i++) {
+		ck_assert_int_eq(fread(&name, sizeof(name), 1, f), 1);
+		if (!strcmp(name.name, "traced"))
+			id = name.fiber;
+	}
+	ck_assert(id != UFIBER_TRACE_NONE && id != 0);
+
+	/* events are in order: created by us, run, exit, and our join */
+	for (unsigned long long i = 0; i < hdr.nr_events; i++) {
+		struct ufiber_trace_event *e = &events[i];
+
+		if (i > 0)
+			ck_assert(e->time >= events[i-1].time);
+		if (e->type == UFIBER_TRACE_CREATE && e->fiber == id) {
+			ck_assert_int_eq(e->other, 0);
+			created++;
+		} else if (created && e->type == UFIBER_TRACE_SWITCH
+				&& e->other == id) {
+			ran++;
+		} else if (created && e->type == UFIBER_TRACE_BLOCK
+				&& e->fiber == 0) {
+			ck_assert_int_eq(e->arg, UFIBER_WAIT_JOIN);
+			blocked++;
+		} else if (ran && e->type == UFIBER_TRACE_EXIT) {
+			ck_assert_int_eq(e->fiber, id);
+			exited++;
+		}
+	}
+	ck_assert_int_eq(created, 1);
+	ck_assert_int_eq(ran, 1); // its yield returns at once: we are blocked
+	ck_assert_int_eq(blocked, 1);
+	ck_assert_int_eq(exited, 1);
+	free(events);
+	fclose(f);
+}
+END_TEST
+
+static void *uf_task(void *data)
+{
+	int *n = data;
+
+	ufiber_yield();
+	counter++;
+	return (void*)(long) (*n * 2);
+}
+
+static int nr_fibers(void)
+{
+	int n = 0;
+
+	ufiber_foreach(count_fiber, &n);
+	return n;
+}
+
+START_TEST(test_ufiber_pool)
+{
+	ufiber_task_t task[NR_FIBERS];
+	ufiber_pool_t pool;
+	int uid[NR_FIBERS];
+	int before = nr_fibers();
+	void *retval;
+
+	ck_assert_int_eq(ufiber_pool_init(&pool, 0, NULL), EINVAL);
+	ck_assert_int_eq(ufiber_pool_init(&pool, 4, NULL), 0);
+	ck_assert_int_eq(nr_fibers(), before + 4);
+
+	/* more tasks than workers: the workers are reused */
+	counter = 0;
+	for (int i = 0; i < NR_FIBERS; i++) {
+		uid[i] = i;
+		ck_assert_int_eq(ufiber_pool_submit(&pool, &task[i], uf_task,
+					&uid[i]), 0);
+	}
+	for (int i = 0; i < NR_FIBERS; i++) {
+		ck_assert_int_eq(ufiber_task_join(&task[i], &retval), 0);
+		ck_assert_int_eq((long) retval, i * 2);
+	}
+	ck_assert_int_eq(counter, NR_FIBERS);
+	ck_assert_int_eq(nr_fibers(), before + 4);
+
+	/* a finished task can be joined again, and resubmitted */
+	ck_assert_int_eq(ufiber_task_join(&task[1], &retval), 0);
+	ck_assert_int_eq((long) retval, 2);
+	ck_assert_int_eq(ufiber_pool_submit(&pool, &task[1], uf_task, &uid[3]),
+			0);
+	ck_assert_int_eq(ufiber_task_join(&task[1], &retval), 0);
+	ck_assert_int_eq((long) retval, 6);
+
+	/* grow, shrink, and drain without joining */
+	ck_assert_int_eq(ufiber_pool_resize(&pool, 8), 0);
+	ck_assert_int_eq(nr_fibers(), before + 8);
+	counter = 0;
+	for (int i = 0; i < NR_FIBERS; i++)
+		ufiber_pool_submit(&pool, &task[i], uf_task, &uid[i]);
+	ck_assert_int_eq(ufiber_pool_resize(&pool, 2), 0);
+	ck_assert_int_eq(ufiber_pool_drain(&pool), 0);
+	ck_assert_int_eq(counter, NR_FIBERS);
+	ufiber_yield(); // let the surplus workers exit
+	ck_assert_int_eq(nr_fibers(), before + 2);
+
+	/* queued tasks still run on shutdown */
+	counter = 0;
+	for (int i = 0; i < NR_FIBERS; i++)
+		ufiber_pool_submit(&pool, &task[i], uf_task, &uid[i]);
+	ck_assert_int_eq(ufiber_pool_destroy(&pool), 0);
+	ck_assert_int_eq(counter, NR_FIBERS);
+	ck_assert_int_eq(nr_fibers(), before);
+	ck_assert_int_eq(ufiber_pool_submit(&pool, &task[0], uf_task, &uid[0]),
+			EPIPE);
+}
+END_TEST
+
+static ufiber_promise_t promises[4];
+
+static void *uf_promise(void *data)
+{
+	int i = *(int*)data;
+
+	for (int j = 0; j < i; j++)
+		ufiber_yield();
+	ck_assert_int_eq(ufiber_promise_set(&promises[i], data), 0);
+	return NULL;
+}
+
+static void *uf_future_get(void *data)
+{
+	void *value;
+
+	ck_assert_int_eq(ufiber_future_get(data, &value), 0);
+	return value;
+}
+
+static void *uf_wait_all(void *data)
+{
+	ck_assert_int_eq(ufiber_wait_all(data, 2), 0);
+	return NULL;
+}
+
+START_TEST(test_ufiber_future)
+{
+	ufiber_future_t *futures[NR_FIBERS];
+	ufiber_t fid[NR_FIBERS];
+	int uid[4] = { 0, 1, 2, 3 };
+	unsigned index;
+	void *value;
+
+	for (int i = 0; i < 4; i++) {
+		ufiber_promise_init(&promises[i]);
+		futures[i] = ufiber_promise_future(&promises[i]);
+	}
+	ck_assert_int_eq(ufiber_future_tryget(futures[0], &value), EAGAIN);
+	ck_assert_int_eq(ufiber_wait_any(futures, 0, &index), EINVAL);
+	ck_assert_int_eq(ufiber_wait_all(futures, 0), 0);
+
+	/* the first to be set wins, even if it's not the first listed */
+	ck_ufiber_create(&fid[0], UFIBER_DETACHED, uf_promise, &uid[3]);
+	ck_ufiber_create(&fid[0], UFIBER_DETACHED, uf_promise, &uid[2]);
+	ck_assert_int_eq(ufiber_wait_any(futures + 1, 3, &index), 0);
+	ck_assert_int_eq(index, 1); // futures[2]
+	ck_assert_int_eq(ufiber_future_tryget(futures[2], &value), 0);
+	ck_assert_ptr_eq(value, &uid[2]);
+	ck_assert_int_eq(ufiber_promise_set(&promises[2], NULL), EINVAL);
+
+	/* a set future is returned at once */
+	ck_assert_int_eq(ufiber_wait_any(futures + 1, 3, &index), 0);
+	ck_assert_int_eq(index, 1);
+
+	/* several getters, and a wait for all, on the same futures */
+	for (int i = 0; i < 4; i++)
+		ck_ufiber_create(&fid[i], 0, uf_future_get, futures[i & 1]);
+	ck_ufiber_create(NULL, 0, uf_promise, &uid[1]);
+	ck_ufiber_create(NULL, 0, uf_promise, &uid[0]);
+	ufiber_yield(); // let the getters block
+	ck_assert_int_eq(ufiber_promise_destroy(&promises[1]), EBUSY);
+	ck_assert_int_eq(ufiber_wait_all(futures, 4), 0);
+	for (int i = 0; i < 4; i++) {
+		ck_ufiber_join(fid[i], &value);
+		ck_assert_ptr_eq(value, &uid[i & 1]);
+	}
+	for (int i = 0; i < 4; i++)
+		ck_assert_int_eq(ufiber_promise_destroy(&promises[i]), 0);
+
+	/* more futures than fit on the stack, some listed twice */
+	for (int i = 0; i < NR_FIBERS; i++)
+		futures[i] = ufiber_promise_future(&promises[i % 4]);
+	for (int i = 0; i < 4; i++)
+		ufiber_promise_init(&promises[i]);
+	for (int i = 0; i < 4; i++)
+		ck_ufiber_create(NULL, 0, uf_promise, &uid[i]);
+	ck_assert_int_eq(ufiber_wait_any(futures + 1, NR_FIBERS - 1, &index),
+			0);
+	ck_assert_int_eq((index + 1) % 4, 0);
+	ck_assert_int_eq(ufiber_wait_all(futures, NR_FIBERS), 0);
+	for (int i = 0; i < 4; i++)
+		ck_assert_int_eq(ufiber_promise_destroy(&promises[i]), 0);
+
+	/* a waiter on a shared stack */
+	ufiber_promise_init(&promises[0]);
+	ufiber_promise_init(&promises[1]);
+	ck_ufiber_create(&fid[0], UFIBER_SHARED_STACK, uf_wait_all, futures);
+	ck_ufiber_create(NULL, 0, uf_promise, &uid[1]);
+	ck_ufiber_create(NULL, 0, uf_promise, &uid[0]);
+	ck_ufiber_join(fid[0], NULL);
+	ck_assert(futures[0]->ready && futures[1]->ready);
+}
+END_TEST
+
+#define SHARED_DEPTH 8
+
+static long *shared_locals[NR_FIBERS];
+
+/* recurse, leaving pointers to locals behind, and check that the locals are
+ * intact after every yield */
+static long uf_shared_recurse(int id, int depth)
+{
+	long local = id * 100 + depth;
+	long sum;
+
+	shared_locals[id] = &local;
+	ufiber_yield();
+	ck_assert_ptr_eq(shared_locals[id], &local);
+	ck_assert_int_eq(local, id * 100 + depth);
+	sum = depth ? uf_shared_recurse(id, depth - 1) : 0;
+	ck_assert_int_eq(local, id * 100 + depth);
+	return sum + local;
+}
+
+static void *uf_shared(void *data)
+{
+	int id = *((int*)data);
+	char buf[4096];
+
+	memset(buf, id, sizeof(buf));
+	stack_sink = buf;
+	uf_shared_recurse(id, id % SHARED_DEPTH);
+	for (size_t i = 0; i < sizeof(buf); i++)
+		ck_assert_int_eq(buf[i], (char) id);
+	return data;
+}
+
+START_TEST(test_ufiber_shared_stack)
+{
+	static long stack[64 * 1024 / sizeof(long)];
+	struct ufiber_mem_stats stats;
+	int uid[NR_FIBERS];
+	ufiber_t fid[NR_FIBERS];
+	ufiber_attr_t attr;
+	void *retval;
+	int shared;
+
+	ufiber_attr_init(&attr);
+	ufiber_attr_getsharedstack(&attr, &shared);
+	ck_assert_int_eq(shared, 0);
+	ufiber_attr_setsharedstack(&attr, 1);
+	ufiber_attr_getsharedstack(&attr, &shared);
+	ck_assert_int_eq(shared, 1);
+
+	/* every other fiber has a stack of its own */
+	for (int i = 0; i < NR_FIBERS; i++) {
+		uid[i] = i;
+		if (i % 2)
+			ck_ufiber_create(&fid[i], 0, uf_shared, &uid[i]);
+		else if (ufiber_create_attr(&fid[i], &attr, uf_shared, &uid[i]))
+			ck_abort_msg("ufiber_create_attr() failed");
+	}
+	ufiber_yield();
+	ufiber_mem_stats(&stats);
+	ck_assert(stats.stack_saved > 0);
+	for (int i = 0; i < NR_FIBERS; i++) {
+		ck_assert_int_eq(ufiber_join(fid[i], &retval), 0);
+		ck_assert_ptr_eq(retval, &uid[i]);
+	}
+
+	/* a shared stack can't also be caller-supplied */
+	ck_assert_int_eq(ufiber_attr_setstack(&attr, stack, sizeof(stack)), 0);
+	ufiber_attr_setsharedstack(&attr, 1);
+	ck_assert_int_eq(ufiber_create_attr(&fid[0], &attr, uf_shared, uid),
+			EINVAL);
+	ufiber_attr_destroy(&attr);
+
+	ck_ufiber_create(&fid[0], UFIBER_SHARED_STACK, uf_yield, NULL);
+	ck_ufiber_join(fid[0], NULL);
+}
+END_TEST
+
+#if UFIBER_SPLIT_STACK
+#define SPLIT_DEPTH 1024
+
+/* use about 1 KiB of stack per level, yielding now and then */
+static long uf_split_recurse(int depth)
+{
+	char buf[1024];
+	long sum;
+
+	memset(buf, depth, sizeof(buf));
+	stack_sink = buf;
+	if (depth % 64 == 0)
+		ufiber_yield();
+	sum = depth ? uf_split_recurse(depth - 1) : 0;
+	ck_assert_int_eq(buf[depth % sizeof(buf)], (char) depth);
+	return sum + depth;
+}
+
+static void *uf_split(void *data)
+{
+	*((long*)data) = uf_split_recurse(SPLIT_DEPTH);
+	return NULL;
+}
+
+START_TEST(test_ufiber_split_stack)
+{
+	struct ufiber_mem_stats stats;
+	long sum[NR_FIBERS];
+	ufiber_t fid[NR_FIBERS];
+	ufiber_attr_t attr;
+
+	/* 16 KiB stacks grow past 1 MiB, twice (the second time reused) */
+	ufiber_attr_init(&attr);
+	ufiber_attr_setstacksize(&attr, 16 * 1024);
+	for (int round = 0; round < 2; round++) {
+		for (int i = 0; i < NR_FIBERS; i++) {
+			sum[i] = 0;
+			if (ufiber_create_attr(&fid[i], &attr, uf_split,
+						&sum[i]))
+				ck_abort_msg("ufiber_create_attr() failed");
+		}
+
+		/* segments don't end on page boundaries */
+		ufiber_yield();
+		ck_assert_int_eq(ufiber_mem_stats(&stats), 0);
+		ck_assert(stats.stack_committed > 0);
+
+		for (int i = 0; i < NR_FIBERS; i++) {
+			ck_ufiber_join(fid[i], NULL);
+			ck_assert_int_eq(sum[i],
+					SPLIT_DEPTH * (SPLIT_DEPTH + 1) / 2);
+		}
+	}
+	ufiber_attr_destroy(&attr);
+}
+END_TEST
+#endif
+
+static void *uf_worker_child(void *data)
+{
+	ufiber_mutex_t *m = data;
+
+	ufiber_mutex_lock(m);
+	ufiber_yield();
+	ufiber_mutex_unlock(m);
+	return NULL;
+}
+
+static void *uf_worker_detached(void *data)
+{
+	ufiber_yield();
+	__atomic_fetch_or((int*)data, 1 << ufiber_worker_id(), __ATOMIC_SEQ_CST);
+	return NULL;
+}
+
+static void *uf_worker(void *data)
+{
+	ufiber_mutex_t m;
+	ufiber_t fid[NR_FIBERS];
+
+	ufiber_mutex_init(&m);
+	for (int i = 0; i < NR_FIBERS; i++)
+		ck_ufiber_create(&fid[i], 0, uf_worker_child, &m);
+	for (int i = 0; i < NR_FIBERS; i++)
+		ck_ufiber_join(fid[i], NULL);
+
+	/* detached fibers must finish before ufiber_run_workers() returns */
+	ck_ufiber_create(NULL, UFIBER_DETACHED, uf_worker_detached, data);
+	return NULL;
+}
+
+START_TEST(test_ufiber_workers)
+{
+	int error;
+
+	counter = 0;
+	error = ufiber_run_workers(4, uf_worker, &counter);
+	if (error == ENOSYS)
+		return;
+	ck_assert_int_eq(error, 0);
+	ck_assert_int_eq(counter, 0xf);
+}
+END_TEST
+
+#define STEAL_DEPTH 3
+#define STEAL_FIBERS (4 * ((2 << STEAL_DEPTH) - 1))
+
+static int steal_mask;
+
+/* spawn two stealable children, unless at the bottom, then keep the worker's
+ * thread busy for a while */
+static void *uf_steal(void *data)
+{
+	long depth = (long) data;
+	struct timespec ts = { 0, 2000000 };
+
+	for (int i = 0; depth > 0 && i < 2; i++)
+		ck_ufiber_create(NULL, UFIBER_STEALABLE, uf_steal,
+				(void*) (depth - 1));
+	nanosleep(&ts, NULL);
+	__atomic_add_fetch(&counter, 1, __ATOMIC_SEQ_CST);
+	__atomic_fetch_or(&steal_mask, 1 << ufiber_worker_id(),
+			__ATOMIC_SEQ_CST);
+	return NULL;
+}
+
+/* worker 0 spawns all of the work; the others have to steal it */
+static void *uf_steal_root(void *data)
+{
+	for (int i = 0; ufiber_worker_id() == 0 && i < 4; i++)
+		ck_ufiber_create(NULL, UFIBER_STEALABLE, uf_steal,
+				(void*) STEAL_DEPTH);
+	return NULL;
+}
+
+START_TEST(test_ufiber_steal)
+{
+	ufiber_t fid;
+	int error;
+
+	/* outside of a worker, stealable fibers are simply detached */
+	ck_assert_int_eq(ufiber_create(&fid, UFIBER_STEALABLE, uf_steal, NULL),
+			EINVAL);
+	counter = 0;
+	ck_ufiber_create(NULL, UFIBER_STEALABLE, uf_steal, (void*) 1L);
+	while (counter < 3)
+		ufiber_yield();
+
+	counter = 0;
+	steal_mask = 0;
+	error = ufiber_run_workers(4, uf_steal_root, NULL);
+	if (error == ENOSYS)
+		return;
+	ck_assert_int_eq(error, 0);
+	ck_assert_int_eq(counter, STEAL_FIBERS);
+	ck_assert_int_ne(steal_mask & ~1, 0);
+}
+END_TEST
+
+#define SHARE_FIBERS 16
+
+struct share {
+	ufiber_mutex_t mutex;
+	ufiber_chan_t chan;
+	int inside;    // fibers holding the mutex
+	int contended; // fibers that had to wait for it
+	int mask;      // workers that ran any of the fibers
+};
+
+/* hold the shared mutex across a sleep that blocks the worker's thread and a
+ * yield, then report our worker over the shared channel */
+static void *uf_share(void *data)
+{
+	struct share *sh = data;
+	struct timespec ts = { 0, 500000 }, abstime;
+	long id = ufiber_worker_id();
+
+	if (ufiber_mutex_trylock(&sh->mutex) == EBUSY) {
+		__atomic_add_fetch(&sh->contended, 1, __ATOMIC_SEQ_CST);
+		clock_gettime(CLOCK_MONOTONIC, &abstime);
+		abstime.tv_sec += 10;
+		ck_assert_int_eq(ufiber_mutex_timedlock(&sh->mutex, &abstime),
+				0);
+	}
+	ck_assert_int_eq(__atomic_add_fetch(&sh->inside, 1, __ATOMIC_SEQ_CST),
+			1);
+	nanosleep(&ts, NULL);
+	ufiber_yield();
+	__atomic_sub_fetch(&sh->inside, 1, __ATOMIC_SEQ_CST);
+	ck_assert_int_eq(ufiber_mutex_unlock(&sh->mutex), 0);
+	ck_assert_int_eq(ufiber_chan_send(&sh->chan, (void*) (id + 1)), 0);
+	return NULL;
+}
+
+/* worker 0 spawns the fibers and collects their reports */
+static void *uf_share_root(void *data)
+{
+	struct share *sh = data;
+	void *id;
+
+	if (ufiber_worker_id() != 0)
+		return NULL;
+	for (int i = 0; i < SHARE_FIBERS; i++)
+		ck_ufiber_create(NULL, UFIBER_STEALABLE, uf_share, sh);
+	for (int i = 0; i < SHARE_FIBERS; i++) {
+		ck_assert_int_eq(ufiber_chan_recv(&sh->chan, &id), 0);
+		sh->mask |= 1 << ((long) id - 1);
+	}
+	return NULL;
+}
+
+/* stolen fibers block on a mutex and a channel shared with fibers in the
+ * worker that spawned them */
+START_TEST(test_ufiber_steal_shared)
+{
+	struct share sh = { .inside = 0, .contended = 0, .mask = 0 };
+	int error;
+
+	ck_assert_int_eq(ufiber_mutex_init(&sh.mutex), 0);
+	ck_assert_int_eq(ufiber_chan_init(&sh.chan, 0, 0), 0);
+	error = ufiber_run_workers(2, uf_share_root, &sh);
+	ufiber_chan_destroy(&sh.chan);
+	ufiber_mutex_destroy(&sh.mutex);
+	if (error == ENOSYS)
+		return;
+	ck_assert_int_eq(error, 0);
+	ck_assert_int_eq(sh.mask, 3);
+	ck_assert_int_gt(sh.contended, 0);
+}
+END_TEST
+
+#ifdef __linux__
+static void *uf_io_read(void *data)
+{
+	char buf[8];
+
+	ck_assert_int_eq(ufiber_read(*(int*)data, buf, sizeof(buf)), 5);
+	ck_assert(!memcmp(buf, "hello", 5));
+	counter = 1;
+	return NULL;
+}
+
+START_TEST(test_ufiber_io_pipe)
+{
+	ufiber_t fid;
+	int fd[2];
+
+	ck_assert_int_eq(pipe(fd), 0);
+	counter = 0;
+	ck_ufiber_create(&fid, 0, uf_io_read, &fd[0]);
+	ufiber_yield();
+	ck_assert_int_eq(counter, 0);
+	ck_assert_int_eq(ufiber_write(fd[1], "hello", 5), 5);
+	ck_ufiber_join(fid, NULL);
+	ck_assert_int_eq(counter, 1);
+	ufiber_close(fd[0]);
+	ufiber_close(fd[1]);
+}
+END_TEST
+
+/* a remote wakeup gets through while another fiber waits for I/O */
+START_TEST(test_ufiber_io_remote)
+{
+	ufiber_t fid[2];
+	void *rv;
+	int fd[2];
+
+	ck_assert_int_eq(pipe(fd), 0);
+	counter = 0;
+	ck_ufiber_create(&fid[0], 0, uf_io_read, &fd[0]);
+	ck_ufiber_create(&fid[1], 0, uf_remote, NULL);
+	ck_ufiber_join(fid[1], &rv);
+	ck_assert_ptr_eq(rv, (void*) 42L);
+	ck_assert_int_eq(counter, 0);
+	ck_assert_int_eq(ufiber_write(fd[1], "hello", 5), 5);
+	ck_ufiber_join(fid[0], NULL);
+	ck_assert_int_eq(counter, 1);
+	ufiber_close(fd[0]);
+	ufiber_close(fd[1]);
+}
+END_TEST
+
+/* write "hello" to the descriptor in 'data' after 200 ms */
+static void *io_writer(void *data)
+{
+	struct timespec ts = { 0, 200000000 };
+
+	nanosleep(&ts, NULL);
+	ck_assert_int_eq(write(*(int*)data, "hello", 5), 5);
+	return NULL;
+}
+
+static long cpu_ms(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000
+		+ (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000;
+}
+
+START_TEST(test_ufiber_io_bell)
+{
+	pthread_t thread;
+	ufiber_t fid;
+	uint64_t one = 1;
+	long start;
+	int fd[2];
+
+	/* ring the doorbell the way a waker that lost the race with the
+	 * scheduler waking up does, then wait for I/O alone: the scheduler
+	 * must not spin on the stale ring */
+	ck_assert_int_eq(pipe(fd), 0);
+	ck_assert_int_eq(_ufiber_remote_prepare(), 0);
+	counter = 0;
+	ck_ufiber_create(&fid, 0, uf_io_read, &fd[0]);
+	ufiber_yield();
+	ck_assert_int_eq(write(_ufiber_doorbell(), &one, sizeof(one)),
+			sizeof(one));
+	ck_assert_int_eq(pthread_create(&thread, NULL, io_writer, &fd[1]), 0);
+	start = cpu_ms();
+	ck_ufiber_join(fid, NULL);
+	ck_assert(cpu_ms() - start < 100);
+	ck_assert_int_eq(counter, 1);
+	pthread_join(thread, NULL);
+	ufiber_close(fd[0]);
+	ufiber_close(fd[1]);
+}
+END_TEST
+
+static void *uf_io_server(void *data)
+{
+	char buf[8];
+	int fd;
+
+	if ((fd = ufiber_accept(*(int*)data, NULL, NULL)) < 0)
+		ck_abort_msg("ufiber_accept() failed");
+	ck_assert_int_eq(ufiber_read(fd, buf, sizeof(buf)), 4);
+	ck_assert_int_eq(ufiber_write(fd, buf, 4), 4);
+	ufiber_close(fd);
+	return NULL;
+}
+
+static void *uf_io_client(void *data)
+{
+	struct sockaddr_in *addr = data;
+	char buf[8];
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (ufiber_connect(fd, (struct sockaddr*) addr, sizeof(*addr)))
+		ck_abort_msg("ufiber_connect() failed");
+	ck_assert_int_eq(ufiber_write(fd, "ping", 4), 4);
+	ck_assert_int_eq(ufiber_read(fd, buf, sizeof(buf)), 4);
+	ck_assert(!memcmp(buf, "ping", 4));
+	ck_assert_int_eq(ufiber_read(fd, buf, sizeof(buf)), 0);
+	ufiber_close(fd);
+	return NULL;
+}
+
+START_TEST(test_ufiber_io_socket)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	ufiber_t server, client;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	ck_assert_int_eq(bind(fd, (struct sockaddr*) &addr, sizeof(addr)), 0);
+	ck_assert_int_eq(listen(fd, 1), 0);
+	getsockname(fd, (struct sockaddr*) &addr, &len);
+
+	ck_ufiber_create(&server, 0, uf_io_server, &fd);
+	ck_ufiber_create(&client, 0, uf_io_client, &addr);
+	ck_ufiber_join(server, NULL);
+	ck_ufiber_join(client, NULL);
+	ufiber_close(fd);
+}
+END_TEST
+
+static void *uf_io_file(void *data)
+{
+	char buf[16];
+	int fd = *(int*)data;
+
+	ck_assert_int_eq(ufiber_pwrite(fd, "0123456789", 10, 0), 10);
+	ck_assert_int_eq(ufiber_pread(fd, buf, sizeof(buf), 4), 6);
+	ck_assert(!memcmp(buf, "456789", 6));
+	counter++;
+	return NULL;
+}
+
+START_TEST(test_ufiber_io_file)
+{
+	char name[] = "/tmp/ufiber-check-XXXXXX";
+	ufiber_t fid[2];
+	int fd;
+
+	ck_assert_int_ge(fd = mkstemp(name), 0);
+	unlink(name);
+	counter = 0;
+	ck_ufiber_create(&fid[0], UFIBER_SHARED_STACK, uf_io_file, &fd);
+	ck_ufiber_create(&fid[1], UFIBER_SHARED_STACK, uf_io_file, &fd);
+	ck_ufiber_join(fid[0], NULL);
+	ck_ufiber_join(fid[1], NULL);
+	ck_assert_int_eq(counter, 2);
+
+	/* counts beyond 32 bits make for a short read, not a truncated one */
+	if (sizeof(size_t) > sizeof(unsigned)) {
+		char *buf = malloc(16);
+
+		ck_assert_int_eq(ufiber_pread(fd, buf, (size_t) UINT_MAX + 2, 4),
+				6);
+		ck_assert(!memcmp(buf, "456789", 6));
+		free(buf);
+	}
+	close(fd);
+}
+END_TEST
+
+static void *uf_io_recv(void *data)
+{
+	char buf[8];
+
+	ck_assert_int_eq(ufiber_recv(*(int*)data, buf, sizeof(buf), 0), 4);
+	ck_assert(!memcmp(buf, "pong", 4));
+	return NULL;
+}
+
+START_TEST(test_ufiber_io_sendrecv)
+{
+	ufiber_t fid;
+	int sv[2];
+
+	ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+	ck_ufiber_create(&fid, 0, uf_io_recv, &sv[0]);
+	ufiber_yield();
+	ck_assert_int_eq(ufiber_send(sv[1], "pong", 4, 0), 4);
+	ck_ufiber_join(fid, NULL);
+	ufiber_close(sv[0]);
+	ufiber_close(sv[1]);
+}
+END_TEST
+
+static void *uf_io_close(void *data)
+{
+	ck_assert_int_eq(ufiber_wait_fd(*(int*)data, UFIBER_POLLIN), EBADF);
+	return NULL;
+}
+
+START_TEST(test_ufiber_io_close)
+{
+	ufiber_t fid;
+	int fd[2];
+
+	ck_assert_int_eq(pipe(fd), 0);
+	ck_ufiber_create(&fid, 0, uf_io_close, &fd[0]);
+	ufiber_yield();
+	ck_assert_int_eq(ufiber_close(fd[0]), 0);
+	ck_ufiber_join(fid, NULL);
+	ufiber_close(fd[1]);
+}
+END_TEST
+#endif
+
+START_TEST(test_deadlock)
+{
+	ufiber_mutex_init(&mutex);
+	ufiber_mutex_lock(&mutex);
+	ck_assert(ufiber_mutex_lock(&mutex) == EDEADLK);
+
+	/* a waiter on a condition nobody can signal gets EDEADLK, and gets
+	 * its mutex back */
+	ufiber_cond_init(&cond);
+	ck_assert_int_eq(ufiber_cond_wait(&cond, NULL), EDEADLK);
+	ck_assert_int_eq(ufiber_cond_wait(&cond, &mutex), EDEADLK);
+	ck_assert_int_eq(ufiber_mutex_trylock(&mutex), EBUSY);
+}
+END_TEST
+
+int main(void)
+{
+	int failed;
+	TCase *tc;
+	Suite *s;
+	SRunner *sr;
+
+	ufiber_init();
+	s = suite_create("ufibers");
+	tc = tcase_create("core");
+	tcase_add_test(tc, test_ufiber_create);
+	tcase_add_test(tc, test_ufiber_create_n);
+	tcase_add_test(tc, test_ufiber_join);
+	tcase_add_test(tc, test_ufiber_self);
+	tcase_add_test(tc, test_ufiber_yield);
+	tcase_add_test(tc, test_ufiber_yield_to);
+	tcase_add_test(tc, test_ufiber_exit);
+	tcase_add_test(tc, test_ufiber_mutex);
+	tcase_add_test(tc, test_ufiber_mutex_policy);
+	tcase_add_test(tc, test_ufiber_barrier);
+	tcase_add_test(tc, test_ufiber_waitgroup);
+	tcase_add_test(tc, test_ufiber_rwlock);
+	tcase_add_test(tc, test_ufiber_cond);
+	tcase_add_test(tc, test_ufiber_sleep);
+	tcase_add_test(tc, test_ufiber_timed);
+	tcase_add_test(tc, test_ufiber_sem);
+	tcase_add_test(tc, test_ufiber_remote);
+	tcase_add_test(tc, test_ufiber_offload);
+	tcase_add_test(tc, test_ufiber_prio);
+	tcase_add_test(tc, test_ufiber_fls);
+	tcase_add_test(tc, test_ufiber_chan);
+	tcase_add_test(tc, test_ufiber_future);
+	tcase_add_test(tc, test_ufiber_pool);
+	tcase_add_test(tc, test_ufiber_attr);
+	tcase_add_test(tc, test_ufiber_cache);
+	tcase_add_test(tc, test_ufiber_mem_stats);
+	tcase_add_test(tc, test_ufiber_stats);
+	tcase_add_test(tc, test_ufiber_trace);
+	tcase_add_test(tc, test_ufiber_shared_stack);
+#if UFIBER_SPLIT_STACK
+	tcase_add_test(tc, test_ufiber_split_stack);
+#endif
+	tcase_add_test(tc, test_ufiber_workers);
+	tcase_add_test(tc, test_ufiber_steal);
+	tcase_add_test(tc, test_ufiber_steal_shared);
+#ifdef __linux__
+	tcase_add_test(tc, test_ufiber_io_pipe);
+	tcase_add_test(tc, test_ufiber_io_remote);
+	tcase_add_test(tc, test_ufiber_io_bell);
+	tcase_add_test(tc, test_ufiber_io_socket);
+	tcase_add_test(tc, test_ufiber_io_close);
+	tcase_add_test(tc, test_ufiber_io_file);
+	tcase_add_test(tc, test_ufiber_io_sendrecv);
+#endif
 	tcase_add_test(tc, test_deadlock);
 	suite_add_tcase(s, tc);
 
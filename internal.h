@@ -0,0 +1,91 @@
+/* Copyright (c) 2013-2015, Drew Thoreson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Interfaces shared between the library's source files.  Nothing in here is
+ * part of the public API.
+ */
+
+#ifndef _UFIBER_INTERNAL_H_
+#define _UFIBER_INTERNAL_H_
+
+#include "ufiber.h"
+
+/* When built with UFIBER_THREADS, each thread has its own scheduler.  A
+ * stealable fiber may be started by another worker than the one that created
+ * it, but fibers never migrate between threads once they have started. */
+#if UFIBER_THREADS
+#define UFIBER_TLS __thread
+#else
+#define UFIBER_TLS
+#endif
+
+/*
+ * An event source that the scheduler polls for fibers to wake (e.g. the I/O
+ * reactor in io.c).
+ *
+ * poll() readies any fibers whose events have occurred, waiting for up to
+ * 'timeout' milliseconds (or indefinitely if 'timeout' is -1) if there are
+ * none.  It returns the number of fibers readied, or -1 if no fiber is
+ * waiting on it.  The scheduler polls without waiting every so often, and
+ * with a timeout whenever it runs out of ready fibers.
+ *
+ * fini() releases the poller's resources when the scheduler is torn down.
+ */
+struct ufiber_poller {
+	int (*poll)(int timeout);
+	void (*fini)(void);
+};
+
+/* ufiber.c */
+extern UFIBER_TLS const struct ufiber_poller *_ufiber_poller;
+void _ufiber_block(struct ufiber_waitlist *list, void **rv, int wait);
+void _ufiber_wake(struct ufiber *fiber, void *rv);
+void _ufiber_wake_one(struct ufiber_waitlist *list, void *rv);
+void _ufiber_wake_all(struct ufiber_waitlist *list, void *rv);
+int _ufiber_on_shared_stack(const void *addr, size_t len);
+int _ufiber_doorbell(void); // fd to watch for remote wakeups, or -1
+int _ufiber_remote_prepare(void);
+
+/* A completion lets a fiber wait for another thread, like
+ * ufiber_wait_remote(), but without taking the fiber's remote wakeup.  The
+ * fiber calls _ufiber_remote_prepare(), initializes the completion, hands it
+ * to the other thread, and waits; the other thread signals it once, and may
+ * not touch it after that.  It must not be on a shared stack. */
+struct _ufiber_completion {
+	struct _ufiber_completion *next;
+	struct ufiber *fiber;
+	int done;
+};
+void _ufiber_completion_init(struct _ufiber_completion *c);
+void _ufiber_complete(struct _ufiber_completion *c);
+void _ufiber_wait_completion(struct _ufiber_completion *c);
+
+#endif
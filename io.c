@@ -0,0 +1,674 @@
+/* Copyright (c) 2013-2015, Drew Thoreson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * I/O reactor.
+ *
+ * File descriptors are registered with a per-scheduler epoll instance the
+ * first time a fiber waits on them, and stay registered (edge-triggered, for
+ * both reading and writing) until they are closed with ufiber_close().  A
+ * fiber that wants to do I/O tries the operation first, and only if it would
+ * block does it wait on the descriptor's read or write waitlist.  The
+ * scheduler polls the epoll instance when it runs out of ready fibers, and
+ * every POLL_INTERVAL calls otherwise.
+ *
+ * Operations that readiness can't help with (file I/O, mainly) go through
+ * io_uring when the kernel supports it.  A fiber queues a submission entry
+ * whose user_data points at the fiber itself, and blocks on the ring's
+ * waitlist, so that nothing the completion is matched with lives on the
+ * fiber's stack (which may be a shared one).  Queued entries are submitted in
+ * one batch the next time the scheduler polls.  The ring's file descriptor is
+ * registered with the epoll instance, and completions are reaped in bulk
+ * whenever the scheduler polls, waking each fiber with the operation's
+ * result.  If io_uring is unavailable, these operations fall back to plain
+ * (or, for sockets, epoll-driven) system calls.
+ *
+ * Once the scheduler has a doorbell for remote wakeups (see
+ * ufiber_wake_remote()), it is registered with the epoll instance as well, so
+ * that waiting for I/O doesn't hold up fibers woken by other threads.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+
+#include "ufiber_io.h"
+#include "internal.h"
+#include "queue.h"
+
+#define MAX_EVENTS 64
+#define URING_ENTRIES 256
+
+struct fd_state {
+	struct ufiber_waitlist rd;
+	struct ufiber_waitlist wr;
+};
+
+static UFIBER_TLS int epfd = -1;
+static UFIBER_TLS struct fd_state **fds; // indexed by file descriptor
+static UFIBER_TLS unsigned nr_fds;
+static UFIBER_TLS unsigned nr_waiting;   // fibers blocked on a descriptor
+static UFIBER_TLS int bell = -1;         // doorbell registered with 'epfd'
+
+#if HAVE_IO_URING
+struct uring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+	unsigned queued;   // entries queued but not yet submitted
+	unsigned inflight; // fibers waiting for a completion
+	uint64_t supported;   // opcodes that have worked, by bit
+	uint64_t unsupported; // opcodes the kernel refused, by bit
+	struct ufiber_waitlist waiters;
+};
+
+static UFIBER_TLS struct uring ring;
+static UFIBER_TLS int uring_state; // 0: not set up, 1: ready, -1: unavailable
+
+static int uring_submit(void)
+{
+	int n;
+
+	if (uring_state <= 0 || !ring.queued)
+		return 0;
+	if ((n = syscall(__NR_io_uring_enter, ring.fd, ring.queued, 0, 0,
+					NULL, 0)) < 0)
+		return -1;
+	ring.queued -= n;
+	return 0;
+}
+
+/* wake the fibers for all available completions */
+static int uring_reap(void)
+{
+	unsigned head, tail;
+	struct io_uring_cqe *cqe;
+	int n = 0;
+
+	if (uring_state <= 0)
+		return 0;
+
+	head = *ring.cq_head;
+	tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++, n++) {
+		cqe = &ring.cqes[head & *ring.cq_mask];
+		_ufiber_wake((struct ufiber*)(unsigned long) cqe->user_data,
+				(void*)(long) cqe->res);
+	}
+	__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	return n;
+}
+
+static void uring_fini(void)
+{
+	if (uring_state > 0) {
+		munmap(ring.sqes, ring.sqes_size);
+		if (ring.cq_ring != ring.sq_ring)
+			munmap(ring.cq_ring, ring.cq_ring_size);
+		munmap(ring.sq_ring, ring.sq_ring_size);
+		close(ring.fd);
+	}
+	uring_state = 0;
+}
+#else
+static struct {
+	unsigned inflight;
+} ring;
+
+static int uring_submit(void)
+{
+	return 0;
+}
+
+static int uring_reap(void)
+{
+	return 0;
+}
+
+static void uring_fini(void)
+{
+}
+#endif
+
+static int reactor_poll(int timeout)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct fd_state *st;
+	uint64_t count;
+	int n, readied;
+
+	if (!nr_waiting && !ring.inflight)
+		return -1;
+
+	if (bell < 0 && (bell = _ufiber_doorbell()) >= 0) {
+		events[0].events = EPOLLIN;
+		events[0].data.ptr = &bell;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, bell, &events[0]);
+	}
+
+	uring_submit();
+	if ((readied = uring_reap()))
+		timeout = 0;
+
+	if ((n = epoll_wait(epfd, events, MAX_EVENTS, timeout)) < 0)
+		return readied;
+
+	for (int i = 0; i < n; i++) {
+		/* The scheduler takes in remote wakeups itself, but the doorbell
+		 * is level-triggered and may have been rung after the scheduler
+		 * last cleared it; clear it here too, or every later poll would
+		 * return at once. */
+		if (events[i].data.ptr == &bell) {
+			while (read(bell, &count, sizeof(count)) > 0)
+				;
+			continue;
+		}
+		/* the io_uring instance is registered with a NULL pointer */
+		if ((st = events[i].data.ptr) == NULL) {
+			readied += uring_reap();
+			continue;
+		}
+		if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+			_ufiber_wake_all(&st->rd, NULL);
+		if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+			_ufiber_wake_all(&st->wr, NULL);
+		readied++;
+	}
+	return readied;
+}
+
+static void reactor_fini(void)
+{
+	uring_fini();
+	for (unsigned i = 0; i < nr_fds; i++)
+		free(fds[i]);
+	free(fds);
+	fds = NULL;
+	nr_fds = 0;
+	close(epfd);
+	epfd = -1;
+	bell = -1;
+	_ufiber_poller = NULL;
+}
+
+static const struct ufiber_poller reactor = {
+	.poll = reactor_poll,
+	.fini = reactor_fini,
+};
+
+static int reactor_init(void)
+{
+	if (epfd >= 0)
+		return 0;
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		return -1;
+	_ufiber_poller = &reactor;
+	return 0;
+}
+
+/* Get the state for 'fd', registering it with the reactor (and putting it in
+ * non-blocking mode) if necessary. */
+static struct fd_state *get_fd(int fd)
+{
+	struct epoll_event ev;
+	struct fd_state **tmp;
+	struct fd_state *st;
+	unsigned n;
+	int flags;
+
+	if (fd < 0) {
+		errno = EBADF;
+		return NULL;
+	}
+
+	if ((unsigned) fd < nr_fds && fds[fd] != NULL)
+		return fds[fd];
+
+	if (reactor_init())
+		return NULL;
+
+	if ((unsigned) fd >= nr_fds) {
+		for (n = nr_fds ? nr_fds : 64; n <= (unsigned) fd; n *= 2)
+			;
+		if ((tmp = realloc(fds, n * sizeof(*fds))) == NULL)
+			return NULL;
+		for (unsigned i = nr_fds; i < n; i++)
+			tmp[i] = NULL;
+		fds = tmp;
+		nr_fds = n;
+	}
+
+	if ((flags = fcntl(fd, F_GETFL)) < 0)
+		return NULL;
+	if (!(flags & O_NONBLOCK) && fcntl(fd, F_SETFL, flags | O_NONBLOCK))
+		return NULL;
+
+	if ((st = malloc(sizeof(*st))) == NULL)
+		return NULL;
+	UFIBER_CIRCLEQ_INIT(&st->rd);
+	UFIBER_CIRCLEQ_INIT(&st->wr);
+
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = st;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		free(st);
+		return NULL;
+	}
+
+	fds[fd] = st;
+	return st;
+}
+
+static int wait_fd(struct fd_state *st, int events)
+{
+	unsigned long error = 0;
+
+	nr_waiting++;
+	if (events == UFIBER_POLLIN)
+		_ufiber_block(&st->rd, (void**) &error, UFIBER_WAIT_IO);
+	else
+		_ufiber_block(&st->wr, (void**) &error, UFIBER_WAIT_IO);
+	nr_waiting--;
+	return error;
+}
+
+int ufiber_wait_fd(int fd, int events)
+{
+	struct fd_state *st;
+
+	if (events != UFIBER_POLLIN && events != UFIBER_POLLOUT)
+		return EINVAL;
+	if ((st = get_fd(fd)) == NULL)
+		return errno;
+	return wait_fd(st, events);
+}
+
+ssize_t ufiber_read(int fd, void *buf, size_t count)
+{
+	struct fd_state *st;
+	ssize_t rc;
+	int error;
+
+	if ((st = get_fd(fd)) == NULL)
+		return -1;
+
+	while ((rc = read(fd, buf, count)) < 0 && errno == EAGAIN) {
+		if ((error = wait_fd(st, UFIBER_POLLIN))) {
+			errno = error;
+			return -1;
+		}
+	}
+	return rc;
+}
+
+ssize_t ufiber_write(int fd, const void *buf, size_t count)
+{
+	struct fd_state *st;
+	ssize_t rc;
+	int error;
+
+	if ((st = get_fd(fd)) == NULL)
+		return -1;
+
+	while ((rc = write(fd, buf, count)) < 0 && errno == EAGAIN) {
+		if ((error = wait_fd(st, UFIBER_POLLOUT))) {
+			errno = error;
+			return -1;
+		}
+	}
+	return rc;
+}
+
+int ufiber_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+	struct fd_state *st;
+	int rc, error;
+
+	if ((st = get_fd(fd)) == NULL)
+		return -1;
+
+	while ((rc = accept4(fd, addr, addrlen, SOCK_NONBLOCK)) < 0
+			&& errno == EAGAIN) {
+		if ((error = wait_fd(st, UFIBER_POLLIN))) {
+			errno = error;
+			return -1;
+		}
+	}
+	return rc;
+}
+
+int ufiber_connect(int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+	struct fd_state *st;
+	socklen_t len = sizeof(int);
+	int error;
+
+	if ((st = get_fd(fd)) == NULL)
+		return -1;
+
+	if (!connect(fd, addr, addrlen))
+		return 0;
+	if (errno != EINPROGRESS)
+		return -1;
+
+	if (!(error = wait_fd(st, UFIBER_POLLOUT))
+			&& getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len))
+		return -1;
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+int ufiber_close(int fd)
+{
+	struct fd_state *st;
+
+	if (fd >= 0 && (unsigned) fd < nr_fds && (st = fds[fd]) != NULL) {
+		_ufiber_wake_all(&st->rd, (void*) EBADF);
+		_ufiber_wake_all(&st->wr, (void*) EBADF);
+		epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+		fds[fd] = NULL;
+		free(st);
+	}
+	return close(fd);
+}
+
+#if HAVE_IO_URING
+static int uring_setup(void)
+{
+	struct io_uring_params p;
+	struct epoll_event ev;
+	char *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	if (reactor_init())
+		return -1;
+	if ((ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0)
+		return -1;
+
+	ring.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring.cq_ring_size = p.cq_off.cqes
+		+ p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring.cq_ring_size > ring.sq_ring_size)
+			ring.sq_ring_size = ring.cq_ring_size;
+		ring.cq_ring_size = ring.sq_ring_size;
+	}
+
+	ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (ring.sq_ring == MAP_FAILED)
+		goto err_close;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring.cq_ring = ring.sq_ring;
+	} else {
+		ring.cq_ring = mmap(NULL, ring.cq_ring_size,
+				PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring.fd,
+				IORING_OFF_CQ_RING);
+		if (ring.cq_ring == MAP_FAILED)
+			goto err_sq;
+	}
+
+	ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED)
+		goto err_cq;
+
+	sq = ring.sq_ring;
+	cq = ring.cq_ring;
+	ring.sq_head  = (unsigned*) (sq + p.sq_off.head);
+	ring.sq_tail  = (unsigned*) (sq + p.sq_off.tail);
+	ring.sq_mask  = (unsigned*) (sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned*) (sq + p.sq_off.array);
+	ring.cq_head  = (unsigned*) (cq + p.cq_off.head);
+	ring.cq_tail  = (unsigned*) (cq + p.cq_off.tail);
+	ring.cq_mask  = (unsigned*) (cq + p.cq_off.ring_mask);
+	ring.cqes     = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+	ring.queued = 0;
+	ring.inflight = 0;
+	ring.supported = 0;
+	ring.unsupported = 0;
+	UFIBER_CIRCLEQ_INIT(&ring.waiters);
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, ring.fd, &ev))
+		goto err_sqes;
+	return 0;
+
+err_sqes:
+	munmap(ring.sqes, ring.sqes_size);
+err_cq:
+	if (ring.cq_ring != ring.sq_ring)
+		munmap(ring.cq_ring, ring.cq_ring_size);
+err_sq:
+	munmap(ring.sq_ring, ring.sq_ring_size);
+err_close:
+	close(ring.fd);
+	return -1;
+}
+
+/* get a free submission queue entry, or NULL if io_uring is unavailable */
+static struct io_uring_sqe *get_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail;
+
+	if (uring_state == 0)
+		uring_state = uring_setup() ? -1 : 1;
+	if (uring_state < 0)
+		return NULL;
+
+	tail = *ring.sq_tail;
+	while (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE)
+			>= *ring.sq_mask + 1) {
+		if (uring_submit())
+			return NULL;
+	}
+
+	sqe = &ring.sqes[tail & *ring.sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	ring.sq_array[tail & *ring.sq_mask] = tail & *ring.sq_mask;
+	return sqe;
+}
+
+/* queue 'sqe' and wait for its completion */
+static long uring_wait(struct io_uring_sqe *sqe)
+{
+	long res = 0;
+
+	sqe->user_data = (unsigned long) ufiber_self();
+	__atomic_store_n(ring.sq_tail, *ring.sq_tail + 1, __ATOMIC_RELEASE);
+	ring.queued++;
+
+	ring.inflight++;
+	_ufiber_block(&ring.waiters, (void**) &res, UFIBER_WAIT_IO);
+	ring.inflight--;
+
+	if (res < 0) {
+		errno = -res;
+		return -1;
+	}
+	return res;
+}
+
+/* The kernel accesses 'buf' while the calling fiber is blocked.  If 'buf' is
+ * on a shared stack, other fibers' frames may be there by then, so the I/O
+ * goes through a bounce buffer instead.
+ *
+ * Kernels that predate an opcode fail it with EINVAL (or EOPNOTSUPP, for
+ * some files); the operation is then done without io_uring, and unless the
+ * opcode has worked before, so is every later one with the same opcode.  An
+ * EINVAL that the system call returns as well costs no more than the retry. */
+static long uring_rw(int op, int fd, const void *buf, size_t count,
+		off_t offset, int flags)
+{
+	int in = op == IORING_OP_READ || op == IORING_OP_RECV;
+	struct io_uring_sqe *sqe;
+	void *bounce = NULL;
+	long rc;
+
+	if (uring_state > 0 && (ring.unsupported & (UINT64_C(1) << op)))
+		return -2;
+
+	/* the length is 32 bits; a short transfer is allowed */
+	if (count > UINT_MAX)
+		count = UINT_MAX;
+
+	if (_ufiber_on_shared_stack(buf, count)) {
+		if ((bounce = malloc(count)) == NULL)
+			return -2;
+		if (!in)
+			memcpy(bounce, buf, count);
+	}
+
+	if ((sqe = get_sqe()) == NULL) {
+		free(bounce);
+		return -2;
+	}
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) (bounce ? bounce : buf);
+	sqe->len = count;
+	sqe->off = offset;
+	sqe->msg_flags = flags;
+	rc = uring_wait(sqe);
+	if (rc >= 0) {
+		ring.supported |= UINT64_C(1) << op;
+	} else if (errno == EINVAL || errno == EOPNOTSUPP) {
+		if (!(ring.supported & (UINT64_C(1) << op)))
+			ring.unsupported |= UINT64_C(1) << op;
+		rc = -2;
+	}
+
+	if (bounce) {
+		if (in && rc > 0)
+			memcpy((void*) buf, bounce, rc);
+		free(bounce);
+	}
+	return rc;
+}
+#else
+static long uring_rw(int op, int fd, const void *buf, size_t count,
+		off_t offset, int flags)
+{
+	return -2;
+}
+
+#define IORING_OP_READ  0
+#define IORING_OP_WRITE 0
+#define IORING_OP_SEND  0
+#define IORING_OP_RECV  0
+#endif
+
+/*
+ * In the functions below, uring_rw() returns -2 when io_uring is unavailable
+ * or doesn't support the operation, in which case it is done without it.  Sockets are also retried
+ * through the reactor if io_uring reports EAGAIN, as it may for non-blocking
+ * sockets on older kernels.
+ */
+
+ssize_t ufiber_pread(int fd, void *buf, size_t count, off_t offset)
+{
+	ssize_t rc = uring_rw(IORING_OP_READ, fd, buf, count, offset, 0);
+	return rc == -2 ? pread(fd, buf, count, offset) : rc;
+}
+
+ssize_t ufiber_pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+	ssize_t rc = uring_rw(IORING_OP_WRITE, fd, buf, count, offset, 0);
+	return rc == -2 ? pwrite(fd, buf, count, offset) : rc;
+}
+
+ssize_t ufiber_send(int fd, const void *buf, size_t len, int flags)
+{
+	struct fd_state *st;
+	ssize_t rc;
+	int error;
+
+	rc = uring_rw(IORING_OP_SEND, fd, buf, len, 0, flags);
+	if (rc != -2 && !(rc < 0 && errno == EAGAIN))
+		return rc;
+
+	if ((st = get_fd(fd)) == NULL)
+		return -1;
+	while ((rc = send(fd, buf, len, flags)) < 0 && errno == EAGAIN) {
+		if ((error = wait_fd(st, UFIBER_POLLOUT))) {
+			errno = error;
+			return -1;
+		}
+	}
+	return rc;
+}
+
+ssize_t ufiber_recv(int fd, void *buf, size_t len, int flags)
+{
+	struct fd_state *st;
+	ssize_t rc;
+	int error;
+
+	rc = uring_rw(IORING_OP_RECV, fd, buf, len, 0, flags);
+	if (rc != -2 && !(rc < 0 && errno == EAGAIN))
+		return rc;
+
+	if ((st = get_fd(fd)) == NULL)
+		return -1;
+	while ((rc = recv(fd, buf, len, flags)) < 0 && errno == EAGAIN) {
+		if ((error = wait_fd(st, UFIBER_POLLIN))) {
+			errno = error;
+			return -1;
+		}
+	}
+	return rc;
+}
@@ -0,0 +1,243 @@
+/* Copyright (c) 2013-2015, Drew Thoreson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * Blocking call offload.
+ *
+ * ufiber_offload() runs a function that may block (getaddrinfo(), fsync(),
+ * ...) on a process-wide pool of threads, and suspends the calling fiber
+ * until it returns, so that the fiber's scheduler keeps running the others.
+ * Calls are queued in a FIFO protected by a mutex; pool threads wait on a
+ * condition variable for work, run each call, and hand its result back
+ * through a completion (see internal.h), which leaves the fiber's own remote
+ * wakeup free for others to use meanwhile.  The queue is
+ * bounded: a call that finds it full is refused with EAGAIN rather than
+ * suspended, so that callers can shed load (or run the function themselves)
+ * instead of piling up behind a backlog.
+ *
+ * The pool is started with OFFLOAD_THREADS threads on first use, unless
+ * ufiber_offload_setsize() was called before.  Threads are detached; when the
+ * pool shrinks, surplus threads exit once they are idle.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ufiber.h"
+#include "internal.h"
+
+#define OFFLOAD_THREADS 4
+#define OFFLOAD_DEPTH   256
+
+/* a call, on the calling fiber's stack (or in the heap if that is a shared
+ * stack) until it has been run */
+struct offload_call {
+	struct offload_call *next;
+	void *(*fn)(void*);
+	void *arg;
+	void *rv;
+	struct _ufiber_completion done;
+	unsigned long long queued_ns; // when the call was queued
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t work;       // signalled when a call is queued
+	struct offload_call *head; // queued calls, oldest first
+	struct offload_call **tail;
+	unsigned threads;          // threads running
+	unsigned size;             // threads wanted; 0 until set up
+	unsigned depth;
+	struct ufiber_offload_stats stats;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.tail = &pool.head,
+};
+
+static unsigned long long mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void account(unsigned long long *total, unsigned long long *max,
+		unsigned long long ns)
+{
+	*total += ns;
+	if (ns > *max)
+		*max = ns;
+}
+
+static void *offload_thread(void *unused)
+{
+	struct offload_call *call;
+	unsigned long long start, end;
+	void *rv;
+
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (pool.head == NULL && pool.threads <= pool.size)
+			pthread_cond_wait(&pool.work, &pool.lock);
+		if (pool.threads > pool.size)
+			break;
+
+		call = pool.head;
+		if ((pool.head = call->next) == NULL)
+			pool.tail = &pool.head;
+		pool.stats.queued--;
+		pool.stats.running++;
+		pthread_mutex_unlock(&pool.lock);
+
+		/* 'call' is gone as soon as it is completed and the fiber
+		 * gets the lock */
+		start = mono_ns();
+		rv = call->fn(call->arg);
+		end = mono_ns();
+
+		pthread_mutex_lock(&pool.lock);
+		pool.stats.running--;
+		account(&pool.stats.wait_ns, &pool.stats.max_wait_ns,
+				start - call->queued_ns);
+		account(&pool.stats.run_ns, &pool.stats.max_run_ns,
+				end - start);
+		call->rv = rv;
+		_ufiber_complete(&call->done);
+	}
+	pool.threads--;
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+
+/* start threads until there are 'pool.size' of them; call with the lock
+ * held */
+static int spawn_threads(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int error = 0;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	while (pool.threads < pool.size) {
+		if ((error = pthread_create(&thread, &attr, offload_thread,
+						NULL)))
+			break;
+		pool.threads++;
+	}
+	pthread_attr_destroy(&attr);
+	return error;
+}
+
+int ufiber_offload_setsize(unsigned threads, unsigned depth)
+{
+	int error;
+
+	if (threads == 0 || depth == 0)
+		return EINVAL;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.size = threads;
+	pool.depth = depth;
+	error = spawn_threads();
+	pthread_cond_broadcast(&pool.work); // let surplus threads exit
+	pthread_mutex_unlock(&pool.lock);
+	return error;
+}
+
+int ufiber_offload(void *(*fn)(void*), void *arg, void **retval)
+{
+	struct offload_call local, *call = &local;
+	unsigned long long now;
+	int error;
+
+	if ((error = _ufiber_remote_prepare()))
+		return error;
+	if (_ufiber_on_shared_stack(call, sizeof(*call))
+			&& (call = malloc(sizeof(*call))) == NULL)
+		return ENOMEM;
+
+	_ufiber_completion_init(&call->done);
+	call->next = NULL;
+	call->fn = fn;
+	call->arg = arg;
+
+	pthread_mutex_lock(&pool.lock);
+	if (pool.size == 0) {
+		pool.size = OFFLOAD_THREADS;
+		pool.depth = OFFLOAD_DEPTH;
+	}
+	/* a previous attempt to start threads may have failed */
+	if (pool.threads == 0 && (error = spawn_threads()) && !pool.threads)
+		goto out;
+	if (pool.stats.queued >= pool.depth) {
+		pool.stats.rejected++;
+		error = EAGAIN;
+		goto out;
+	}
+	call->queued_ns = mono_ns();
+	*pool.tail = call;
+	pool.tail = &call->next;
+	pool.stats.queued++;
+	pthread_cond_signal(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+
+	_ufiber_wait_completion(&call->done);
+	now = mono_ns();
+
+	pthread_mutex_lock(&pool.lock);
+	pool.stats.calls++;
+	account(&pool.stats.latency_ns, &pool.stats.max_latency_ns,
+			now - call->queued_ns);
+	if (retval != NULL)
+		*retval = call->rv;
+	error = 0;
+out:
+	pthread_mutex_unlock(&pool.lock);
+	if (call != &local)
+		free(call);
+	return error;
+}
+
+int ufiber_offload_stats(struct ufiber_offload_stats *stats)
+{
+	pthread_mutex_lock(&pool.lock);
+	*stats = pool.stats;
+	stats->threads = pool.size ? pool.size : OFFLOAD_THREADS;
+	stats->depth = pool.depth ? pool.depth : OFFLOAD_DEPTH;
+	pthread_mutex_unlock(&pool.lock);
+	return 0;
+}
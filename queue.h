@@ -551,6 +551,22 @@ struct {                                                                     \
 	UFIBER_Q_INVALIDATE((elm)->field.cqe_next);                            \
 } while (0)
 
+/* move all elements of head2 to the end of head1 */
+#define UFIBER_CIRCLEQ_CONCAT(head1, head2, field) do {                        \
+	if (!UFIBER_CIRCLEQ_EMPTY(head2)) {                                    \
+		(head2)->cqh_first->field.cqe_prev = (head1)->cqh_last;      \
+		if (UFIBER_CIRCLEQ_EMPTY(head1))                               \
+			(head1)->cqh_first = (head2)->cqh_first;             \
+		else                                                         \
+			(head1)->cqh_last->field.cqe_next =                  \
+			    (head2)->cqh_first;                              \
+		(head2)->cqh_last->field.cqe_next =                          \
+		    UFIBER_CIRCLEQ_END(head1);                                 \
+		(head1)->cqh_last = (head2)->cqh_last;                       \
+		UFIBER_CIRCLEQ_INIT(head2);                                    \
+	}                                                                    \
+} while (0)
+
 #define UFIBER_CIRCLEQ_REPLACE(head, elm, elm2, field) do {                    \
 	if (((elm2)->field.cqe_next = (elm)->field.cqe_next) ==              \
 	    UFIBER_CIRCLEQ_END(head))                                          \
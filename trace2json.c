@@ -0,0 +1,179 @@
+/* Copyright (c) 2013-2026, Drew Thoreson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Convert trace files written by ufiber_trace_dump(3) to the Chrome trace
+ * event JSON format, which chrome://tracing and Perfetto can display.  Each
+ * worker thread is shown as a process, and each fiber as a thread of it, with
+ * a slice for every stretch of time the fiber ran.  Trace files must be
+ * converted on a machine with the same ABI as the one that wrote them. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ufiber.h"
+
+static const char *const wait_names[UFIBER_NR_WAITS] = {
+	[UFIBER_WAIT_JOIN]    = "join",
+	[UFIBER_WAIT_SLEEP]   = "sleep",
+	[UFIBER_WAIT_MUTEX]   = "mutex",
+	[UFIBER_WAIT_RWLOCK]  = "rwlock",
+	[UFIBER_WAIT_COND]    = "cond",
+	[UFIBER_WAIT_BARRIER] = "barrier",
+	[UFIBER_WAIT_CHAN]    = "chan",
+	[UFIBER_WAIT_IO]      = "io",
+	[UFIBER_WAIT_SEM]     = "sem",
+	[UFIBER_WAIT_REMOTE]  = "remote",
+	[UFIBER_WAIT_OTHER]   = "other",
+};
+
+static int first_event = 1;
+
+static void die(const char *file, const char *msg)
+{
+	fprintf(stderr, "trace2json: %s: %s\n", file, msg);
+	exit(EXIT_FAILURE);
+}
+
+/* print the start of an event; the caller adds any further fields */
+static void begin_event(const char *ph, const char *name, unsigned pid,
+		unsigned tid, double ts)
+{
+	printf("%s\n{\"ph\":\"%s\",\"name\":\"%s\",\"pid\":%u,\"tid\":%u,"
+			"\"ts\":%.3f", first_event ? "" : ",", ph, name, pid,
+			tid, ts);
+	first_event = 0;
+}
+
+static void print_string(const char *s)
+{
+	putchar('"');
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			printf("\\%c", *s);
+		else if ((unsigned char) *s < 0x20)
+			printf("\\u%04x", *s);
+		else
+			putchar(*s);
+	}
+	putchar('"');
+}
+
+static void convert(FILE *f, const char *file)
+{
+	struct ufiber_trace_header hdr;
+	struct ufiber_trace_event e;
+	struct ufiber_trace_name name;
+	unsigned running = UFIBER_TRACE_NONE;
+	double ts = 0;
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1
+			|| memcmp(hdr.magic, UFIBER_TRACE_MAGIC, sizeof(hdr.magic)))
+		die(file, "not a ufibers trace");
+	if (hdr.version != UFIBER_TRACE_VERSION)
+		die(file, "unsupported trace version");
+
+	for (unsigned long long i = 0; i < hdr.nr_events; i++) {
+		if (fread(&e, sizeof(e), 1, f) != 1)
+			die(file, "truncated trace");
+
+		/* ticks to microseconds */
+		ts = (hdr.base_ns + ((double) e.time - hdr.base_tick)
+				* hdr.ns_per_tick) / 1000;
+
+		switch (e.type) {
+		case UFIBER_TRACE_SWITCH:
+			/* the trace may start in the middle of a slice */
+			if (running == e.fiber) {
+				begin_event("E", "run", hdr.worker, e.fiber, ts);
+				fputs("}", stdout);
+			}
+			begin_event("B", "run", hdr.worker, e.other, ts);
+			fputs("}", stdout);
+			running = e.other;
+			break;
+		case UFIBER_TRACE_CREATE:
+			begin_event("i", "create", hdr.worker, e.fiber, ts);
+			printf(",\"s\":\"t\",\"args\":{\"by\":%u}}", e.other);
+			break;
+		case UFIBER_TRACE_BLOCK:
+			begin_event("i", "block", hdr.worker, e.fiber, ts);
+			printf(",\"s\":\"t\",\"args\":{\"on\":\"%s\"}}",
+					e.arg < UFIBER_NR_WAITS
+					? wait_names[e.arg] : "?");
+			break;
+		case UFIBER_TRACE_WAKE:
+			begin_event("i", "wake", hdr.worker, e.fiber, ts);
+			printf(",\"s\":\"t\",\"args\":{\"by\":%u,\"timeout\":%u}}",
+					e.other, e.arg);
+			break;
+		case UFIBER_TRACE_EXIT:
+			begin_event("i", "exit", hdr.worker, e.fiber, ts);
+			fputs(",\"s\":\"t\"}", stdout);
+			break;
+		default:
+			die(file, "unknown event type");
+		}
+	}
+
+	/* close the slice of whichever fiber was running at the end */
+	if (running != UFIBER_TRACE_NONE) {
+		begin_event("E", "run", hdr.worker, running, ts);
+		fputs("}", stdout);
+	}
+
+	for (unsigned long long i = 0; i < hdr.nr_names; i++) {
+		if (fread(&name, sizeof(name), 1, f) != 1)
+			die(file, "truncated trace");
+		name.name[UFIBER_NAME_MAX-1] = '\0';
+		begin_event("M", "thread_name", hdr.worker, name.fiber, 0);
+		fputs(",\"args\":{\"name\":", stdout);
+		print_string(name.name);
+		fputs("}}", stdout);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	FILE *f;
+
+	printf("{\"traceEvents\":[");
+	if (argc < 2)
+		convert(stdin, "<stdin>");
+	for (int i = 1; i < argc; i++) {
+		if ((f = fopen(argv[i], "rb")) == NULL) {
+			perror(argv[i]);
+			return EXIT_FAILURE;
+		}
+		convert(f, argv[i]);
+		fclose(f);
+	}
+	printf("\n]}\n");
+	return EXIT_SUCCESS;
+}
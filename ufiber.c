@@ -28,16 +28,106 @@
  * POSSIBILITY OF SUCH DAMAGE.
 */
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#if !UFIBER_NO_MMAP
+#include <sys/mman.h>
+#endif
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#if UFIBER_THREADS
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 #include "ufiber.h"
+#include "internal.h"
 #include "queue.h"
 
+#define STACK_MIN  (16*1024)
+#if UFIBER_SPLIT_STACK
+#define STACK_SIZE STACK_MIN // initial segment; stacks grow on demand
+#else
 #define STACK_SIZE (8*1024*1024)
-
-/* must be at least 1 */
-#define FREE_LIST_MAX 1
+#endif
+
+/* number of calls to schedule() between non-blocking polls for events */
+#define POLL_INTERVAL 64
+
+/* default size of each TCB cache bin; must be at least 1 */
+#define FREE_LIST_MAX 64
+
+/* Free TCBs are cached together with their stacks, binned by stack size.  Bin
+ * 0 holds TCBs without a stack of their own (i.e. fibers that ran on a stack
+ * supplied by the caller); bin n holds TCBs with a stack of size
+ * STACK_MIN << (n - 1). */
+#define NR_BINS 24
+
+#if __GNUC__
+#define prefetch(addr) __builtin_prefetch(addr)
+#define noinline __attribute__((noinline))
+#else
+#define prefetch(addr) ((void) (addr))
+#define noinline
+#endif
+
+/* With split stacks, the linker forces functions that call into code built
+ * without -fsplit-stack (such as libc) onto a fresh stack segment each time
+ * they are called.  Such calls are kept out of line (noinline) where they
+ * would otherwise end up in the scheduler's fast path, and context_switch()
+ * doesn't check for a new segment at all (no_split_stack). */
+#if UFIBER_SPLIT_STACK
+#define no_split_stack __attribute__((no_split_stack))
+#else
+#define no_split_stack
+#endif
+
+/* Fibers created with UFIBER_SHARED_STACK run on one of NR_SHARED_STACKS
+ * stacks of SHARED_STACK_SIZE bytes, assigned round-robin; the copier runs on
+ * a stack of COPIER_STACK_SIZE bytes. */
+#define NR_SHARED_STACKS  4
+#define SHARED_STACK_SIZE (8*1024*1024)
+#define COPIER_STACK_SIZE (64*1024)
+
+/* alignment of TCBs (the size of a cache line), and number of TCBs per slab */
+#define TCB_ALIGN 64
+#define SLAB_TCBS 32
+#define TCB_STRIDE \
+	((sizeof(struct ufiber) + TCB_ALIGN - 1) & ~(size_t) (TCB_ALIGN - 1))
+
+/* size of a split-stack context, in pointers (fixed by libgcc) */
+#define SPLIT_CONTEXT 10
+
+/* number of fiber-local storage values stored in the TCB itself */
+#define FLS_INLINE 8
+
+/* number of priority levels; each has its own run queue */
+#define NR_PRIOS (UFIBER_PRIO_MAX + 1)
+
+/* Timers are kept in a hierarchical timing wheel with a resolution of one
+ * millisecond: WHEEL_LEVELS levels of WHEEL_SIZE slots each, where a slot at
+ * level n spans WHEEL_SIZE^n ticks.  Timers are inserted at the lowest level
+ * that can hold them and move down a level each time the level below wraps
+ * around.  Timers further out than the wheel's span are parked at the top
+ * level and re-inserted until they come into range. */
+#define WHEEL_BITS   6
+#define WHEEL_SIZE   (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_SPAN   (1UL << (WHEEL_BITS * WHEEL_LEVELS))
 
 enum {
 	FS_DEAD = 0,
@@ -45,30 +135,188 @@ enum {
 	FS_BLOCKED,
 };
 
-/* fiber TCB */
+enum {
+	TIMER_IDLE = 0,
+	TIMER_ARMED,
+	TIMER_EXPIRED,
+};
+
+/* fiber TCB
+ *
+ * The fields that the scheduler touches to queue a fiber, switch to it and
+ * wake it come first, so that they share a cache line; see TCB_ALIGN. */
 struct ufiber {
 	UFIBER_CIRCLEQ_ENTRY(ufiber) chain;
-	struct ufiber_waitlist blocked;
+	void          *sp;
 	struct ufiber_waitlist *blocked_on;
+	void          **ptr; // pointer for join()
+	unsigned      state;
+	unsigned      prio;
+	unsigned char timer_state;
+	unsigned char timer_level;
+	unsigned char remote_state; // REMOTE_*; see ufiber_wake_remote()
+	struct shared_stack *sstack; // NULL unless running on a shared stack
+#if UFIBER_SPLIT_STACK
+	void          *split_ctx[SPLIT_CONTEXT];
+#endif
+	/* cold */
+	struct tcb_slab *slab;
+	UFIBER_LIST_ENTRY(ufiber) all; // on 'all_tcbs' until destroyed
+	struct ufiber_waitlist blocked;
 	char          *stack;
-	void          *sp;
-	unsigned long state;
-	unsigned long flags;
+	size_t        stack_size;
+	size_t        guard_size;
+	unsigned      bin;
 	int           ref;
-	void          *rv;   // return value
-	void          **ptr; // pointer for join()
+	unsigned long flags;
+	struct ufiber *remote_next; // on the injection queue
+	void          *rv;   // return value, or value of a pending remote wakeup
+#if UFIBER_THREADS
+	int           *blocked_lock; // guards 'blocked_on' if workers share it
+	struct ufiber *woken_next;   // on the 'woken' stack
+	void          *woken_rv;     // value to wake with, or a blocked send's
+	int           woken;         // taken off 'blocked_on' by another thread
+#endif
+	UFIBER_LIST_ENTRY(ufiber) timer;
+	unsigned long expires; // tick at which the timer fires
+	void          *fls[FLS_INLINE]; // values of the first FLS_INLINE keys
+	void          **fls_spill;      // values of the remaining keys
+	unsigned      fls_spill_size;
+	int           fls_used;  // set if any value may be non-NULL
+	char          *saved;      // copy of the live part of a shared stack
+	size_t        saved_len;
+	size_t        saved_size;
+	void          *(*start_routine)(void*); // until first run on a shared
+	void          *arg;                     // stack
+#if UFIBER_STATS
+	struct ufiber_stats stats; // times in fast_clock() ticks
+	unsigned long long blocked_at; // when the fiber last blocked
+#endif
+#if UFIBER_TRACE
+	unsigned      id; // identifies the fiber in traces
+#endif
+	char          name[UFIBER_NAME_MAX];
+};
+
+/* TCBs are carved out of slabs of SLAB_TCBS slots.  Each slot starts on a
+ * TCB_ALIGN boundary, so the hot fields of a TCB never straddle two cache
+ * lines, and neighbouring fibers sit next to each other in memory instead of
+ * being scattered across the heap.  A slab is on its thread's 'partial_slabs'
+ * list while it has free slots, and is freed when its last TCB is. */
+struct tcb_slab {
+	UFIBER_LIST_ENTRY(tcb_slab) link;
+	void     *free;  // free slots, linked through their first word
+	unsigned used;   // number of slots in use
+	struct remote_queue *remote; // injection queue of the slab's thread
+};
+
+UFIBER_LIST_HEAD(slab_list, tcb_slab);
+UFIBER_LIST_HEAD(tcb_list, ufiber);
+
+/*
+ * Shared stacks
+ *
+ * A fiber created with UFIBER_SHARED_STACK runs on a stack that it shares
+ * with other fibers.  The stack holds the frames of one of them at a time,
+ * its 'owner'; the live part of the stacks of the others (from their saved
+ * stack pointer to the top) is kept in right-sized heap buffers.  Since
+ * frames contain pointers into the stack, a fiber is always restored to the
+ * stack it first ran on.
+ *
+ * Copying happens when switching to a fiber that does not own its stack.
+ * This is done by the copier, a context with a small stack of its own, which
+ * saves the owner's frames, restores (or, the first time, creates) those of
+ * the new fiber, and then switches to it.  A fiber being switched away from
+ * may itself be the owner, so the copy can't be done on its stack.
+ */
+struct shared_stack {
+	char          *base;
+	struct ufiber *owner; // fiber whose frames are on the stack, if any
+};
+
+UFIBER_LIST_HEAD(timer_slot, ufiber);
+
+/*
+ * Remote wakeups
+ *
+ * ufiber_wake_remote() may be called from any thread, so it can't touch the
+ * run queues of the fiber's scheduler.  Instead, it pushes the fiber onto
+ * the scheduler's injection queue, a lock-free stack which the scheduler
+ * empties with a single exchange (reversing it to restore the order of the
+ * wakeups) every time it schedules, and then readies the fibers in one go.
+ *
+ * When it has nothing to run and fibers are waiting for remote wakeups, the
+ * scheduler sleeps on the doorbell, an eventfd (or pipe) that the poller
+ * also watches.  It sets 'sleeping' before checking the queue one last time,
+ * and wakers check 'sleeping' after pushing, so that one of the two always
+ * sees the other; 'rung' keeps a burst of wakeups down to a single write.
+ *
+ * Completions (see internal.h) go through a second stack, 'done', so that
+ * the library can wait for other threads without using up the fiber's
+ * remote wakeup.  Fibers woken through mutexes and channels shared between
+ * workers go through a third, 'woken' (see wake_shared()).
+ */
+enum {
+	REMOTE_IDLE,   // no wakeup pending
+	REMOTE_QUEUED, // woken, and maybe still on the injection queue
+	REMOTE_EARLY,  // drained before the fiber called ufiber_wait_remote()
 };
 
-static struct ufiber_waitlist ready_queue // queue of ready fibers
-	= UFIBER_CIRCLEQ_HEAD_INITIALIZER(ready_queue);
-static struct ufiber_waitlist free_list   // list of free TCBs
-	= UFIBER_CIRCLEQ_HEAD_INITIALIZER(free_list);
-static unsigned free_count = 0;  // number of free TCBs
-static unsigned fiber_count = 1; // number of active (non-dead) fibers
+struct remote_queue {
+	struct ufiber *head; // last fiber pushed, linked through 'remote_next'
+	struct _ufiber_completion *done; // last completion pushed
+#if UFIBER_THREADS
+	struct ufiber *woken; // last fiber pushed, linked through 'woken_next'
+#endif
+	int sleeping; // set while the scheduler may be asleep on the doorbell
+	int rung;     // set once the doorbell has been rung for this sleep
+	int doorbell; // read end (the eventfd itself on Linux), or -1
+	int bell_wr;  // write end
+};
+
+struct tcb_bin {
+	struct ufiber_waitlist list;
+	unsigned count;
+};
+
+static unsigned free_max = FREE_LIST_MAX; // maximum number of TCBs per bin
+
+static UFIBER_TLS struct ufiber_waitlist ready_queues[NR_PRIOS]; // run queues
+static UFIBER_TLS unsigned long ready_mask; // bit n set if run queue n is busy
+static UFIBER_TLS struct ufiber_waitlist drained; // waiting for fiber_count==1
+static UFIBER_TLS struct ufiber_waitlist sleepers; // in ufiber_sleep()
+static UFIBER_TLS struct tcb_bin free_bins[NR_BINS]; // cached TCBs
+static UFIBER_TLS struct slab_list partial_slabs; // slabs with free slots
+static UFIBER_TLS struct tcb_list all_tcbs; // live and cached TCBs
+static UFIBER_TLS struct shared_stack shared_stacks[NR_SHARED_STACKS];
+static UFIBER_TLS unsigned next_shared;  // next shared stack to assign
+static UFIBER_TLS char *copier_stack;
+static UFIBER_TLS void *copier_sp;
+static UFIBER_TLS struct ufiber *copy_to; // fiber for the copier to switch to
+static UFIBER_TLS unsigned fiber_count = 1; // number of active fibers
+
+static UFIBER_TLS struct ufiber *current;      // the running fiber
+static UFIBER_TLS struct ufiber *root;         // the top-level fiber
+static UFIBER_TLS struct ufiber *last_blocked; // last fiber to block
+static UFIBER_TLS unsigned poll_ticks; // calls to schedule() since last poll
+
+static UFIBER_TLS struct remote_queue remote = {
+	.doorbell = -1,
+	.bell_wr = -1,
+};
+static UFIBER_TLS struct ufiber_waitlist remote_waiters; // in
+static UFIBER_TLS unsigned nr_remote_waiters;            // ufiber_wait_remote()
+static UFIBER_TLS struct ufiber_waitlist completion_waiters; // or completions
+#if UFIBER_THREADS
+static UFIBER_TLS struct worker *this_worker; // NULL outside of workers
+#endif
+
+static UFIBER_TLS struct timer_slot wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static UFIBER_TLS unsigned wheel_count[WHEEL_LEVELS]; // timers at each level
+static UFIBER_TLS unsigned nr_timers;    // armed timers
+static UFIBER_TLS unsigned long wheel_tick; // next tick to be processed
 
-static struct ufiber *current;      // the running fiber
-static struct ufiber *root;         // the top-level fiber
-static struct ufiber *last_blocked; // last fiber to block
+UFIBER_TLS const struct ufiber_poller *_ufiber_poller;
 
 /* arch.S */
 extern void *_ufiber_create(void *cx, size_t stack_size,
@@ -77,285 +325,2967 @@ extern void *_ufiber_create(void *cx, size_t stack_size,
 extern void _ufiber_switch(void *save_sp, void *rest_sp);
 extern void _ufiber_trampoline(void);
 
-/* get a free TCB */
-static struct ufiber *alloc_tcb(void)
+#if UFIBER_SPLIT_STACK
+/*
+ * Split stacks
+ *
+ * Code compiled with -fsplit-stack checks on entry to each function that the
+ * stack has room for its frame, and otherwise calls __morestack to continue
+ * on a new segment.  libgcc keeps the list of segments and the limit to
+ * check against per thread; saved together, these make up a split-stack
+ * context, which context_switch() swaps along with the registers.
+ *
+ * A library-allocated stack is the initial segment of the fiber's context.
+ * Fibers on other stacks (caller-supplied or shared, and the copier) run with
+ * an empty context instead: its limit of 0 disables the checks, so these
+ * stacks behave as they would without split stacks.
+ */
+
+/* libgcc */
+extern void *__splitstack_makecontext(size_t stack_size,
+		void *context[SPLIT_CONTEXT], size_t *size);
+extern void *__splitstack_resetcontext(void *context[SPLIT_CONTEXT],
+		size_t *size);
+extern void __splitstack_releasecontext(void *context[SPLIT_CONTEXT]);
+extern void __splitstack_getcontext(void *context[SPLIT_CONTEXT]);
+extern void __splitstack_setcontext(void *context[SPLIT_CONTEXT]);
+
+/* prepare the context of a new fiber */
+static noinline no_split_stack void split_reset(struct ufiber *tcb)
 {
-	struct ufiber *ret;
+	size_t size;
 
-	if (!UFIBER_CIRCLEQ_EMPTY(&free_list)) {
-		free_count--;
-		ret = UFIBER_CIRCLEQ_FIRST(&free_list);
-		UFIBER_CIRCLEQ_REMOVE(&free_list, ret, chain);
-		return ret;
-	}
+	if (tcb->bin)
+		__splitstack_resetcontext(tcb->split_ctx, &size);
+	else
+		memset(tcb->split_ctx, 0, sizeof(tcb->split_ctx));
+}
+#endif
+
+#if UFIBER_NO_MMAP
+static size_t default_guard_size(void)
+{
+	return 0;
+}
+
+static char *stack_alloc(size_t size, size_t guard)
+{
+	return malloc(size);
+}
+
+static inline void stack_free(char *stack, size_t size, size_t guard)
+{
+	free(stack);
+}
+
+/* Without mmap there is no telling which parts of a stack are in memory, so
+ * all of it counts as committed, and all of it may have been written to. */
+static size_t stack_committed(char *stack, size_t size)
+{
+	return size;
+}
+
+#if UFIBER_STACK_PAINT
+static char *stack_touched(char *stack, size_t size)
+{
+	return stack;
+}
+#endif
+#else
+static size_t page_size;
+
+static noinline void init_page_size(void)
+{
+	page_size = sysconf(_SC_PAGESIZE);
+}
+
+static size_t default_guard_size(void)
+{
+	if (!page_size)
+		init_page_size();
+	return page_size;
+}
+
+/* Allocate a stack, with 'guard' bytes of PROT_NONE memory below it to catch
+ * overflows.  Memory is only committed when the fiber touches it. */
+static char *stack_alloc(size_t size, size_t guard)
+{
+	char *mem;
 
-	if ((ret = malloc(sizeof(struct ufiber))) == NULL)
+	mem = mmap(NULL, size + guard, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (mem == MAP_FAILED)
 		return NULL;
 
-	if ((ret->stack = malloc(STACK_SIZE)) == NULL)
+	if (guard && mprotect(mem, guard, PROT_NONE)) {
+		munmap(mem, size + guard);
 		return NULL;
+	}
+	return mem + guard;
+}
 
-	return ret;
+static inline void stack_free(char *stack, size_t size, size_t guard)
+{
+	munmap(stack - guard, size + guard);
 }
 
-/* Release a TCB.
+#if !UFIBER_SPLIT_STACK
+#define STACK_RESERVE 1
+
+/* Allocate 'n' stacks, each as stack_alloc() would, with one mapping.  The
+ * stacks are laid out 'size' + 'guard' bytes apart, starting at the returned
+ * address, and each can be released separately with stack_free(). */
+static char *stack_reserve(size_t size, size_t guard, unsigned n)
+{
+	char *mem;
+
+	mem = mmap(NULL, (size + guard) * n, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (mem == MAP_FAILED)
+		return NULL;
+
+	for (unsigned i = 0; guard && i < n; i++) {
+		if (mprotect(mem + i * (size + guard), guard, PROT_NONE)) {
+			munmap(mem, (size + guard) * n);
+			return NULL;
+		}
+	}
+	return mem + guard;
+}
+#endif
+
+/* number of pages to query with each call to mincore() */
+#define MINCORE_PAGES 64
+
+/* count the bytes of a stack that are resident in memory */
+static size_t stack_committed(char *stack, size_t size)
+{
+	unsigned char vec[MINCORE_PAGES];
+	size_t page = default_guard_size();
+	size_t n, committed = 0;
+	char *start, *end;
+
+	/* split-stack segments start after a header, partway into a page, and
+	 * needn't end on a page boundary either */
+	start = (char*) ((uintptr_t) stack & ~(uintptr_t) (page - 1));
+	end = (char*) (((uintptr_t) stack + size + page - 1)
+			& ~(uintptr_t) (page - 1));
+	for (char *p = start; p < end; p += n * page) {
+		n = (end - p) / page;
+		if (n > MINCORE_PAGES)
+			n = MINCORE_PAGES;
+		if (mincore(p, n * page, (void*) vec))
+			return size;
+		for (size_t i = 0; i < n; i++)
+			if (vec[i] & 1)
+				committed += page;
+	}
+	return committed;
+}
+
+#if UFIBER_STACK_PAINT
+/* Find the bottom of the run of resident pages at the top of a stack.  The
+ * pages below it have not been touched since the stack was mapped. */
+static char *stack_touched(char *stack, size_t size)
+{
+	unsigned char vec[MINCORE_PAGES];
+	size_t page = default_guard_size();
+	char *p = stack + size;
+	size_t n, i;
+
+	while (p > stack) {
+		n = (p - stack + page - 1) / page;
+		if (n > MINCORE_PAGES)
+			n = MINCORE_PAGES;
+		if (mincore(p - n * page, n * page, (void*) vec))
+			return stack;
+		for (i = n; i > 0 && (vec[i - 1] & 1); i--)
+			p -= page;
+		if (i > 0)
+			break;
+	}
+	return p > stack ? p : stack;
+}
+#endif
+#endif
+
+static inline size_t bin_size(unsigned bin)
+{
+	return (size_t) STACK_MIN << (bin - 1);
+}
+
+/* get the bin for stacks of at least 'size' bytes; returns 0 if too big */
+static unsigned size_to_bin(size_t size)
+{
+	for (unsigned bin = 1; bin < NR_BINS; bin++)
+		if (bin_size(bin) >= size)
+			return bin;
+	return 0;
+}
+
+#if UFIBER_STACK_PAINT
+/*
+ * Stack painting
  *
- * NOTE: TCBs can't be freed immediately on ufiber_exit() because the exiting
- * thread still needs a stack for its final context_switch().  So instead of
- * freeing its argument, this function will evict a TCB from the free list and
- * free that instead.
+ * Stacks are painted with zeroes, since fresh stack mappings read as zeroes
+ * anyway: painting them is free, and commits no memory.  A fiber's stack
+ * usage is the distance from the top of its stack down to the lowest
+ * non-zero word, and a reused stack is cleared down to there.
  */
-static void free_tcb(struct ufiber *tcb)
+
+static UFIBER_TLS size_t stack_max_usage; // largest usage of an exited fiber
+
+static size_t stack_usage(const struct ufiber *tcb)
 {
-	struct ufiber *victim;
+	char *top = tcb->stack + tcb->stack_size;
+	uintptr_t p;
 
-	UFIBER_CIRCLEQ_INSERT_HEAD(&free_list, tcb, chain);
-	if (free_count < FREE_LIST_MAX) {
-		free_count++;
-		return;
+	/* caller-supplied stacks are not necessarily page-aligned */
+	p = (uintptr_t) (tcb->bin ? stack_touched(tcb->stack, tcb->stack_size)
+			: tcb->stack);
+	p = (p + sizeof(long) - 1) & ~(uintptr_t) (sizeof(long) - 1);
+
+	while (p < (uintptr_t) top && *(long*) p == 0)
+		p += sizeof(long);
+	return p < (uintptr_t) top ? (uintptr_t) top - p : 0;
+}
+
+static void stack_paint(struct ufiber *tcb)
+{
+	size_t used = stack_usage(tcb);
+
+	memset(tcb->stack + tcb->stack_size - used, 0, used);
+}
+#endif
+
+static struct tcb_slab *slab_create(void)
+{
+	struct tcb_slab *slab;
+	uintptr_t addr;
+	void **slot;
+
+	slab = malloc(sizeof(*slab) + TCB_ALIGN - 1 + SLAB_TCBS * TCB_STRIDE);
+	if (slab == NULL)
+		return NULL;
+
+	addr = ((uintptr_t) (slab + 1) + TCB_ALIGN - 1)
+		& ~(uintptr_t) (TCB_ALIGN - 1);
+	slab->free = NULL;
+	for (unsigned i = SLAB_TCBS; i > 0; i--) {
+		slot = (void**) (addr + (i - 1) * TCB_STRIDE);
+		*slot = slab->free;
+		slab->free = slot;
+	}
+	slab->used = 0;
+	slab->remote = &remote;
+	return slab;
+}
+
+static struct ufiber *slab_alloc(void)
+{
+	struct tcb_slab *slab = UFIBER_LIST_FIRST(&partial_slabs);
+	struct ufiber *tcb;
+
+	if (slab == NULL) {
+		if ((slab = slab_create()) == NULL)
+			return NULL;
+		UFIBER_LIST_INSERT_HEAD(&partial_slabs, slab, link);
 	}
 
-	victim = UFIBER_CIRCLEQ_LAST(&free_list);
-	UFIBER_CIRCLEQ_REMOVE(&free_list, victim, chain);
-	free(victim->stack);
-	free(victim);
+	tcb = slab->free;
+	slab->free = *(void**) tcb;
+	if (++slab->used == SLAB_TCBS)
+		UFIBER_LIST_REMOVE(slab, link);
+
+	tcb->slab = slab;
+	return tcb;
 }
 
-static void context_switch(struct ufiber *fiber)
+static void slab_free(struct ufiber *tcb)
 {
-	void *save_sp = &current->sp;
+	struct tcb_slab *slab = tcb->slab;
 
-	if (fiber == current)
+	if (slab->used-- == SLAB_TCBS)
+		UFIBER_LIST_INSERT_HEAD(&partial_slabs, slab, link);
+	if (!slab->used) {
+		UFIBER_LIST_REMOVE(slab, link);
+		free(slab);
 		return;
+	}
 
-	current = fiber;
-	_ufiber_switch(save_sp, &fiber->sp);
+	*(void**) tcb = slab->free;
+	slab->free = tcb;
 }
 
-/* add 'fiber' to the ready queue */
-static inline void ready(struct ufiber *fiber)
+static void destroy_tcb(struct ufiber *tcb)
 {
-	fiber->state = FS_READY;
-	UFIBER_CIRCLEQ_INSERT_TAIL(&ready_queue, fiber, chain);
+#if UFIBER_SPLIT_STACK
+	if (tcb->bin)
+		__splitstack_releasecontext(tcb->split_ctx);
+#else
+	if (tcb->bin)
+		stack_free(tcb->stack, tcb->stack_size, tcb->guard_size);
+#endif
+	free(tcb->fls_spill);
+	free(tcb->saved);
+	UFIBER_LIST_REMOVE(tcb, all);
+	slab_free(tcb);
 }
 
-/* unblock 'fiber', returning 'retval' */
-static inline void wake(struct ufiber *tcb, void *retval)
+static struct ufiber *evict_tcb(struct tcb_bin *bin)
 {
-	if (tcb->ptr != NULL)
-		*tcb->ptr = retval;
-	UFIBER_CIRCLEQ_REMOVE(tcb->blocked_on, tcb, chain);
-	ready(tcb);
+	struct ufiber *tcb = UFIBER_CIRCLEQ_LAST(&bin->list);
+	UFIBER_CIRCLEQ_REMOVE(&bin->list, tcb, chain);
+	bin->count--;
+	return tcb;
 }
 
-static inline void wake_one(struct ufiber_waitlist *list, void *retval)
+/* allocate a TCB that isn't cached; see alloc_tcb().  Unless 'stack' is NULL,
+ * it is the memory for the stack, already allocated by stack_reserve(). */
+static noinline struct ufiber *new_tcb(unsigned bin, size_t guard,
+		char *stack)
 {
-	if (!UFIBER_CIRCLEQ_EMPTY(list))
-		wake(UFIBER_CIRCLEQ_FIRST(list), retval);
+	struct ufiber *ret;
+
+	if ((ret = slab_alloc()) == NULL)
+		return NULL;
+
+	for (unsigned i = 0; i < FLS_INLINE; i++)
+		ret->fls[i] = NULL;
+	ret->fls_spill = NULL;
+	ret->fls_spill_size = 0;
+	ret->fls_used = 0;
+	ret->saved = NULL;
+	ret->saved_size = 0;
+
+	ret->bin = bin;
+	ret->stack = NULL;
+	ret->stack_size = 0;
+	ret->guard_size = guard;
+	if (bin) {
+		ret->stack_size = bin_size(bin);
+#if UFIBER_SPLIT_STACK
+		/* libgcc aborts if it can't allocate a segment */
+		ret->stack = __splitstack_makecontext(ret->stack_size,
+				ret->split_ctx, &ret->stack_size);
+#else
+		ret->stack = stack ? stack : stack_alloc(ret->stack_size, guard);
+#endif
+		if (ret->stack == NULL) {
+			slab_free(ret);
+			return NULL;
+		}
+	}
+
+	UFIBER_LIST_INSERT_HEAD(&all_tcbs, ret, all);
+	return ret;
 }
 
-/* wake all fibers on 'list', retunning 'val' to each */
-static inline void wake_all(struct ufiber_waitlist *list, void *val)
+/* Get a free TCB from bin 'bin'.  Unless 'bin' is 0, the TCB comes with a
+ * stack of bin_size(bin) bytes, preceded by 'guard' bytes of guard pages. */
+static struct ufiber *alloc_tcb(unsigned bin, size_t guard)
 {
-	struct ufiber *pos, *n;
+	struct tcb_bin *b = &free_bins[bin];
+	struct ufiber *ret;
 
-	UFIBER_CIRCLEQ_FOREACH_SAFE(pos, list, chain, n)
-		wake(pos, val);
+#if UFIBER_SPLIT_STACK
+	guard = 0; // segments can't overflow, so they have no guard pages
+#endif
+	if (b->count) {
+		b->count--;
+		ret = UFIBER_CIRCLEQ_FIRST(&b->list);
+		UFIBER_CIRCLEQ_REMOVE(&b->list, ret, chain);
+		if (!bin || ret->guard_size == guard)
+			return ret;
+		destroy_tcb(ret);
+	}
+	return new_tcb(bin, guard, NULL);
 }
 
-/* choose a new fiber to run, and run it */
-static void schedule(void)
+/* Get 'n' free TCBs, as alloc_tcb() would, and append them to 'list'.  The
+ * stacks of those that aren't cached are allocated in one go. */
+static int alloc_tcbs(struct ufiber_waitlist *list, unsigned n, unsigned bin,
+		size_t guard)
 {
 	struct ufiber *tcb;
+	char *stacks = NULL;
+	unsigned i;
+
+#if UFIBER_SPLIT_STACK
+	guard = 0;
+#endif
+	for (i = 0; i < n && free_bins[bin].count; i++) {
+		if ((tcb = alloc_tcb(bin, guard)) == NULL)
+			goto fail;
+		UFIBER_CIRCLEQ_INSERT_TAIL(list, tcb, chain);
+	}
+#ifdef STACK_RESERVE
+	if (bin && n - i > 1) {
+		stacks = stack_reserve(bin_size(bin), guard, n - i);
+		if (stacks == NULL)
+			goto fail;
+	}
+#endif
+	for (; i < n; i++) {
+		if ((tcb = new_tcb(bin, guard, stacks)) == NULL)
+			goto fail;
+		UFIBER_CIRCLEQ_INSERT_TAIL(list, tcb, chain);
+		if (stacks)
+			stacks += bin_size(bin) + guard;
+	}
+	return 0;
+fail:
+#ifdef STACK_RESERVE
+	if (stacks)
+		stack_free(stacks, (bin_size(bin) + guard) * (n - i) - guard,
+				guard);
+#endif
+	while (!UFIBER_CIRCLEQ_EMPTY(list)) {
+		tcb = UFIBER_CIRCLEQ_FIRST(list);
+		UFIBER_CIRCLEQ_REMOVE(list, tcb, chain);
+		destroy_tcb(tcb);
+	}
+	return ENOMEM;
+}
 
-	if (UFIBER_CIRCLEQ_EMPTY(&ready_queue))
-		wake(last_blocked, (void*) EDEADLK);
+/* Release a TCB.
+ *
+ * NOTE: TCBs can't be freed immediately on ufiber_exit() because the exiting
+ * thread still needs a stack for its final context_switch().  So instead of
+ * freeing its argument, this function will evict a TCB from the free list and
+ * free that instead.
+ */
+static void free_tcb(struct ufiber *tcb)
+{
+	struct tcb_bin *bin = &free_bins[tcb->bin];
 
-	tcb = UFIBER_CIRCLEQ_FIRST(&ready_queue);
-	UFIBER_CIRCLEQ_REMOVE(&ready_queue, tcb, chain);
+	UFIBER_CIRCLEQ_INSERT_HEAD(&bin->list, tcb, chain);
+	if (bin->count++ < free_max)
+		return;
 
-	context_switch(tcb);
+	destroy_tcb(evict_tcb(bin));
 }
 
-/* block 'fiber' on a given wait queue */
-static void block(struct ufiber_waitlist *list, void **rv)
+static inline void ready(struct ufiber *fiber);
+
+#if UFIBER_STATS || UFIBER_TRACE
+/*
+ * Clock
+ *
+ * Accounting and tracing read the time with fast_clock(): the TSC on x86,
+ * where reading it is about twice as fast as reading CLOCK_MONOTONIC, and
+ * CLOCK_MONOTONIC in nanoseconds elsewhere.  clock_scale() gives the length
+ * of a tick in nanoseconds, at the rate the clock has run at since
+ * ufiber_init().
+ */
+
+static UFIBER_TLS unsigned long long calib_clock; // fast_clock() and
+static UFIBER_TLS unsigned long long calib_ns;    // mono_ns() at ufiber_init()
+
+static noinline unsigned long long mono_ns(void)
 {
-	current->ptr = rv;
-	current->state = FS_BLOCKED;
-	current->blocked_on = list;
-	UFIBER_CIRCLEQ_INSERT_TAIL(list, current, chain);
+	struct timespec ts;
 
-	last_blocked = current;
-	schedule();
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-/* API */
+#if (__amd64__ || __i386__) && __GNUC__
+static inline unsigned long long fast_clock(void)
+{
+	unsigned lo, hi;
 
-int ufiber_init(void)
+	__asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+	return (unsigned long long) hi << 32 | lo;
+}
+#else
+#define fast_clock mono_ns
+#endif
+
+static void clock_calibrate(void)
 {
-	struct ufiber *tcb;
+	calib_ns = mono_ns();
+	calib_clock = fast_clock();
+}
 
-	tcb = alloc_tcb();
-	tcb->state = FS_READY;
-	tcb->ref = 100;
-	UFIBER_CIRCLEQ_INIT(&tcb->blocked);
+static double clock_scale(void)
+{
+	unsigned long long now = fast_clock();
 
-	root = current = tcb;
-	return 0;
+	if (now == calib_clock)
+		return 1.0;
+	return (double) (mono_ns() - calib_ns) / (now - calib_clock);
 }
+#endif
 
-ufiber_t ufiber_self(void)
+#if UFIBER_STATS
+/*
+ * Accounting
+ *
+ * A fiber is charged for the time from being switched to until it is
+ * switched away from or blocks, and for the time from blocking until it is
+ * woken, by what it blocked on.  Times are kept in fast_clock() ticks, and
+ * converted to nanoseconds by ufiber_stats().
+ */
+
+static UFIBER_TLS unsigned long long switch_stamp; // when 'current' started
+
+static void stats_init(struct ufiber *tcb)
 {
-	return current;
+	memset(&tcb->stats, 0, sizeof(tcb->stats));
+	tcb->stats.waiting = -1;
 }
 
-int ufiber_create(ufiber_t *fiber, unsigned long flags,
-		void *(*start_routine)(void*), void *arg)
+/* charge the current fiber for its run, which ends as it blocks */
+static inline void stats_block(int wait)
 {
-	struct ufiber *tcb;
-	if ((tcb = alloc_tcb()) == NULL)
-		return ENOMEM;
+	unsigned long long now = fast_clock();
 
-	tcb->ref = (fiber == NULL || flags & UFIBER_DETACHED) ? 1 : 2;
-	tcb->flags = flags;
-	UFIBER_CIRCLEQ_INIT(&tcb->blocked);
+	current->stats.run_ns += now - switch_stamp;
+	current->stats.blocks++;
+	current->stats.waiting = wait;
+	current->blocked_at = now;
+}
 
-	tcb->sp = _ufiber_create(tcb->stack, STACK_SIZE, start_routine, arg,
-			_ufiber_trampoline, ufiber_exit);
+/* charge a fiber for the time it was blocked; if it never got switched away
+ * from, its next run starts now */
+static inline void stats_wake(struct ufiber *tcb)
+{
+	unsigned long long now = fast_clock();
 
-	ready(tcb);
+	tcb->stats.blocked_ns[tcb->stats.waiting] += now - tcb->blocked_at;
+	tcb->stats.waiting = -1;
+	if (tcb == current)
+		switch_stamp = now;
+}
+#endif
 
-	if (fiber)
-		*fiber = tcb;
+#if UFIBER_TRACE
+/*
+ * Tracing
+ *
+ * Scheduling events are recorded into a per-thread ring of TRACE_EVENTS
+ * entries, overwriting the oldest, and written out by ufiber_trace_dump().
+ * Recording an event takes a clock read and a few stores.
+ */
 
-	fiber_count++;
-	return 0;
-}
+#define TRACE_EVENTS (1 << 16)
 
-int ufiber_join(ufiber_t fiber, void **retval)
+static UFIBER_TLS struct ufiber_trace_event *trace_buf;
+static UFIBER_TLS unsigned long trace_head; // number of events recorded
+static UFIBER_TLS unsigned next_id;
+
+static inline void trace(unsigned type, const struct ufiber *fiber,
+		const struct ufiber *other, unsigned arg)
 {
-	if (fiber == current)
-		return EDEADLK;
+	struct ufiber_trace_event *e = &trace_buf[trace_head++ % TRACE_EVENTS];
 
-	if (fiber->state == FS_DEAD && retval != NULL)
-		*retval = fiber->rv;
-	else if (fiber->state != FS_DEAD)
-		block(&fiber->blocked, retval);
-	ufiber_unref(fiber);
-	return 0;
+	e->time = fast_clock();
+	e->fiber = fiber->id;
+	e->other = other ? other->id : UFIBER_TRACE_NONE;
+	e->type = type;
+	e->arg = arg;
 }
 
-void ufiber_yield(void)
+static int write_all(int fd, const void *buf, size_t len)
 {
-	ready(current);
-	schedule();
+	const char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		if ((n = write(fd, p, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
 }
+#endif
 
-int ufiber_yield_to(ufiber_t fiber)
+/*
+ * Timers
+ *
+ * Ticks are milliseconds on CLOCK_MONOTONIC.  Tick arithmetic is done modulo
+ * ULONG_MAX+1, so comparisons must go through the difference.
+ */
+
+static noinline unsigned long now_tick(void)
 {
-	if (fiber->state == FS_DEAD)
-		return ESRCH;
-	if (fiber->state != FS_READY)
-		return EAGAIN;
+	struct timespec ts;
 
-	ready(current);
-	UFIBER_CIRCLEQ_REMOVE(&ready_queue, fiber, chain);
-	context_switch(fiber);
-	return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-void ufiber_exit(void *retval)
+/* convert an absolute time to a tick, rounding up so timeouts never fire
+ * early */
+static unsigned long timespec_to_tick(const struct timespec *ts)
 {
-	if (--fiber_count == 0)
-		exit(((long)retval));
+	return (unsigned long) ts->tv_sec * 1000
+		+ (ts->tv_nsec + 999999) / 1000000;
+}
 
-	current->rv = retval;
+static inline int timespec_valid(const struct timespec *ts)
+{
+	return ts->tv_nsec >= 0 && ts->tv_nsec < 1000000000;
+}
+
+static void timer_insert(struct ufiber *tcb)
+{
+	unsigned long when = tcb->expires;
+	unsigned long delta = when - wheel_tick;
+	unsigned level;
+
+	if ((long) delta < 0) {
+		when = wheel_tick;
+		delta = 0;
+	} else if (delta >= WHEEL_SPAN) {
+		when = wheel_tick + WHEEL_SPAN - 1;
+		delta = WHEEL_SPAN - 1;
+	}
+
+	for (level = 0; delta >> (WHEEL_BITS * (level + 1)); level++)
+		/* nothing */;
+
+	tcb->timer_level = level;
+	wheel_count[level]++;
+	UFIBER_LIST_INSERT_HEAD(
+		&wheel[level][(when >> (WHEEL_BITS * level)) & WHEEL_MASK],
+		tcb, timer);
+}
+
+static void timer_remove(struct ufiber *tcb)
+{
+	UFIBER_LIST_REMOVE(tcb, timer);
+	wheel_count[tcb->timer_level]--;
+	nr_timers--;
+}
+
+/* arm the timer of the current fiber to fire at tick 'expires' */
+static void timer_arm(unsigned long expires, unsigned long now)
+{
+	if (!nr_timers)
+		wheel_tick = now;
+	nr_timers++;
+	current->expires = expires;
+	current->timer_state = TIMER_ARMED;
+	timer_insert(current);
+}
+
+/* move the timers in the current slot of each level above 0 down a level,
+ * stopping at the first level that hasn't wrapped around */
+static void timer_cascade(void)
+{
+	struct timer_slot *slot, list;
+	struct ufiber *tcb;
+	unsigned idx;
+
+	for (unsigned level = 1; level < WHEEL_LEVELS; level++) {
+		idx = (wheel_tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+		slot = &wheel[level][idx];
+
+		/* detach the slot first: parked timers may land back in it */
+		UFIBER_LIST_INIT(&list);
+		if ((tcb = UFIBER_LIST_FIRST(slot)) != NULL) {
+			list.lh_first = tcb;
+			tcb->timer.le_prev = &list.lh_first;
+			UFIBER_LIST_INIT(slot);
+		}
+		while ((tcb = UFIBER_LIST_FIRST(&list)) != NULL) {
+			UFIBER_LIST_REMOVE(tcb, timer);
+			wheel_count[level]--;
+			timer_insert(tcb);
+		}
+
+		if (idx)
+			break;
+	}
+}
+
+/* Mutexes and channels may be shared between the workers of
+ * ufiber_run_workers(), so in workers their state is guarded by a spinlock;
+ * see wake_shared() and block_shared().  Other threads can't share them, and
+ * don't bother. */
+#if UFIBER_THREADS
+static inline void obj_lock(int *lock)
+{
+	unsigned spins = 0;
+
+	if (this_worker == NULL)
+		return;
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+		/* the holder may have been preempted */
+		if (++spins % 64 == 0)
+			sched_yield();
+	}
+}
+
+static inline void obj_unlock(int *lock)
+{
+	if (this_worker != NULL)
+		__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+#else
+#define obj_lock(lock)   ((void) 0)
+#define obj_unlock(lock) ((void) 0)
+#endif
+
+/* Take 'tcb' off the list it is blocked on.  Returns 0 if a fiber in another
+ * worker has done so already, in which case the wakeup is on its way. */
+static int unlink_blocked(struct ufiber *tcb)
+{
+#if UFIBER_THREADS
+	int unlinked;
+
+	if (tcb->blocked_lock != NULL) {
+		obj_lock(tcb->blocked_lock);
+		if ((unlinked = !tcb->woken))
+			UFIBER_CIRCLEQ_REMOVE(tcb->blocked_on, tcb, chain);
+		obj_unlock(tcb->blocked_lock);
+		return unlinked;
+	}
+#endif
+	UFIBER_CIRCLEQ_REMOVE(tcb->blocked_on, tcb, chain);
+	return 1;
+}
+
+/* wake a fiber whose timer has expired */
+static void timer_fire(struct ufiber *tcb)
+{
+	timer_remove(tcb);
+	if (!unlink_blocked(tcb)) {
+		tcb->timer_state = TIMER_IDLE;
+		return;
+	}
+#if UFIBER_STATS
+	stats_wake(tcb);
+#endif
+#if UFIBER_TRACE
+	trace(UFIBER_TRACE_WAKE, tcb, current, 1);
+#endif
+	tcb->timer_state = TIMER_EXPIRED;
+	ready(tcb);
+}
+
+/* fire all timers that are due */
+static void run_timers(void)
+{
+	struct timer_slot *slot;
+	unsigned long now, next;
+
+	if (!nr_timers)
+		return;
+
+	now = now_tick();
+	while ((long) (now - wheel_tick) >= 0 && nr_timers) {
+		if (!(wheel_tick & WHEEL_MASK))
+			timer_cascade();
+
+		slot = &wheel[0][wheel_tick & WHEEL_MASK];
+		while (!UFIBER_LIST_EMPTY(slot))
+			timer_fire(UFIBER_LIST_FIRST(slot));
+
+		/* skip ahead to the next cascade if level 0 is empty */
+		if (wheel_count[0]) {
+			wheel_tick++;
+			continue;
+		}
+		next = (wheel_tick | WHEEL_MASK) + 1;
+		if ((long) (next - now) > 0) {
+			wheel_tick = now + 1;
+			break;
+		}
+		wheel_tick = next;
+	}
+}
+
+/* milliseconds until the next timer may be due, or -1 if there are none */
+static int timer_timeout(void)
+{
+	unsigned long now, next;
+
+	if (!nr_timers)
+		return -1;
+
+	/* timers may cascade into level 0 at the next multiple of WHEEL_SIZE,
+	 * which is wheel_tick itself if that cascade hasn't happened yet */
+	next = wheel_tick;
+	if (wheel_tick & WHEEL_MASK) {
+		next = (wheel_tick | WHEEL_MASK) + 1;
+		for (unsigned long t = wheel_tick; t != next; t++) {
+			if (!UFIBER_LIST_EMPTY(&wheel[0][t & WHEEL_MASK])) {
+				next = t;
+				break;
+			}
+		}
+	}
+
+	now = now_tick();
+	if ((long) (next - now) <= 0)
+		return 0;
+	if (next - now > INT_MAX)
+		return INT_MAX;
+	return next - now;
+}
+
+/* sleep the thread until the next timer is due */
+static noinline void idle(int timeout)
+{
+	struct timespec ts;
+
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = (timeout % 1000) * 1000000L;
+	nanosleep(&ts, NULL);
+}
+
+/* copy the live part of the stack of 'fiber', which owns a shared stack, to
+ * its buffer */
+static void shared_save(struct ufiber *fiber)
+{
+	char *top = fiber->sstack->base + SHARED_STACK_SIZE;
+	size_t len = top - (char*) fiber->sp;
+	char *buf;
+
+	/* There's no way to report an error from here: the fiber's frames
+	 * must go somewhere. */
+	if (len > fiber->saved_size || len < fiber->saved_size / 4) {
+		if ((buf = realloc(fiber->saved, len)) == NULL)
+			abort();
+		fiber->saved = buf;
+		fiber->saved_size = len;
+	}
+	memcpy(fiber->saved, fiber->sp, len);
+	fiber->saved_len = len;
+}
+
+static void *copier_main(void *unused)
+{
+	struct shared_stack *ss;
+	struct ufiber *fiber;
+	char *top;
+
+	for (;;) {
+		fiber = copy_to;
+		ss = fiber->sstack;
+		top = ss->base + SHARED_STACK_SIZE;
+
+		if (ss->owner)
+			shared_save(ss->owner);
+		if (fiber->sp)
+			memcpy(top - fiber->saved_len, fiber->saved,
+					fiber->saved_len);
+		else
+			fiber->sp = _ufiber_create(ss->base, SHARED_STACK_SIZE,
+					fiber->start_routine, fiber->arg,
+					_ufiber_trampoline, ufiber_exit);
+		ss->owner = fiber;
+
+		current = fiber;
+		_ufiber_switch(&copier_sp, &fiber->sp);
+	}
+	return NULL;
+}
+
+/* assign a shared stack to a new fiber */
+static noinline int shared_assign(struct ufiber *tcb)
+{
+	struct shared_stack *ss;
+	size_t guard = default_guard_size();
+
+	if (copier_stack == NULL) {
+		copier_stack = stack_alloc(COPIER_STACK_SIZE, guard);
+		if (copier_stack == NULL)
+			return ENOMEM;
+		copier_sp = _ufiber_create(copier_stack, COPIER_STACK_SIZE,
+				copier_main, NULL, _ufiber_trampoline, NULL);
+	}
+
+	ss = &shared_stacks[next_shared];
+	if (ss->base == NULL) {
+		ss->base = stack_alloc(SHARED_STACK_SIZE, guard);
+		if (ss->base == NULL)
+			return ENOMEM;
+	}
+	next_shared = (next_shared + 1) % NR_SHARED_STACKS;
+
+	tcb->sstack = ss;
+	tcb->sp = NULL;
+	tcb->saved_len = 0;
+	return 0;
+}
+
+#if UFIBER_THREADS
+static void shared_fini(void)
+{
+	size_t guard = default_guard_size();
+
+	for (unsigned i = 0; i < NR_SHARED_STACKS; i++) {
+		if (shared_stacks[i].base)
+			stack_free(shared_stacks[i].base, SHARED_STACK_SIZE,
+					guard);
+	}
+	if (copier_stack)
+		stack_free(copier_stack, COPIER_STACK_SIZE, guard);
+}
+#endif
+
+static no_split_stack void context_switch(struct ufiber *fiber)
+{
+	void *save_sp = &current->sp;
+#if UFIBER_STATS
+	unsigned long long now;
+#endif
+
+	if (fiber == current)
+		return;
+
+#if UFIBER_STATS
+	now = fast_clock();
+	if (current->state != FS_BLOCKED)
+		current->stats.run_ns += now - switch_stamp;
+	fiber->stats.switches++;
+	switch_stamp = now;
+#endif
+#if UFIBER_TRACE
+	trace(UFIBER_TRACE_SWITCH, current, fiber, 0);
+#endif
+#if UFIBER_SPLIT_STACK
+	/* Nothing compiled with -fsplit-stack may be called between here
+	 * and the switch.  A fiber on a shared stack has an empty context,
+	 * which is also what the copier runs with. */
+	__splitstack_getcontext(current->split_ctx);
+	__splitstack_setcontext(fiber->split_ctx);
+#endif
+	if (fiber->sstack && fiber->sstack->owner != fiber) {
+		copy_to = fiber;
+		_ufiber_switch(save_sp, &copier_sp);
+		return;
+	}
+
+	current = fiber;
+	_ufiber_switch(save_sp, &fiber->sp);
+}
+
+/* add 'fiber' to the ready queue */
+static inline void ready(struct ufiber *fiber)
+{
+	fiber->state = FS_READY;
+	UFIBER_CIRCLEQ_INSERT_TAIL(&ready_queues[fiber->prio], fiber, chain);
+	ready_mask |= 1UL << fiber->prio;
+}
+
+/* remove a ready fiber from its run queue */
+static inline void unready(struct ufiber *fiber)
+{
+	struct ufiber_waitlist *queue = &ready_queues[fiber->prio];
+
+	UFIBER_CIRCLEQ_REMOVE(queue, fiber, chain);
+	if (UFIBER_CIRCLEQ_EMPTY(queue))
+		ready_mask &= ~(1UL << fiber->prio);
+}
+
+/* index of the most significant bit set in 'mask', which must be non-zero */
+static inline unsigned highest_bit(unsigned long mask)
+{
+#if __GNUC__
+	return sizeof(mask) * CHAR_BIT - 1 - __builtin_clzl(mask);
+#else
+	unsigned bit = 0;
+
+	while (mask >>= 1)
+		bit++;
+	return bit;
+#endif
+}
+
+/* Find 'addr', which may point into the stack of 'tcb', while 'tcb' isn't
+ * running: a fiber that isn't the owner of its shared stack keeps its frames
+ * in its 'saved' buffer. */
+static inline void *stack_addr(struct ufiber *tcb, void *addr)
+{
+	char *top;
+
+	if (tcb->sstack == NULL || tcb->sstack->owner == tcb)
+		return addr;
+
+	top = tcb->sstack->base + SHARED_STACK_SIZE;
+	if ((char*) addr < top - tcb->saved_len || (char*) addr >= top)
+		return addr;
+	return tcb->saved + ((char*) addr - (top - tcb->saved_len));
+}
+
+/* ready 'tcb', which has been taken off the list it was blocked on,
+ * returning 'retval' */
+static inline void wake_unlinked(struct ufiber *tcb, void *retval)
+{
+	if (tcb->timer_state == TIMER_ARMED) {
+		timer_remove(tcb);
+		tcb->timer_state = TIMER_IDLE;
+	}
+#if UFIBER_STATS
+	stats_wake(tcb);
+#endif
+#if UFIBER_TRACE
+	trace(UFIBER_TRACE_WAKE, tcb, current, 0);
+#endif
+	if (tcb->ptr != NULL)
+		*(void**) stack_addr(tcb, tcb->ptr) = retval;
+	ready(tcb);
+}
+
+/* unblock 'fiber', returning 'retval' */
+static inline void wake(struct ufiber *tcb, void *retval)
+{
+	UFIBER_CIRCLEQ_REMOVE(tcb->blocked_on, tcb, chain);
+	wake_unlinked(tcb, retval);
+}
+
+static inline void wake_one(struct ufiber_waitlist *list, void *retval)
+{
+	if (!UFIBER_CIRCLEQ_EMPTY(list))
+		wake(UFIBER_CIRCLEQ_FIRST(list), retval);
+}
+
+/* wake all fibers on 'list', retunning 'val' to each */
+static inline void wake_all(struct ufiber_waitlist *list, void *val)
+{
+	struct ufiber *pos, *n;
+
+	UFIBER_CIRCLEQ_FOREACH_SAFE(pos, list, chain, n)
+		wake(pos, val);
+}
+
+/* ring the doorbell of 'rq' if its scheduler may be asleep */
+static void remote_ring(struct remote_queue *rq)
+{
+	uint64_t one = 1;
+
+	if (__atomic_load_n(&rq->sleeping, __ATOMIC_SEQ_CST)
+			&& !__atomic_exchange_n(&rq->rung, 1, __ATOMIC_ACQ_REL)) {
+		while (write(rq->bell_wr, &one, sizeof(one)) < 0 && errno == EINTR)
+			;
+	}
+}
+
+/* Ready the fibers on the injection queue that are waiting for their remote
+ * wakeups; the others find theirs when they call ufiber_wait_remote(). */
+static noinline void remote_drain(void)
+{
+	struct _ufiber_completion *c, *c_next;
+	struct ufiber *tcb, *next, *list = NULL;
+	void *value;
+
+#if UFIBER_THREADS
+	tcb = __atomic_exchange_n(&remote.woken, NULL, __ATOMIC_ACQUIRE);
+	for (; tcb != NULL; tcb = next) {
+		next = tcb->woken_next;
+		tcb->woken_next = list;
+		list = tcb;
+	}
+	for (tcb = list; tcb != NULL; tcb = next) {
+		next = tcb->woken_next;
+		tcb->woken = 0;
+		wake_unlinked(tcb, tcb->woken_rv);
+	}
+	list = NULL;
+#endif
+
+	c = __atomic_exchange_n(&remote.done, NULL, __ATOMIC_ACQUIRE);
+	for (; c != NULL; c = c_next) {
+		c_next = c->next;
+		c->done = 1;
+		tcb = c->fiber;
+		if (tcb->state == FS_BLOCKED
+				&& tcb->blocked_on == &completion_waiters)
+			wake(tcb, NULL);
+	}
+
+	tcb = __atomic_exchange_n(&remote.head, NULL, __ATOMIC_ACQUIRE);
+	for (; tcb != NULL; tcb = next) {
+		next = tcb->remote_next;
+		tcb->remote_next = list;
+		list = tcb;
+	}
+
+	for (tcb = list; tcb != NULL; tcb = next) {
+		next = tcb->remote_next;
+		if (tcb->state != FS_BLOCKED || tcb->blocked_on != &remote_waiters) {
+			tcb->remote_state = REMOTE_EARLY;
+			continue;
+		}
+		/* the next wakeup may reuse 'remote_next' and 'rv' as soon as
+		 * the state is idle */
+		value = tcb->rv;
+		__atomic_store_n(&tcb->remote_state, REMOTE_IDLE,
+				__ATOMIC_RELEASE);
+		wake(tcb, value);
+	}
+}
+
+/* check whether remote_drain() has anything to do */
+static inline int remote_pending(int order)
+{
+	return __atomic_load_n(&remote.head, order) != NULL
+		|| __atomic_load_n(&remote.done, order) != NULL
+#if UFIBER_THREADS
+		|| __atomic_load_n(&remote.woken, order) != NULL
+#endif
+		;
+}
+
+/* sleep until a remote wakeup arrives, the poller has something for us, or
+ * 'timeout' milliseconds have passed */
+static noinline void remote_sleep(int timeout)
+{
+	struct pollfd pfd;
+	uint64_t buf[8];
+
+	__atomic_store_n(&remote.sleeping, 1, __ATOMIC_SEQ_CST);
+	if (!remote_pending(__ATOMIC_SEQ_CST)
+			&& (!_ufiber_poller || _ufiber_poller->poll(timeout) < 0)) {
+		pfd.fd = remote.doorbell;
+		pfd.events = POLLIN;
+		poll(&pfd, 1, timeout);
+	}
+	__atomic_store_n(&remote.sleeping, 0, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&remote.rung, 0, __ATOMIC_SEQ_CST);
+
+	/* a late waker may ring after this, which costs a spurious wakeup
+	 * next time, but never a lost one */
+	while (read(remote.doorbell, buf, sizeof(buf)) > 0)
+		;
+	remote_drain();
+}
+
+#if UFIBER_THREADS
+static int worker_feed(int idle);
+#endif
+
+/* choose a new fiber to run, and run it: the first fiber in the run queue of
+ * the highest priority with any ready fibers */
+static void schedule(void)
+{
+	struct ufiber_waitlist *queue;
+	struct ufiber *tcb, *next;
+	int timeout;
+
+	if (remote_pending(__ATOMIC_RELAXED))
+		remote_drain();
+
+	if (++poll_ticks >= POLL_INTERVAL) {
+		poll_ticks = 0;
+		if (_ufiber_poller)
+			_ufiber_poller->poll(0);
+		run_timers();
+#if UFIBER_THREADS
+		worker_feed(0);
+#endif
+	}
+
+	while (!ready_mask) {
+#if UFIBER_THREADS
+		if (worker_feed(1))
+			break;
+#endif
+		timeout = timer_timeout();
+		if (nr_remote_waiters) {
+			remote_sleep(timeout);
+		} else if (_ufiber_poller && _ufiber_poller->poll(timeout) >= 0) {
+			/* polled */
+		} else if (timeout >= 0) {
+			idle(timeout);
+		} else {
+			wake(last_blocked, (void*) EDEADLK);
+			break;
+		}
+		run_timers();
+	}
+
+	queue = &ready_queues[highest_bit(ready_mask)];
+	tcb = UFIBER_CIRCLEQ_FIRST(queue);
+	unready(tcb);
+
+	/* The fiber now at the head of the queue is likely to run next: warm
+	 * up the top of its stack, which its switch will pop registers off,
+	 * and the TCB behind it, which unready() will touch. */
+	if (!UFIBER_CIRCLEQ_EMPTY(queue)) {
+		next = UFIBER_CIRCLEQ_FIRST(queue);
+		prefetch(next->sp);
+		prefetch(UFIBER_CIRCLEQ_NEXT(next, chain));
+	}
+
+	context_switch(tcb);
+}
+
+/* run 'fiber', which must be ready, in place of the current fiber */
+static void switch_to(struct ufiber *fiber)
+{
+	ready(current);
+	unready(fiber);
+	context_switch(fiber);
+}
+
+/* queue the current fiber on 'list' as blocked, without switching away yet */
+static void block_prepare(struct ufiber_waitlist *list, void **rv, int wait)
+{
+#if UFIBER_STATS
+	stats_block(wait);
+#endif
+#if UFIBER_TRACE
+	trace(UFIBER_TRACE_BLOCK, current, NULL, wait);
+#endif
+	current->ptr = rv;
+	current->state = FS_BLOCKED;
+	current->blocked_on = list;
+	UFIBER_CIRCLEQ_INSERT_TAIL(list, current, chain);
+
+	last_blocked = current;
+}
+
+/* block 'fiber' on a given wait queue; 'wait' is a UFIBER_WAIT_* constant
+ * saying what for */
+static void block(struct ufiber_waitlist *list, void **rv, int wait)
+{
+	block_prepare(list, rv, wait);
+	schedule();
+}
+
+/* Block on 'list' until woken, or until tick 'expires'.  Returns ETIMEDOUT if
+ * the timeout expired (in which case nothing is stored through 'rv'), or 0
+ * otherwise. */
+static int block_until(struct ufiber_waitlist *list, void **rv, int wait,
+		unsigned long expires)
+{
+	unsigned long now = now_tick();
+
+	if ((long) (expires - now) <= 0)
+		return ETIMEDOUT;
+
+	timer_arm(expires, now);
+	block(list, rv, wait);
+
+	if (current->timer_state == TIMER_EXPIRED) {
+		current->timer_state = TIMER_IDLE;
+		return ETIMEDOUT;
+	}
+	return 0;
+}
+
+/* block_until() with an absolute CLOCK_MONOTONIC deadline; if 'abstime' is
+ * NULL, waits indefinitely */
+static int block_timed(struct ufiber_waitlist *list, void **rv, int wait,
+		const struct timespec *abstime)
+{
+	if (abstime == NULL) {
+		block(list, rv, wait);
+		return 0;
+	}
+	return block_until(list, rv, wait, timespec_to_tick(abstime));
+}
+
+/* Wake 'tcb', which is blocked on a list guarded by a lock that the caller
+ * holds.  A fiber of another worker can't be readied from here: it is taken
+ * off the list and pushed onto its scheduler's 'woken' stack instead, for
+ * remote_drain() to ready.  Returns 1 if 'tcb' was readied here. */
+static int wake_shared(struct ufiber *tcb, void *retval)
+{
+#if UFIBER_THREADS
+	struct remote_queue *rq = tcb->slab->remote;
+	struct ufiber *head;
+
+	if (rq != &remote) {
+		UFIBER_CIRCLEQ_REMOVE(tcb->blocked_on, tcb, chain);
+		tcb->woken = 1;
+		tcb->woken_rv = retval;
+		head = __atomic_load_n(&rq->woken, __ATOMIC_RELAXED);
+		do {
+			tcb->woken_next = head;
+		} while (!__atomic_compare_exchange_n(&rq->woken, &head, tcb,
+					1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+		remote_ring(rq);
+		return 0;
+	}
+#endif
+	wake(tcb, retval);
+	return 1;
+}
+
+static void wake_all_shared(struct ufiber_waitlist *list, void *val)
+{
+	struct ufiber *pos, *n;
+
+	UFIBER_CIRCLEQ_FOREACH_SAFE(pos, list, chain, n)
+		wake_shared(pos, val);
+}
+
+/* block_timed() on a list guarded by 'lock', which the caller holds; it is
+ * released once the fiber is on the list, and not taken again */
+static int block_shared(struct ufiber_waitlist *list, int *lock, void **rv,
+		int wait, const struct timespec *abstime)
+{
+#if UFIBER_THREADS
+	unsigned long expires, now;
+
+	if (abstime != NULL) {
+		expires = timespec_to_tick(abstime);
+		now = now_tick();
+		if ((long) (expires - now) <= 0) {
+			obj_unlock(lock);
+			return ETIMEDOUT;
+		}
+		timer_arm(expires, now);
+	}
+
+	/* other workers may wake us, so this isn't a deadlock as long as
+	 * they run */
+	block_prepare(list, rv, wait);
+	current->blocked_lock = lock;
+	if (this_worker != NULL)
+		nr_remote_waiters++;
+	obj_unlock(lock);
+	schedule();
+	if (this_worker != NULL)
+		nr_remote_waiters--;
+	current->blocked_lock = NULL;
+
+	if (current->timer_state == TIMER_EXPIRED) {
+		current->timer_state = TIMER_IDLE;
+		return ETIMEDOUT;
+	}
+	return 0;
+#else
+	return block_timed(list, rv, wait, abstime);
+#endif
+}
+
+void _ufiber_block(struct ufiber_waitlist *list, void **rv, int wait)
+{
+	block(list, rv, wait);
+}
+
+/* check whether [addr, addr+len) overlaps the current fiber's shared stack */
+int _ufiber_on_shared_stack(const void *addr, size_t len)
+{
+	const char *base;
+
+	if (current->sstack == NULL)
+		return 0;
+	base = current->sstack->base;
+	return (const char*) addr < base + SHARED_STACK_SIZE
+		&& (const char*) addr + len > base;
+}
+
+void _ufiber_wake(struct ufiber *fiber, void *rv)
+{
+	wake(fiber, rv);
+}
+
+void _ufiber_wake_one(struct ufiber_waitlist *list, void *rv)
+{
+	wake_one(list, rv);
+}
+
+void _ufiber_wake_all(struct ufiber_waitlist *list, void *rv)
+{
+	wake_all(list, rv);
+}
+
+int _ufiber_doorbell(void)
+{
+	return remote.doorbell;
+}
+
+/* API */
+
+int ufiber_init(void)
+{
+	struct ufiber *tcb;
+
+	for (unsigned i = 0; i < NR_PRIOS; i++)
+		UFIBER_CIRCLEQ_INIT(&ready_queues[i]);
+	UFIBER_CIRCLEQ_INIT(&drained);
+	UFIBER_CIRCLEQ_INIT(&sleepers);
+	UFIBER_CIRCLEQ_INIT(&remote_waiters);
+	UFIBER_CIRCLEQ_INIT(&completion_waiters);
+	for (unsigned i = 0; i < NR_BINS; i++)
+		UFIBER_CIRCLEQ_INIT(&free_bins[i].list);
+
+#if UFIBER_TRACE
+	trace_buf = malloc(TRACE_EVENTS * sizeof(*trace_buf));
+	if (trace_buf == NULL)
+		return ENOMEM;
+	trace_head = 0;
+	next_id = 0;
+#endif
+
+	/* the top-level fiber runs on the process stack */
+	if ((tcb = alloc_tcb(0, 0)) == NULL)
+		return ENOMEM;
+
+	tcb->state = FS_READY;
+	tcb->timer_state = TIMER_IDLE;
+	tcb->prio = UFIBER_PRIO_DEFAULT;
+	tcb->ref = 100;
+	tcb->name[0] = '\0';
+	tcb->remote_state = REMOTE_IDLE;
+#if UFIBER_THREADS
+	tcb->blocked_lock = NULL;
+	tcb->woken = 0;
+#endif
+	UFIBER_CIRCLEQ_INIT(&tcb->blocked);
+#if UFIBER_STATS
+	stats_init(tcb);
+#endif
+#if UFIBER_TRACE
+	tcb->id = 0;
+#endif
+#if UFIBER_STATS || UFIBER_TRACE
+	clock_calibrate();
+#endif
+#if UFIBER_STATS
+	switch_stamp = calib_clock;
+#endif
+
+	root = current = tcb;
+	return 0;
+}
+
+int ufiber_set_cache_size(unsigned size)
+{
+	if (size == 0)
+		return EINVAL;
+
+	free_max = size;
+	for (unsigned i = 0; i < NR_BINS; i++)
+		while (free_bins[i].count > free_max)
+			destroy_tcb(evict_tcb(&free_bins[i]));
+	return 0;
+}
+
+int ufiber_stack_usage(ufiber_t fiber, size_t *usage)
+{
+#if UFIBER_STACK_PAINT
+	if (fiber->stack == NULL)
+		return EINVAL;
+	*usage = stack_usage(fiber);
+	return 0;
+#else
+	return ENOSYS;
+#endif
+}
+
+int ufiber_stats(ufiber_t fiber, struct ufiber_stats *stats)
+{
+#if UFIBER_STATS
+	unsigned long long now = fast_clock();
+	double scale = clock_scale();
+
+	/* include the time of the current run or wait */
+	*stats = fiber->stats;
+	if (fiber == current)
+		stats->run_ns += now - switch_stamp;
+	if (fiber->state == FS_BLOCKED)
+		stats->blocked_ns[stats->waiting] += now - fiber->blocked_at;
+
+	stats->run_ns *= scale;
+	for (int i = 0; i < UFIBER_NR_WAITS; i++)
+		stats->blocked_ns[i] *= scale;
+	return 0;
+#else
+	return ENOSYS;
+#endif
+}
+
+int ufiber_foreach(int (*fn)(ufiber_t fiber, void *arg), void *arg)
+{
+	struct ufiber *tcb;
+	int rc;
+
+	UFIBER_LIST_FOREACH(tcb, &all_tcbs, all) {
+		if (tcb->state != FS_DEAD && (rc = fn(tcb, arg)))
+			return rc;
+	}
+	return 0;
+}
+
+int ufiber_trace_dump(int fd)
+{
+#if UFIBER_TRACE
+	struct ufiber_trace_header hdr;
+	struct ufiber_trace_name name;
+	unsigned long first, n, len;
+	struct ufiber *tcb;
+	int error;
+
+	n = trace_head < TRACE_EVENTS ? trace_head : TRACE_EVENTS;
+	first = (trace_head - n) % TRACE_EVENTS;
+	len = n < TRACE_EVENTS - first ? n : TRACE_EVENTS - first;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, UFIBER_TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = UFIBER_TRACE_VERSION;
+	hdr.worker = ufiber_worker_id();
+	hdr.nr_events = n;
+	UFIBER_LIST_FOREACH(tcb, &all_tcbs, all) {
+		if (tcb->name[0])
+			hdr.nr_names++;
+	}
+	hdr.base_tick = calib_clock;
+	hdr.base_ns = calib_ns;
+	hdr.ns_per_tick = clock_scale();
+
+	/* the ring, oldest event first, may be in two pieces */
+	if ((error = write_all(fd, &hdr, sizeof(hdr)))
+			|| (error = write_all(fd, trace_buf + first,
+					len * sizeof(*trace_buf)))
+			|| (error = write_all(fd, trace_buf,
+					(n - len) * sizeof(*trace_buf))))
+		return error;
+
+	/* cached TCBs keep the id and name of the last fiber to use them */
+	UFIBER_LIST_FOREACH(tcb, &all_tcbs, all) {
+		if (!tcb->name[0])
+			continue;
+		memset(&name, 0, sizeof(name));
+		name.fiber = tcb->id;
+		memcpy(name.name, tcb->name, sizeof(name.name));
+		if ((error = write_all(fd, &name, sizeof(name))))
+			return error;
+	}
+	return 0;
+#else
+	return ENOSYS;
+#endif
+}
+
+int ufiber_mem_stats(struct ufiber_mem_stats *stats)
+{
+	struct ufiber *tcb;
+	unsigned long nr_tcbs = 0;
+
+	stats->fibers = fiber_count;
+	stats->tcbs_cached = 0;
+	for (unsigned i = 0; i < NR_BINS; i++)
+		stats->tcbs_cached += free_bins[i].count;
+
+	stats->stack_reserved = 0;
+	stats->stack_committed = 0;
+	stats->stack_max_usage = 0;
+#if UFIBER_STACK_PAINT
+	stats->stack_max_usage = stack_max_usage;
+#endif
+	stats->stack_saved = 0;
+	UFIBER_LIST_FOREACH(tcb, &all_tcbs, all) {
+		nr_tcbs++;
+		stats->stack_saved += tcb->saved_size;
+		if (!tcb->bin)
+			continue;
+		stats->stack_reserved += tcb->stack_size + tcb->guard_size;
+		stats->stack_committed += stack_committed(tcb->stack,
+				tcb->stack_size);
+#if UFIBER_STACK_PAINT
+		if (stack_usage(tcb) > stats->stack_max_usage)
+			stats->stack_max_usage = stack_usage(tcb);
+#endif
+	}
+	for (unsigned i = 0; i < NR_SHARED_STACKS; i++) {
+		if (!shared_stacks[i].base)
+			continue;
+		stats->stack_reserved += SHARED_STACK_SIZE
+			+ default_guard_size();
+		stats->stack_committed += stack_committed(
+				shared_stacks[i].base, SHARED_STACK_SIZE);
+	}
+	stats->tcbs_live = nr_tcbs - stats->tcbs_cached;
+	return 0;
+}
+
+#if UFIBER_THREADS
+/*
+ * Work stealing
+ *
+ * A fiber created with UFIBER_STEALABLE in a worker isn't set up right away:
+ * its start routine, argument and flags are pushed onto the bottom of the
+ * worker's deque (a Chase-Lev deque of fixed size), and the fiber is created
+ * by whichever worker takes them off it.  The owner takes spawns from the
+ * bottom when it has nothing else to run, and once every POLL_INTERVAL calls
+ * to schedule() so that they can't starve; other workers steal from the top
+ * when they run out of fibers.  Fibers don't move once they have started:
+ * waitlists belong to a single scheduler, and compiled code may keep the
+ * address of a thread-local variable across a switch.
+ *
+ * schedule() can't create fibers itself, since it may be running on the stack
+ * of an exiting fiber whose TCB is back in the cache, so it hands the spawns
+ * it takes to the worker's root fiber, which waits on 'drained' for them.
+ *
+ * 'work' counts pending spawns plus busy workers (those with fibers other
+ * than their root); once it drops to zero, nothing is left that could spawn
+ * more, and the workers exit.  Idle workers sleep on 'wake', and spawners
+ * signal it if 'sleeping' says there's anyone to wake.
+ */
+
+#define DEQUE_SIZE 1024 // pending spawns per worker; must be a power of 2
+
+struct spawn {
+	void *(*start_routine)(void*);
+	void *arg;
+	unsigned long flags;
+};
+
+struct team {
+	struct worker *workers;
+	unsigned nr_workers;
+	long work;         // pending spawns plus busy workers
+	unsigned sleeping; // idle workers waiting on 'wake'
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+};
+
+struct worker {
+	pthread_t thread;
+	unsigned id;
+	void *(*start_routine)(void*);
+	void *arg;
+	int error;
+	struct team *team;
+	long bottom; // next slot to push to; written by the owner only
+	struct spawn deque[DEQUE_SIZE];
+	long top;    // next slot to steal from
+};
+
+static UFIBER_TLS unsigned worker_id;
+static UFIBER_TLS struct spawn taken;         // handed to the root fiber
+static UFIBER_TLS unsigned next_victim;
+
+static void spawn_load(struct worker *w, long i, struct spawn *sp)
+{
+	struct spawn *slot = &w->deque[i & (DEQUE_SIZE - 1)];
+
+	sp->start_routine = __atomic_load_n(&slot->start_routine,
+			__ATOMIC_RELAXED);
+	sp->arg = __atomic_load_n(&slot->arg, __ATOMIC_RELAXED);
+	sp->flags = __atomic_load_n(&slot->flags, __ATOMIC_RELAXED);
+}
+
+/* push a spawn onto the bottom of our deque; fails if it is full */
+static int deque_push(struct worker *w, const struct spawn *sp)
+{
+	long b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED);
+	long t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+	struct spawn *slot = &w->deque[b & (DEQUE_SIZE - 1)];
+
+	if (b - t >= DEQUE_SIZE)
+		return 0;
+	__atomic_store_n(&slot->start_routine, sp->start_routine,
+			__ATOMIC_RELAXED);
+	__atomic_store_n(&slot->arg, sp->arg, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->flags, sp->flags, __ATOMIC_RELAXED);
+	__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* take the newest spawn off the bottom of our deque */
+static int deque_take(struct worker *w, struct spawn *sp)
+{
+	long b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED) - 1;
+	long t;
+	int found = 1;
+
+	__atomic_store_n(&w->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	t = __atomic_load_n(&w->top, __ATOMIC_RELAXED);
+	if (t > b) {
+		__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	spawn_load(w, b, sp);
+	if (t == b) {
+		/* the last one: thieves may be after it too */
+		found = __atomic_compare_exchange_n(&w->top, &t, t + 1, 0,
+				__ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+		__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+	return found;
+}
+
+/* steal the oldest spawn off the top of another worker's deque */
+static int deque_steal(struct worker *w, struct spawn *sp)
+{
+	long t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+	long b;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	b = __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+	if (t >= b)
+		return 0;
+
+	/* if the owner has reused the slot, 'top' has moved on, and the
+	 * exchange fails */
+	spawn_load(w, t, sp);
+	return __atomic_compare_exchange_n(&w->top, &t, t + 1, 0,
+			__ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+/* find a spawn to start: one of our own, or else another worker's */
+static int find_work(struct spawn *sp)
+{
+	struct team *team = this_worker->team;
+	struct worker *victim;
+
+	if (deque_take(this_worker, sp))
+		return 1;
+	for (unsigned i = 0; i < team->nr_workers; i++) {
+		victim = &team->workers[next_victim++ % team->nr_workers];
+		if (victim != this_worker && deque_steal(victim, sp))
+			return 1;
+	}
+	return 0;
+}
+
+/* check whether any worker has spawns pending */
+static int team_has_work(struct team *team)
+{
+	struct worker *w;
+
+	for (unsigned i = 0; i < team->nr_workers; i++) {
+		w = &team->workers[i];
+		if (__atomic_load_n(&w->top, __ATOMIC_ACQUIRE)
+				< __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE))
+			return 1;
+	}
+	return 0;
+}
+
+static void work_done(struct team *team)
+{
+	if (__atomic_sub_fetch(&team->work, 1, __ATOMIC_SEQ_CST) == 0) {
+		pthread_mutex_lock(&team->lock);
+		pthread_cond_broadcast(&team->wake);
+		pthread_mutex_unlock(&team->lock);
+	}
+}
+
+/* queue a fiber for whichever worker gets to it first */
+static int worker_spawn(unsigned long flags, void *(*start_routine)(void*),
+		void *arg)
+{
+	struct team *team = this_worker->team;
+	struct spawn sp = { start_routine, arg, flags };
+
+	__atomic_add_fetch(&team->work, 1, __ATOMIC_SEQ_CST);
+	if (!deque_push(this_worker, &sp)) {
+		work_done(team);
+		return 0;
+	}
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&team->sleeping, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&team->lock);
+		pthread_cond_signal(&team->wake);
+		pthread_mutex_unlock(&team->lock);
+	}
+	return 1;
+}
+
+/* Called by schedule(): if the root fiber is waiting, take a spawn and wake
+ * the root to start it.  Unless 'idle' is set, only our own deque is looked
+ * at.  Returns 1 if the root was woken. */
+static int worker_feed(int idle)
+{
+	if (this_worker == NULL || UFIBER_CIRCLEQ_EMPTY(&drained))
+		return 0;
+	if (!(idle ? find_work(&taken) : deque_take(this_worker, &taken)))
+		return 0;
+	wake(root, &taken);
+	return 1;
+}
+
+/* create the fiber described by 'sp' */
+static void worker_start(const struct spawn *sp)
+{
+	unsigned long flags = (sp->flags & ~UFIBER_STEALABLE) | UFIBER_DETACHED;
+	int error;
+
+	error = ufiber_create(NULL, flags, sp->start_routine, sp->arg);
+	if (error && !this_worker->error)
+		this_worker->error = error;
+}
+
+/* Wait, with no fibers of our own, for a spawn to start.  Returns 0 once
+ * there is no work left in any worker. */
+static int worker_idle(void)
+{
+	struct team *team = this_worker->team;
+	struct spawn sp;
+	int done;
+
+	for (;;) {
+		if (find_work(&sp)) {
+			worker_start(&sp);
+			if (fiber_count > 1)
+				return 1;
+			work_done(team); // couldn't start it
+			continue;
+		}
+
+		pthread_mutex_lock(&team->lock);
+		__atomic_add_fetch(&team->sleeping, 1, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&team->work, __ATOMIC_SEQ_CST)
+				&& !team_has_work(team))
+			pthread_cond_wait(&team->wake, &team->lock);
+		__atomic_sub_fetch(&team->sleeping, 1, __ATOMIC_SEQ_CST);
+		done = __atomic_load_n(&team->work, __ATOMIC_SEQ_CST) == 0;
+		pthread_mutex_unlock(&team->lock);
+		if (done)
+			return 0;
+	}
+}
+
+/* release all cached TCBs */
+static void flush_tcb_cache(void)
+{
+	for (unsigned i = 0; i < NR_BINS; i++)
+		while (free_bins[i].count)
+			destroy_tcb(evict_tcb(&free_bins[i]));
+}
+
+/* Worker thread: runs the initial fiber, and then fibers taken off its own
+ * deque or stolen from others, until there is no work left in any worker. */
+static void *worker_main(void *data)
+{
+	struct worker *w = data;
+	struct spawn *sp;
+
+	worker_id = w->id;
+	if ((w->error = ufiber_init())) {
+		work_done(w->team);
+		return NULL;
+	}
+
+	this_worker = w;
+	/* fibers blocked on shared objects may sleep on the doorbell */
+	if ((w->error = _ufiber_remote_prepare())) {
+		work_done(w->team);
+		goto out;
+	}
+	w->error = ufiber_create(NULL, UFIBER_DETACHED, w->start_routine,
+			w->arg);
+	for (;;) {
+		sp = NULL;
+		if (fiber_count > 1)
+			block(&drained, (void**) &sp, UFIBER_WAIT_OTHER);
+		if (sp != NULL) {
+			/* handed over by schedule() while we were busy */
+			worker_start(sp);
+			work_done(w->team);
+			continue;
+		}
+		work_done(w->team);
+		if (!worker_idle())
+			break;
+	}
+out:
+	this_worker = NULL;
+
+	if (_ufiber_poller)
+		_ufiber_poller->fini();
+	if (remote.doorbell >= 0) {
+		if (remote.bell_wr != remote.doorbell)
+			close(remote.bell_wr);
+		close(remote.doorbell);
+		remote.doorbell = remote.bell_wr = -1;
+	}
+	flush_tcb_cache();
+	destroy_tcb(root);
+	shared_fini();
+#if UFIBER_TRACE
+	free(trace_buf);
+	trace_buf = NULL;
+#endif
+	return NULL;
+}
+
+int ufiber_run_workers(unsigned nr_workers, void *(*start_routine)(void*),
+		void *arg)
+{
+	struct team team;
+	struct worker *workers;
+	unsigned i, started;
+	int error = 0;
+
+	if (nr_workers == 0)
+		return EINVAL;
+	if ((workers = malloc(nr_workers * sizeof(*workers))) == NULL)
+		return ENOMEM;
+
+	team.workers = workers;
+	team.nr_workers = nr_workers;
+	team.work = nr_workers;
+	team.sleeping = 0;
+	pthread_mutex_init(&team.lock, NULL);
+	pthread_cond_init(&team.wake, NULL);
+	for (i = 0; i < nr_workers; i++) {
+		workers[i].id = i;
+		workers[i].start_routine = start_routine;
+		workers[i].arg = arg;
+		workers[i].error = 0;
+		workers[i].team = &team;
+		workers[i].top = workers[i].bottom = 0;
+	}
+
+	for (started = 0; started < nr_workers; started++) {
+		error = pthread_create(&workers[started].thread, NULL,
+				worker_main, &workers[started]);
+		if (error)
+			break;
+	}
+	for (i = started; i < nr_workers; i++)
+		work_done(&team);
+
+	for (i = 0; i < started; i++) {
+		pthread_join(workers[i].thread, NULL);
+		if (!error)
+			error = workers[i].error;
+	}
+
+	pthread_cond_destroy(&team.wake);
+	pthread_mutex_destroy(&team.lock);
+	free(workers);
+	return error;
+}
+
+unsigned ufiber_worker_id(void)
+{
+	return worker_id;
+}
+#else
+int ufiber_run_workers(unsigned nr_workers, void *(*start_routine)(void*),
+		void *arg)
+{
+	return ENOSYS;
+}
+
+unsigned ufiber_worker_id(void)
+{
+	return 0;
+}
+#endif
+
+ufiber_t ufiber_self(void)
+{
+	return current;
+}
+
+const char *ufiber_getname(ufiber_t fiber)
+{
+	return fiber->name;
+}
+
+int ufiber_attr_init(ufiber_attr_t *attr)
+{
+	attr->stackaddr = NULL;
+	attr->stacksize = STACK_SIZE;
+	attr->guardsize = default_guard_size();
+	attr->flags = 0;
+	attr->name = NULL;
+	attr->prio = UFIBER_PRIO_DEFAULT;
+	return 0;
+}
+
+int ufiber_attr_destroy(ufiber_attr_t *attr)
+{
+	return 0;
+}
+
+int ufiber_attr_setstacksize(ufiber_attr_t *attr, size_t stacksize)
+{
+	if (stacksize < STACK_MIN || !size_to_bin(stacksize))
+		return EINVAL;
+	attr->stackaddr = NULL;
+	attr->stacksize = stacksize;
+	return 0;
+}
+
+int ufiber_attr_getstacksize(const ufiber_attr_t *attr, size_t *stacksize)
+{
+	*stacksize = attr->stacksize;
+	return 0;
+}
+
+int ufiber_attr_setstack(ufiber_attr_t *attr, void *stackaddr,
+		size_t stacksize)
+{
+	if (stackaddr == NULL || stacksize < STACK_MIN)
+		return EINVAL;
+	attr->stackaddr = stackaddr;
+	attr->stacksize = stacksize;
+	return 0;
+}
+
+int ufiber_attr_getstack(const ufiber_attr_t *attr, void **stackaddr,
+		size_t *stacksize)
+{
+	*stackaddr = attr->stackaddr;
+	*stacksize = attr->stacksize;
+	return 0;
+}
+
+int ufiber_attr_setguardsize(ufiber_attr_t *attr, size_t guardsize)
+{
+	size_t page = default_guard_size();
+
+	if (page)
+		guardsize = (guardsize + page - 1) / page * page;
+	attr->guardsize = guardsize;
+	return 0;
+}
+
+int ufiber_attr_getguardsize(const ufiber_attr_t *attr, size_t *guardsize)
+{
+	*guardsize = attr->guardsize;
+	return 0;
+}
+
+int ufiber_attr_setdetachstate(ufiber_attr_t *attr, int detachstate)
+{
+	if (detachstate & ~UFIBER_DETACHED)
+		return EINVAL;
+	attr->flags = (attr->flags & ~UFIBER_DETACHED) | detachstate;
+	return 0;
+}
+
+int ufiber_attr_getdetachstate(const ufiber_attr_t *attr, int *detachstate)
+{
+	*detachstate = attr->flags & UFIBER_DETACHED;
+	return 0;
+}
+
+int ufiber_attr_setsharedstack(ufiber_attr_t *attr, int shared)
+{
+	if (shared)
+		attr->flags |= UFIBER_SHARED_STACK;
+	else
+		attr->flags &= ~UFIBER_SHARED_STACK;
+	return 0;
+}
+
+int ufiber_attr_getsharedstack(const ufiber_attr_t *attr, int *shared)
+{
+	*shared = !!(attr->flags & UFIBER_SHARED_STACK);
+	return 0;
+}
+
+int ufiber_attr_setname(ufiber_attr_t *attr, const char *name)
+{
+	attr->name = name;
+	return 0;
+}
+
+int ufiber_attr_getname(const ufiber_attr_t *attr, const char **name)
+{
+	*name = attr->name;
+	return 0;
+}
+
+int ufiber_attr_setprio(ufiber_attr_t *attr, int prio)
+{
+	if (prio < UFIBER_PRIO_MIN || prio > UFIBER_PRIO_MAX)
+		return EINVAL;
+	attr->prio = prio;
+	return 0;
+}
+
+int ufiber_attr_getprio(const ufiber_attr_t *attr, int *prio)
+{
+	*prio = attr->prio;
+	return 0;
+}
+
+/*
+ * Fiber-local storage
+ *
+ * The values of the first FLS_INLINE keys live in the TCB, so looking one up
+ * is a single load; the values of other keys live in a block that is
+ * allocated, and grown, when a fiber first sets one of them.  Key indices are
+ * never reused, so a new key can't see values left over from a deleted one.
+ * TCBs are cached with all of their values cleared.
+ */
+
+struct fls_key {
+	void (*destructor)(void*);
+	int live;
+};
+
+static struct fls_key keys[UFIBER_KEYS_MAX];
+static unsigned nr_keys; // keys created so far
+
+#if UFIBER_THREADS
+static pthread_mutex_t key_lock = PTHREAD_MUTEX_INITIALIZER;
+#define lock_keys()   pthread_mutex_lock(&key_lock)
+#define unlock_keys() pthread_mutex_unlock(&key_lock)
+#else
+#define lock_keys()
+#define unlock_keys()
+#endif
+
+/* get the slot for 'key' in 'tcb', or NULL if its spill block is too small */
+static void **fls_slot(struct ufiber *tcb, ufiber_key_t key)
+{
+	if (key < FLS_INLINE)
+		return &tcb->fls[key];
+	key -= FLS_INLINE;
+	return key < tcb->fls_spill_size ? &tcb->fls_spill[key] : NULL;
+}
+
+/* run the destructors for the current fiber's values, and clear them all */
+static void fls_destroy(void)
+{
+	void (*destructor)(void*);
+	void **slot, *value;
+	unsigned n;
+	int again = 1;
+
+	for (int i = 0; again && i < UFIBER_DESTRUCTOR_ITERATIONS; i++) {
+		again = 0;
+		lock_keys();
+		n = nr_keys;
+		unlock_keys();
+
+		for (ufiber_key_t key = 0; key < n; key++) {
+			if ((slot = fls_slot(current, key)) == NULL)
+				break;
+			if ((value = *slot) == NULL)
+				continue;
+
+			lock_keys();
+			destructor = keys[key].live ? keys[key].destructor
+				: NULL;
+			unlock_keys();
+			if (destructor == NULL)
+				continue;
+
+			*slot = NULL;
+			destructor(value);
+			again = 1;
+		}
+	}
+
+	for (unsigned i = 0; i < FLS_INLINE; i++)
+		current->fls[i] = NULL;
+	for (unsigned i = 0; i < current->fls_spill_size; i++)
+		current->fls_spill[i] = NULL;
+	current->fls_used = 0;
+}
+
+int ufiber_key_create(ufiber_key_t *key, void (*destructor)(void*))
+{
+	lock_keys();
+	if (nr_keys == UFIBER_KEYS_MAX) {
+		unlock_keys();
+		return EAGAIN;
+	}
+	*key = nr_keys++;
+	keys[*key].destructor = destructor;
+	keys[*key].live = 1;
+	unlock_keys();
+	return 0;
+}
+
+int ufiber_key_delete(ufiber_key_t key)
+{
+	int error = 0;
+
+	lock_keys();
+	if (key >= nr_keys || !keys[key].live)
+		error = EINVAL;
+	else
+		keys[key].live = 0;
+	unlock_keys();
+	return error;
+}
+
+void *ufiber_getspecific(ufiber_key_t key)
+{
+	void **slot;
+
+	if (key < FLS_INLINE)
+		return current->fls[key];
+	slot = fls_slot(current, key);
+	return slot ? *slot : NULL;
+}
+
+int ufiber_setspecific(ufiber_key_t key, const void *value)
+{
+	unsigned size;
+	void **spill;
+
+	if (key >= UFIBER_KEYS_MAX)
+		return EINVAL;
+
+	if (key >= FLS_INLINE + current->fls_spill_size) {
+		if (value == NULL)
+			return 0;
+
+		size = current->fls_spill_size ? current->fls_spill_size : 8;
+		while (size <= key - FLS_INLINE)
+			size *= 2;
+		if (size > UFIBER_KEYS_MAX - FLS_INLINE)
+			size = UFIBER_KEYS_MAX - FLS_INLINE;
+
+		spill = realloc(current->fls_spill, size * sizeof(*spill));
+		if (spill == NULL)
+			return ENOMEM;
+		for (unsigned i = current->fls_spill_size; i < size; i++)
+			spill[i] = NULL;
+		current->fls_spill = spill;
+		current->fls_spill_size = size;
+	}
+
+	*fls_slot(current, key) = (void*) value;
+	current->fls_used = 1;
+	return 0;
+}
+
+int ufiber_create(ufiber_t *fiber, unsigned long flags,
+		void *(*start_routine)(void*), void *arg)
+{
+	ufiber_attr_t attr;
+
+	if (flags & UFIBER_STEALABLE) {
+		if (fiber != NULL)
+			return EINVAL;
+#if UFIBER_THREADS
+		if (this_worker != NULL
+				&& worker_spawn(flags, start_routine, arg))
+			return 0;
+#endif
+		flags = (flags & ~UFIBER_STEALABLE) | UFIBER_DETACHED;
+	}
+
+	ufiber_attr_init(&attr);
+	attr.flags = flags;
+	return ufiber_create_attr(fiber, &attr, start_routine, arg);
+}
+
+/* check 'attr', and find the bin of the stacks of fibers created with it */
+static int attr_bin(const ufiber_attr_t *attr, unsigned *bin)
+{
+	*bin = 0;
+	if (attr->flags & UFIBER_SHARED_STACK) {
+		if (attr->stackaddr != NULL)
+			return EINVAL;
+	} else if (attr->stackaddr == NULL
+			&& !(*bin = size_to_bin(attr->stacksize))) {
+		return EINVAL;
+	}
+	if (attr->prio < UFIBER_PRIO_MIN || attr->prio > UFIBER_PRIO_MAX)
+		return EINVAL;
+	return 0;
+}
+
+/* set up a new fiber in 'tcb', whose stack has been assigned, to run
+ * 'start_routine' */
+static void init_fiber(struct ufiber *tcb, const ufiber_attr_t *attr,
+		int joinable, void *(*start_routine)(void*), void *arg)
+{
+	unsigned i;
+
+	tcb->ref = (!joinable || attr->flags & UFIBER_DETACHED) ? 1 : 2;
+	tcb->flags = attr->flags;
+	tcb->prio = attr->prio;
+	tcb->timer_state = TIMER_IDLE;
+	tcb->remote_state = REMOTE_IDLE;
+#if UFIBER_THREADS
+	tcb->blocked_lock = NULL;
+	tcb->woken = 0;
+#endif
+	UFIBER_CIRCLEQ_INIT(&tcb->blocked);
+#if UFIBER_STATS
+	stats_init(tcb);
+#endif
+#if UFIBER_TRACE
+	tcb->id = ++next_id;
+	trace(UFIBER_TRACE_CREATE, tcb, current, 0);
+#endif
+
+	for (i = 0; attr->name && i < UFIBER_NAME_MAX-1 && attr->name[i]; i++)
+		tcb->name[i] = attr->name[i];
+	tcb->name[i] = '\0';
+
+#if UFIBER_SPLIT_STACK
+	split_reset(tcb);
+#endif
+	if (tcb->sstack) {
+		tcb->start_routine = start_routine;
+		tcb->arg = arg;
+	} else {
+#if UFIBER_STACK_PAINT
+		stack_paint(tcb);
+#endif
+		tcb->sp = _ufiber_create(tcb->stack, tcb->stack_size,
+				start_routine, arg, _ufiber_trampoline,
+				ufiber_exit);
+	}
+}
+
+int ufiber_create_attr(ufiber_t *fiber, const ufiber_attr_t *attr,
+		void *(*start_routine)(void*), void *arg)
+{
+	struct ufiber *tcb;
+	ufiber_attr_t defaults;
+	unsigned bin;
+	int error;
+
+	if (attr == NULL) {
+		ufiber_attr_init(&defaults);
+		attr = &defaults;
+	}
+	if ((error = attr_bin(attr, &bin)))
+		return error;
+
+	if ((tcb = alloc_tcb(bin, attr->guardsize)) == NULL)
+		return ENOMEM;
+
+	tcb->sstack = NULL;
+	if (attr->stackaddr != NULL) {
+		tcb->stack = attr->stackaddr;
+		tcb->stack_size = attr->stacksize;
+	} else if (attr->flags & UFIBER_SHARED_STACK) {
+		tcb->stack = NULL;
+		tcb->stack_size = 0;
+		if (shared_assign(tcb)) {
+			free_tcb(tcb);
+			return ENOMEM;
+		}
+	}
+
+	init_fiber(tcb, attr, fiber != NULL, start_routine, arg);
+	ready(tcb);
+
+	if (fiber)
+		*fiber = tcb;
+
+	fiber_count++;
+	return 0;
+}
+
+/* Fan-out: the TCBs are allocated together (see alloc_tcbs()), and queued
+ * behind the ready fibers of their priority in one go. */
+int ufiber_create_n(ufiber_t fibers[], unsigned n, const ufiber_attr_t *attr,
+		void *(*start_routine)(void*), void *arg, size_t stride)
+{
+	struct ufiber_waitlist list;
+	struct ufiber *tcb;
+	ufiber_attr_t defaults;
+	unsigned bin, i = 0;
+	int error;
+
+	if (attr == NULL) {
+		ufiber_attr_init(&defaults);
+		attr = &defaults;
+	}
+	if ((error = attr_bin(attr, &bin)))
+		return error;
+	if (attr->stackaddr != NULL) // the fibers can't all run on it
+		return EINVAL;
+	if (n == 0)
+		return 0;
+
+	UFIBER_CIRCLEQ_INIT(&list);
+	if (alloc_tcbs(&list, n, bin, attr->guardsize))
+		return ENOMEM;
+
+	/* assign shared stacks first: it's the last thing that can fail */
+	UFIBER_CIRCLEQ_FOREACH(tcb, &list, chain) {
+		tcb->sstack = NULL;
+		if (attr->flags & UFIBER_SHARED_STACK) {
+			tcb->stack = NULL;
+			tcb->stack_size = 0;
+			if (shared_assign(tcb))
+				goto fail;
+		}
+	}
+
+	UFIBER_CIRCLEQ_FOREACH(tcb, &list, chain) {
+		init_fiber(tcb, attr, fibers != NULL, start_routine,
+				stride ? (char*) arg + stride * i : arg);
+		tcb->state = FS_READY;
+		if (fibers)
+			fibers[i] = tcb;
+		i++;
+	}
+	UFIBER_CIRCLEQ_CONCAT(&ready_queues[attr->prio], &list, chain);
+	ready_mask |= 1UL << attr->prio;
+
+	fiber_count += n;
+	return 0;
+fail:
+	while (!UFIBER_CIRCLEQ_EMPTY(&list)) {
+		tcb = UFIBER_CIRCLEQ_FIRST(&list);
+		UFIBER_CIRCLEQ_REMOVE(&list, tcb, chain);
+		free_tcb(tcb);
+	}
+	return ENOMEM;
+}
+
+int ufiber_join(ufiber_t fiber, void **retval)
+{
+	return ufiber_timedjoin(fiber, retval, NULL);
+}
+
+int ufiber_timedjoin(ufiber_t fiber, void **retval,
+		const struct timespec *abstime)
+{
+	int error;
+
+	if (fiber == current)
+		return EDEADLK;
+	if (abstime != NULL && !timespec_valid(abstime))
+		return EINVAL;
+
+	if (fiber->state == FS_DEAD && retval != NULL)
+		*retval = fiber->rv;
+	else if (fiber->state != FS_DEAD
+			&& (error = block_timed(&fiber->blocked, retval,
+					UFIBER_WAIT_JOIN, abstime)))
+		return error;
+	ufiber_unref(fiber);
+	return 0;
+}
+
+int ufiber_sleep(unsigned long msec)
+{
+	/* add a tick since we're probably partway through the current one */
+	block_until(&sleepers, NULL, UFIBER_WAIT_SLEEP, now_tick() + msec + 1);
+	return 0;
+}
+
+void ufiber_yield(void)
+{
+#if UFIBER_STATS
+	current->stats.yields++;
+#endif
+	ready(current);
+	schedule();
+}
+
+int ufiber_yield_to(ufiber_t fiber)
+{
+	if (fiber->state == FS_DEAD)
+		return ESRCH;
+	if (fiber->state != FS_READY)
+		return EAGAIN;
+
+#if UFIBER_STATS
+	current->stats.yields++;
+#endif
+	switch_to(fiber);
+	return 0;
+}
+
+int ufiber_setprio(ufiber_t fiber, int prio)
+{
+	if (prio < UFIBER_PRIO_MIN || prio > UFIBER_PRIO_MAX)
+		return EINVAL;
+	if (fiber->state == FS_DEAD)
+		return ESRCH;
+
+	/* move a waiting ready fiber to the back of its new run queue */
+	if (fiber->state == FS_READY && fiber != current) {
+		unready(fiber);
+		fiber->prio = prio;
+		ready(fiber);
+	} else {
+		fiber->prio = prio;
+	}
+	return 0;
+}
+
+int ufiber_getprio(ufiber_t fiber)
+{
+	return fiber->prio;
+}
+
+static noinline void exit_process(long status)
+{
+	exit(status);
+}
+
+void ufiber_exit(void *retval)
+{
+#if UFIBER_STACK_PAINT
+	size_t used;
+#endif
+
+	if (current->fls_used)
+		fls_destroy();
+
+#if UFIBER_STACK_PAINT
+	if (current->stack && (used = stack_usage(current)) > stack_max_usage)
+		stack_max_usage = used;
+#endif
+
+	if (--fiber_count == 0)
+		exit_process((long) retval);
+
+	/* nothing on the stack is needed any more */
+	if (current->sstack)
+		current->sstack->owner = NULL;
+
+#if UFIBER_TRACE
+	trace(UFIBER_TRACE_EXIT, current, NULL, 0);
+#endif
+	current->rv = retval;
 	current->state = FS_DEAD;
 	wake_all(&current->blocked, retval);
+	if (fiber_count == 1)
+		wake_all(&drained, NULL);
 	ufiber_unref(current);
 
-	schedule();
+	schedule();
+}
+
+void ufiber_ref(ufiber_t fiber)
+{
+	fiber->ref++;
+}
+
+void ufiber_unref(ufiber_t fiber)
+{
+	if (--fiber->ref == 0)
+		free_tcb(fiber);
+}
+
+/*
+ * Remote wakeups (see struct remote_queue)
+ */
+
+/* create the doorbell that the scheduler sleeps on while fibers wait for
+ * remote wakeups */
+static noinline int doorbell_open(void)
+{
+#ifdef __linux__
+	if ((remote.doorbell = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+		return errno;
+	remote.bell_wr = remote.doorbell;
+#else
+	int fds[2];
+
+	if (pipe(fds))
+		return errno;
+	for (int i = 0; i < 2; i++) {
+		fcntl(fds[i], F_SETFL, O_NONBLOCK);
+		fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+	}
+	remote.doorbell = fds[0];
+	remote.bell_wr = fds[1];
+#endif
+	return 0;
+}
+
+int ufiber_wait_remote(void **value)
+{
+	void *rv;
+	int error;
+
+	if (__atomic_load_n(&remote.head, __ATOMIC_RELAXED) != NULL)
+		remote_drain();
+
+	if (current->remote_state == REMOTE_EARLY) {
+		rv = current->rv;
+		__atomic_store_n(&current->remote_state, REMOTE_IDLE,
+				__ATOMIC_RELEASE);
+	} else {
+		if (remote.doorbell < 0 && (error = doorbell_open()))
+			return error;
+		nr_remote_waiters++;
+		block(&remote_waiters, &rv, UFIBER_WAIT_REMOTE);
+		nr_remote_waiters--;
+	}
+
+	if (value != NULL)
+		*value = rv;
+	return 0;
+}
+
+/* make sure that ufiber_wait_remote() can't fail */
+int _ufiber_remote_prepare(void)
+{
+	return remote.doorbell < 0 ? doorbell_open() : 0;
+}
+
+void _ufiber_completion_init(struct _ufiber_completion *c)
+{
+	c->fiber = current;
+	c->done = 0;
+}
+
+/* May be called from any thread; 'c' must not be touched afterwards. */
+void _ufiber_complete(struct _ufiber_completion *c)
+{
+	struct remote_queue *rq = c->fiber->slab->remote;
+	struct _ufiber_completion *head;
+
+	head = __atomic_load_n(&rq->done, __ATOMIC_RELAXED);
+	do {
+		c->next = head;
+	} while (!__atomic_compare_exchange_n(&rq->done, &head, c, 1,
+				__ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+	remote_ring(rq);
+}
+
+void _ufiber_wait_completion(struct _ufiber_completion *c)
+{
+	while (!c->done) {
+		nr_remote_waiters++;
+		block(&completion_waiters, NULL, UFIBER_WAIT_REMOTE);
+		nr_remote_waiters--;
+	}
+}
+
+/* May be called from any thread.  TCBs never leave the thread whose slabs
+ * they were allocated from, so the slab knows which queue to push onto. */
+int ufiber_wake_remote(ufiber_t fiber, void *value)
+{
+	struct remote_queue *rq = fiber->slab->remote;
+	struct ufiber *head;
+	unsigned char idle = REMOTE_IDLE;
+
+	if (!__atomic_compare_exchange_n(&fiber->remote_state, &idle,
+				REMOTE_QUEUED, 0, __ATOMIC_ACQUIRE,
+				__ATOMIC_RELAXED))
+		return EBUSY;
+	fiber->rv = value;
+
+	head = __atomic_load_n(&rq->head, __ATOMIC_RELAXED);
+	do {
+		fiber->remote_next = head;
+	} while (!__atomic_compare_exchange_n(&rq->head, &head, fiber, 1,
+				__ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+	remote_ring(rq);
+	return 0;
+}
+
+/*
+ * mutexes
+ *
+ * Under the FIFO and HANDOFF policies, an unlock with fibers waiting leaves
+ * the mutex locked and hands it to the first of them; HANDOFF then switches
+ * to the new owner, so that the mutex is not held by a fiber that is waiting
+ * behind the whole run queue.  Under the STEAL policy, an unlock releases the
+ * mutex and wakes the first waiter to retry, so that a running fiber may take
+ * the mutex first.  Only one waiter is woken at a time ('waking'); whichever
+ * fiber ends up holding the mutex wakes the next one when it unlocks.
+ */
+
+#define MUTEX_RETRY EAGAIN
+
+int ufiber_mutex_init(ufiber_mutex_t *mutex)
+{
+	UFIBER_CIRCLEQ_INIT(&mutex->blocked);
+	mutex->count = 0;
+	mutex->policy = UFIBER_MUTEX_FIFO;
+	mutex->waking = 0;
+	mutex->lock = 0;
+	return 0;
+}
+
+int ufiber_mutex_destroy(ufiber_mutex_t *mutex)
+{
+	obj_lock(&mutex->lock);
+	wake_all_shared(&mutex->blocked, (void*) -1L);
+	obj_unlock(&mutex->lock);
+	return 0;
+}
+
+int ufiber_mutex_setpolicy(ufiber_mutex_t *mutex, int policy)
+{
+	if (policy != UFIBER_MUTEX_FIFO && policy != UFIBER_MUTEX_HANDOFF
+			&& policy != UFIBER_MUTEX_STEAL)
+		return EINVAL;
+	mutex->policy = policy;
+	return 0;
+}
+
+int ufiber_mutex_getpolicy(const ufiber_mutex_t *mutex, int *policy)
+{
+	*policy = mutex->policy;
+	return 0;
+}
+
+int ufiber_mutex_lock(ufiber_mutex_t *mutex)
+{
+	return ufiber_mutex_timedlock(mutex, NULL);
+}
+
+int ufiber_mutex_timedlock(ufiber_mutex_t *mutex,
+		const struct timespec *abstime)
+{
+	unsigned long error;
+	int timedout;
+
+	obj_lock(&mutex->lock);
+	if (mutex->count && abstime != NULL && !timespec_valid(abstime)) {
+		obj_unlock(&mutex->lock);
+		return EINVAL;
+	}
+
+	while (mutex->count) {
+		error = 0;
+		timedout = block_shared(&mutex->blocked, &mutex->lock,
+				(void**) &error, UFIBER_WAIT_MUTEX, abstime);
+		if (timedout)
+			return timedout;
+		if (error != MUTEX_RETRY)
+			return error; // handed over (0), or failed
+		obj_lock(&mutex->lock);
+		mutex->waking = 0;
+	}
+
+	mutex->count = 1;
+	obj_unlock(&mutex->lock);
+	return 0;
+}
+
+/* Release 'mutex'.  Under UFIBER_MUTEX_HANDOFF, the new owner is only switched
+ * to if 'handoff' is set: a fiber releasing the mutex to wait on a condition
+ * must be queued on it first, or the owner's signals would be lost. */
+static void mutex_release(ufiber_mutex_t *mutex, int handoff)
+{
+	struct ufiber *owner;
+
+	obj_lock(&mutex->lock);
+	if (UFIBER_CIRCLEQ_EMPTY(&mutex->blocked)) {
+		mutex->count = 0;
+		obj_unlock(&mutex->lock);
+		return;
+	}
+
+	owner = UFIBER_CIRCLEQ_FIRST(&mutex->blocked);
+	switch (mutex->policy) {
+	case UFIBER_MUTEX_STEAL:
+		mutex->count = 0;
+		if (!mutex->waking) {
+			mutex->waking = 1;
+			wake_shared(owner, (void*) MUTEX_RETRY);
+		}
+		break;
+	case UFIBER_MUTEX_HANDOFF:
+		/* the owner can only be switched to in its own worker */
+		handoff &= wake_shared(owner, (void*) 0L);
+		obj_unlock(&mutex->lock);
+		if (handoff)
+			switch_to(owner);
+		return;
+	default:
+		wake_shared(owner, (void*) 0L);
+		break;
+	}
+	obj_unlock(&mutex->lock);
+}
+
+int ufiber_mutex_unlock(ufiber_mutex_t *mutex)
+{
+	mutex_release(mutex, 1);
+	return 0;
+}
+
+int ufiber_mutex_trylock(ufiber_mutex_t *mutex)
+{
+	int error = EBUSY;
+
+	obj_lock(&mutex->lock);
+	if (!mutex->count) {
+		mutex->count = 1;
+		error = 0;
+	}
+	obj_unlock(&mutex->lock);
+	return error;
+}
+
+int ufiber_barrier_init(ufiber_barrier_t *barrier, unsigned count)
+{
+	UFIBER_CIRCLEQ_INIT(&barrier->blocked);
+	barrier->count = count;
+	return 0;
+}
+
+int ufiber_barrier_destroy(ufiber_barrier_t *barrier)
+{
+	wake_all(&barrier->blocked, (void*) ((unsigned long) EINVAL));
+	return 0;
+}
+
+int ufiber_barrier_wait(ufiber_barrier_t *barrier)
+{
+	unsigned long rv = 0;
+
+	if (--barrier->count == 0) {
+		wake_all(&barrier->blocked, (void*) 0L);
+		rv = UFIBER_BARRIER_SERIAL_FIBER;
+	} else {
+		block(&barrier->blocked, (void**) &rv, UFIBER_WAIT_BARRIER);
+	}
+
+	return rv;
+}
+
+/*
+ * Wait groups
+ *
+ * 'count' is the number of outstanding ufiber_waitgroup_add()s; waiters are
+ * woken together when it drops to zero.
+ */
+
+int ufiber_waitgroup_init(ufiber_waitgroup_t *wg)
+{
+	UFIBER_CIRCLEQ_INIT(&wg->blocked);
+	wg->count = 0;
+	return 0;
 }
 
-void ufiber_ref(ufiber_t fiber)
+int ufiber_waitgroup_destroy(ufiber_waitgroup_t *wg)
 {
-	fiber->ref++;
+	if (!UFIBER_CIRCLEQ_EMPTY(&wg->blocked))
+		return EBUSY;
+	return 0;
 }
 
-void ufiber_unref(ufiber_t fiber)
+int ufiber_waitgroup_add(ufiber_waitgroup_t *wg, unsigned n)
 {
-	if (--fiber->ref == 0)
-		free_tcb(fiber);
+	if (wg->count + n < wg->count)
+		return EOVERFLOW;
+	wg->count += n;
+	return 0;
 }
 
-int ufiber_mutex_init(ufiber_mutex_t *mutex)
+int ufiber_waitgroup_done(ufiber_waitgroup_t *wg)
 {
-	UFIBER_CIRCLEQ_INIT(&mutex->blocked);
-	mutex->count = 0;
+	if (wg->count == 0)
+		return EINVAL;
+	if (--wg->count == 0)
+		wake_all(&wg->blocked, NULL);
 	return 0;
 }
 
-int ufiber_mutex_destroy(ufiber_mutex_t *mutex)
+int ufiber_waitgroup_wait(ufiber_waitgroup_t *wg)
 {
-	wake_all(&mutex->blocked, (void*) -1L);
+	if (wg->count)
+		block(&wg->blocked, NULL, UFIBER_WAIT_BARRIER);
 	return 0;
 }
 
-int ufiber_mutex_lock(ufiber_mutex_t *mutex)
+/*
+ * Semaphores
+ *
+ * Waiters are served in FIFO order, and permits are handed to them by the
+ * poster: a waiter that is woken up already holds the permits it asked for,
+ * and later waiters can't take permits while earlier ones wait for more than
+ * are available.  A waiter's request is the value of its wait pointer.
+ */
+
+/* hand out permits to as many waiters, from the first, as they cover */
+static void sem_grant(ufiber_sem_t *sem)
 {
-	unsigned long error = 0;
+	struct ufiber *waiter;
+	unsigned long want;
+
+	while (!UFIBER_CIRCLEQ_EMPTY(&sem->blocked)) {
+		waiter = UFIBER_CIRCLEQ_FIRST(&sem->blocked);
+		want = (unsigned long) *(void**) stack_addr(waiter, waiter->ptr);
+		if (want > sem->count)
+			break;
+		sem->count -= want;
+		wake(waiter, NULL);
+	}
+}
 
-	if (mutex->count)
-		block(&mutex->blocked, (void**) &error);
+static int sem_wait(ufiber_sem_t *sem, unsigned long n,
+		const struct timespec *abstime)
+{
+	void *want = (void*) n;
+	int error;
 
-	if (error)
-		return error;
+	if (UFIBER_CIRCLEQ_EMPTY(&sem->blocked) && sem->count >= n) {
+		sem->count -= n;
+		return 0;
+	}
+	if (abstime != NULL && !timespec_valid(abstime))
+		return EINVAL;
 
-	mutex->count = 1;
-	return 0;
+	error = block_timed(&sem->blocked, &want, UFIBER_WAIT_SEM, abstime);
+	if (error) // we may have been holding up the waiters behind us
+		sem_grant(sem);
+	return error;
 }
 
-int ufiber_mutex_unlock(ufiber_mutex_t *mutex)
+int ufiber_sem_init(ufiber_sem_t *sem, unsigned long value)
 {
-	if (UFIBER_CIRCLEQ_EMPTY(&mutex->blocked))
-		mutex->count = 0;
-	else
-		wake_one(&mutex->blocked, (void*) 0L);
+	UFIBER_CIRCLEQ_INIT(&sem->blocked);
+	sem->count = value;
 	return 0;
 }
 
-int ufiber_mutex_trylock(ufiber_mutex_t *mutex)
+int ufiber_sem_destroy(ufiber_sem_t *sem)
 {
-	if (mutex->count)
+	if (!UFIBER_CIRCLEQ_EMPTY(&sem->blocked))
 		return EBUSY;
-	return ufiber_mutex_lock(mutex);
+	return 0;
 }
 
-int ufiber_barrier_init(ufiber_barrier_t *barrier, unsigned count)
+int ufiber_sem_wait(ufiber_sem_t *sem)
 {
-	UFIBER_CIRCLEQ_INIT(&barrier->blocked);
-	barrier->count = count;
-	return 0;
+	return sem_wait(sem, 1, NULL);
 }
 
-int ufiber_barrier_destroy(ufiber_barrier_t *barrier)
+int ufiber_sem_wait_n(ufiber_sem_t *sem, unsigned long n)
 {
-	wake_all(&barrier->blocked, (void*) ((unsigned long) EINVAL));
+	return sem_wait(sem, n, NULL);
+}
+
+int ufiber_sem_timedwait(ufiber_sem_t *sem, const struct timespec *abstime)
+{
+	return sem_wait(sem, 1, abstime);
+}
+
+int ufiber_sem_timedwait_n(ufiber_sem_t *sem, unsigned long n,
+		const struct timespec *abstime)
+{
+	return sem_wait(sem, n, abstime);
+}
+
+int ufiber_sem_trywait(ufiber_sem_t *sem)
+{
+	if (!UFIBER_CIRCLEQ_EMPTY(&sem->blocked) || sem->count == 0)
+		return EAGAIN;
+	sem->count--;
 	return 0;
 }
 
-int ufiber_barrier_wait(ufiber_barrier_t *barrier)
+int ufiber_sem_post(ufiber_sem_t *sem)
 {
-	unsigned long rv = 0;
+	return ufiber_sem_post_n(sem, 1);
+}
 
-	if (--barrier->count == 0) {
-		wake_all(&barrier->blocked, (void*) 0L);
-		rv = UFIBER_BARRIER_SERIAL_FIBER;
-	} else {
-		block(&barrier->blocked, (void**) &rv);
-	}
+int ufiber_sem_post_n(ufiber_sem_t *sem, unsigned long n)
+{
+	if (sem->count + n < sem->count)
+		return EOVERFLOW;
+	sem->count += n;
+	if (!UFIBER_CIRCLEQ_EMPTY(&sem->blocked))
+		sem_grant(sem);
+	return 0;
+}
 
-	return rv;
+int ufiber_sem_getvalue(const ufiber_sem_t *sem, unsigned long *value)
+{
+	*value = sem->count;
+	return 0;
 }
 
 /*
@@ -364,6 +3294,9 @@ int ufiber_barrier_wait(ufiber_barrier_t *barrier)
  * A value of -1 for lock->reading means that it is currently write-locked.
  * When unlocking a write-locked rwlock, queued writers are unblocked first.
  * Only when there are no writers left are any queued readers unblocked.
+ *
+ * The lock is handed over to woken fibers by the unlocker, so that a fiber
+ * which times out (and is therefore never woken) never holds it.
  */
 
 int ufiber_rwlock_init(ufiber_rwlock_t *lock)
@@ -381,15 +3314,35 @@ int ufiber_rwlock_destroy(ufiber_rwlock_t *lock)
 	return 0;
 }
 
-int ufiber_rwlock_rdlock(ufiber_rwlock_t *lock)
+/* hand the lock to all queued readers */
+static void rwlock_wake_readers(ufiber_rwlock_t *lock)
 {
-	unsigned long error = 0;
+	struct ufiber *pos, *n;
 
-	if (lock->reading == -1 || !UFIBER_CIRCLEQ_EMPTY(&lock->wrblocked))
-		block(&lock->rdblocked, (void**) &error);
+	UFIBER_CIRCLEQ_FOREACH_SAFE(pos, &lock->rdblocked, chain, n) {
+		lock->reading++;
+		wake(pos, (void*) 0L);
+	}
+}
 
-	if (error)
-		return error;
+int ufiber_rwlock_rdlock(ufiber_rwlock_t *lock)
+{
+	return ufiber_rwlock_timedrdlock(lock, NULL);
+}
+
+int ufiber_rwlock_timedrdlock(ufiber_rwlock_t *lock,
+		const struct timespec *abstime)
+{
+	unsigned long error = 0;
+	int timedout;
+
+	if (lock->reading == -1 || !UFIBER_CIRCLEQ_EMPTY(&lock->wrblocked)) {
+		if (abstime != NULL && !timespec_valid(abstime))
+			return EINVAL;
+		timedout = block_timed(&lock->rdblocked, (void**) &error,
+				UFIBER_WAIT_RWLOCK, abstime);
+		return timedout ? timedout : (int) error;
+	}
 
 	lock->reading++;
 	return 0;
@@ -397,13 +3350,29 @@ int ufiber_rwlock_rdlock(ufiber_rwlock_t *lock)
 
 int ufiber_rwlock_wrlock(ufiber_rwlock_t *lock)
 {
-	unsigned long error = 0;
-
-	if (lock->reading > 0)
-		block(&lock->wrblocked, (void*) &error);
+	return ufiber_rwlock_timedwrlock(lock, NULL);
+}
 
-	if (error)
+int ufiber_rwlock_timedwrlock(ufiber_rwlock_t *lock,
+		const struct timespec *abstime)
+{
+	unsigned long error = 0;
+	int timedout;
+
+	if (lock->reading) {
+		if (abstime != NULL && !timespec_valid(abstime))
+			return EINVAL;
+		timedout = block_timed(&lock->wrblocked, (void**) &error,
+				UFIBER_WAIT_RWLOCK, abstime);
+		if (timedout) {
+			/* readers may have been queued behind us */
+			if (lock->reading != -1
+					&& UFIBER_CIRCLEQ_EMPTY(&lock->wrblocked))
+				rwlock_wake_readers(lock);
+			return timedout;
+		}
 		return error;
+	}
 
 	lock->reading = -1;
 	return 0;
@@ -418,25 +3387,23 @@ int ufiber_rwlock_tryrdlock(ufiber_rwlock_t *lock)
 
 int ufiber_rwlock_trywrlock(ufiber_rwlock_t *lock)
 {
-	if (lock->reading > 0)
+	if (lock->reading)
 		return EBUSY;
 	return ufiber_rwlock_wrlock(lock);
 }
 
 int ufiber_rwlock_unlock(ufiber_rwlock_t *lock)
 {
-	struct ufiber *next;
-
 	if (lock->reading == -1) {
 		if (UFIBER_CIRCLEQ_EMPTY(&lock->wrblocked)) {
 			lock->reading = 0;
-			wake_all(&lock->rdblocked, (void*) 0L);
+			rwlock_wake_readers(lock);
 		} else {
-			next = UFIBER_CIRCLEQ_FIRST(&lock->wrblocked);
-			UFIBER_CIRCLEQ_REMOVE(&lock->wrblocked, next, chain);
-			ready(next);
+			wake_one(&lock->wrblocked, (void*) 0L);
 		}
-	} else if (--lock->reading == 0) {
+	} else if (--lock->reading == 0
+			&& !UFIBER_CIRCLEQ_EMPTY(&lock->wrblocked)) {
+		lock->reading = -1;
 		wake_one(&lock->wrblocked, (void*) 0L);
 	}
 	return 0;
@@ -455,19 +3422,29 @@ int ufiber_cond_destroy(ufiber_cond_t *cond)
 
 int ufiber_cond_wait(ufiber_cond_t *cond, ufiber_mutex_t *mutex)
 {
-	unsigned long error = 0;
+	return ufiber_cond_timedwait(cond, mutex, NULL);
+}
 
-	if (mutex != NULL && (error = ufiber_mutex_unlock(mutex) != 0))
-		return error;
+int ufiber_cond_timedwait(ufiber_cond_t *cond, ufiber_mutex_t *mutex,
+		const struct timespec *abstime)
+{
+	unsigned long wakeerr = 0;
+	int error, timedout;
 
-	block(cond, (void*) &error);
-	if (error)
-		return error;
+	if (abstime != NULL && !timespec_valid(abstime))
+		return EINVAL;
 
 	if (mutex != NULL)
-		error = ufiber_mutex_unlock(mutex);
+		mutex_release(mutex, 0);
 
-	return error;
+	timedout = block_timed(cond, (void**) &wakeerr, UFIBER_WAIT_COND,
+			abstime);
+
+	/* the mutex is reacquired even if the wait failed */
+	if (mutex != NULL && (error = ufiber_mutex_lock(mutex)) != 0)
+		return error;
+
+	return timedout ? timedout : (int) wakeerr;
 }
 
 int ufiber_cond_broadcast(ufiber_cond_t *cond)
@@ -481,3 +3458,471 @@ int ufiber_cond_signal(ufiber_cond_t *cond)
 	wake_one(cond, (void*) 0L);
 	return 0;
 }
+
+/*
+ * channels
+ *
+ * A channel of size N buffers up to N values; a channel of size 0 is
+ * unbuffered, so that every send waits for a matching receive.
+ *
+ * Values are never queued in the buffer while there are blocked receivers: a
+ * sender that finds one stores its value straight into the receiver and
+ * readies it.  Likewise a blocked sender keeps its value in the slot that its
+ * 'ptr' points to until a receiver takes it from there (refilling the buffer
+ * if there is one) and wakes the sender.  Fibers woken by a close or destroy
+ * instead receive the address of 'chan_closed'.
+ *
+ * With thread support, a blocked sender also keeps its value in its TCB, as
+ * a receiver in another worker can't reach into a shared stack.
+ */
+
+static char chan_closed;
+
+/* the value that blocked sender 'tcb' is sending */
+static inline void *chan_sent(struct ufiber *tcb)
+{
+#if UFIBER_THREADS
+	return tcb->woken_rv;
+#else
+	return *(void**) stack_addr(tcb, tcb->ptr);
+#endif
+}
+
+int ufiber_chan_init(ufiber_chan_t *chan, unsigned size, unsigned flags)
+{
+	chan->buf = NULL;
+	if (size && !(chan->buf = malloc(size * sizeof(*chan->buf))))
+		return ENOMEM;
+
+	UFIBER_CIRCLEQ_INIT(&chan->sendq);
+	UFIBER_CIRCLEQ_INIT(&chan->recvq);
+	chan->size = size;
+	chan->head = 0;
+	chan->count = 0;
+	chan->flags = flags;
+	chan->closed = 0;
+	chan->lock = 0;
+	return 0;
+}
+
+int ufiber_chan_destroy(ufiber_chan_t *chan)
+{
+	ufiber_chan_close(chan);
+	free(chan->buf);
+	return 0;
+}
+
+int ufiber_chan_close(ufiber_chan_t *chan)
+{
+	obj_lock(&chan->lock);
+	chan->closed = 1;
+	wake_all_shared(&chan->recvq, &chan_closed);
+	wake_all_shared(&chan->sendq, &chan_closed);
+	obj_unlock(&chan->lock);
+	return 0;
+}
+
+static int chan_send(ufiber_chan_t *chan, void *value, int wait)
+{
+	struct ufiber *receiver;
+	int local;
+
+	obj_lock(&chan->lock);
+	if (chan->closed) {
+		obj_unlock(&chan->lock);
+		return EPIPE;
+	}
+
+	if (!UFIBER_CIRCLEQ_EMPTY(&chan->recvq)) {
+		receiver = UFIBER_CIRCLEQ_FIRST(&chan->recvq);
+		local = wake_shared(receiver, value);
+		obj_unlock(&chan->lock);
+		if (local && (chan->flags & UFIBER_CHAN_SWITCH))
+			switch_to(receiver);
+		return 0;
+	}
+
+	if (chan->count < chan->size) {
+		chan->buf[(chan->head + chan->count++) % chan->size] = value;
+		obj_unlock(&chan->lock);
+		return 0;
+	}
+
+	if (!wait) {
+		obj_unlock(&chan->lock);
+		return EAGAIN;
+	}
+
+#if UFIBER_THREADS
+	current->woken_rv = value;
+#endif
+	block_shared(&chan->sendq, &chan->lock, &value, UFIBER_WAIT_CHAN,
+			NULL);
+	return value == &chan_closed ? EPIPE : 0;
+}
+
+static int chan_recv(ufiber_chan_t *chan, void **value, int wait)
+{
+	struct ufiber *sender;
+	void *slot;
+	int error;
+
+	obj_lock(&chan->lock);
+	if (chan->count) {
+		*value = chan->buf[chan->head];
+		chan->head = (chan->head + 1) % chan->size;
+		chan->count--;
+		if (!UFIBER_CIRCLEQ_EMPTY(&chan->sendq)) {
+			sender = UFIBER_CIRCLEQ_FIRST(&chan->sendq);
+			chan->buf[(chan->head + chan->count++) % chan->size] =
+				chan_sent(sender);
+			wake_shared(sender, NULL);
+		}
+		obj_unlock(&chan->lock);
+		return 0;
+	}
+
+	if (!UFIBER_CIRCLEQ_EMPTY(&chan->sendq)) {
+		sender = UFIBER_CIRCLEQ_FIRST(&chan->sendq);
+		*value = chan_sent(sender);
+		wake_shared(sender, NULL);
+		obj_unlock(&chan->lock);
+		return 0;
+	}
+
+	if (chan->closed || !wait) {
+		error = chan->closed ? EPIPE : EAGAIN;
+		obj_unlock(&chan->lock);
+		return error;
+	}
+
+	block_shared(&chan->recvq, &chan->lock, &slot, UFIBER_WAIT_CHAN, NULL);
+	if (slot == &chan_closed)
+		return EPIPE;
+	*value = slot;
+	return 0;
+}
+
+int ufiber_chan_send(ufiber_chan_t *chan, void *value)
+{
+	return chan_send(chan, value, 1);
+}
+
+int ufiber_chan_trysend(ufiber_chan_t *chan, void *value)
+{
+	return chan_send(chan, value, 0);
+}
+
+int ufiber_chan_recv(ufiber_chan_t *chan, void **value)
+{
+	return chan_recv(chan, value, 1);
+}
+
+int ufiber_chan_tryrecv(ufiber_chan_t *chan, void **value)
+{
+	return chan_recv(chan, value, 0);
+}
+
+/*
+ * Futures
+ *
+ * A fiber in ufiber_future_get() waits on the future's 'waiters' list.  A
+ * fiber waiting on several futures at once can't be on all of their lists,
+ * so it blocks on a list of its own, in a struct fselect, and registers a
+ * struct ufiber_fwait with each future instead.  Setting a future counts
+ * down the 'remaining' futures of every fselect registered with it, and
+ * wakes the waiter when that reaches zero.  The setter unlinks all of the
+ * future's registrations, so the promise may be destroyed as soon as it is
+ * set; the waiter unlinks those that remain when it wakes up.
+ *
+ * Registrations live on the waiter's stack, except for fibers on shared
+ * stacks (whose stacks other fibers can't reach into) and for large waits.
+ */
+
+#define FUTURE_INLINE 8 // registrations kept on the stack
+
+struct fselect {
+	struct ufiber_waitlist blocked;
+	unsigned remaining; // futures to wait for before waking up
+	unsigned index;     // the future that woke us
+};
+
+struct ufiber_fwait {
+	struct ufiber_fwait *next;
+	struct ufiber_fwait **pprev; // NULL once unlinked
+	struct fselect *sel;
+	unsigned index;
+};
+
+int ufiber_promise_init(ufiber_promise_t *promise)
+{
+	UFIBER_CIRCLEQ_INIT(&promise->future.waiters);
+	promise->future.selectors = NULL;
+	promise->future.value = NULL;
+	promise->future.ready = 0;
+	return 0;
+}
+
+int ufiber_promise_destroy(ufiber_promise_t *promise)
+{
+	if (!UFIBER_CIRCLEQ_EMPTY(&promise->future.waiters)
+			|| promise->future.selectors)
+		return EBUSY;
+	return 0;
+}
+
+int ufiber_promise_set(ufiber_promise_t *promise, void *value)
+{
+	ufiber_future_t *future = &promise->future;
+	struct ufiber_fwait *w, *next;
+	struct fselect *sel;
+
+	if (future->ready)
+		return EINVAL;
+	future->value = value;
+	future->ready = 1;
+	wake_all(&future->waiters, value);
+
+	for (w = future->selectors; w; w = next) {
+		next = w->next;
+		w->pprev = NULL;
+		sel = w->sel;
+		if (sel->remaining && --sel->remaining == 0) {
+			sel->index = w->index;
+			wake_one(&sel->blocked, NULL);
+		}
+	}
+	future->selectors = NULL;
+	return 0;
+}
+
+ufiber_future_t *ufiber_promise_future(ufiber_promise_t *promise)
+{
+	return &promise->future;
+}
+
+int ufiber_future_get(ufiber_future_t *future, void **value)
+{
+	void *rv = future->value;
+
+	if (!future->ready)
+		block(&future->waiters, &rv, UFIBER_WAIT_OTHER);
+	if (value)
+		*value = rv;
+	return 0;
+}
+
+int ufiber_future_tryget(ufiber_future_t *future, void **value)
+{
+	if (!future->ready)
+		return EAGAIN;
+	if (value)
+		*value = future->value;
+	return 0;
+}
+
+/* Block until 'remaining' of those of the 'n' futures that aren't ready have
+ * been set.  'index' gets the index of the last one. */
+static int future_select(ufiber_future_t *const futures[], unsigned n,
+		unsigned remaining, unsigned *index)
+{
+	struct {
+		struct fselect sel;
+		struct ufiber_fwait w[FUTURE_INLINE];
+	} local;
+	struct fselect *sel = &local.sel;
+	struct ufiber_fwait *w = local.w;
+	void *mem = NULL;
+
+	if (current->sstack || n > FUTURE_INLINE) {
+		mem = malloc(sizeof(*sel) + n * sizeof(*w));
+		if (mem == NULL)
+			return ENOMEM;
+		sel = mem;
+		w = (struct ufiber_fwait*) (sel + 1);
+	}
+
+	UFIBER_CIRCLEQ_INIT(&sel->blocked);
+	sel->remaining = remaining;
+	for (unsigned i = 0; i < n; i++) {
+		w[i].pprev = NULL;
+		if (futures[i]->ready)
+			continue;
+		w[i].sel = sel;
+		w[i].index = i;
+		if ((w[i].next = futures[i]->selectors) != NULL)
+			w[i].next->pprev = &w[i].next;
+		futures[i]->selectors = &w[i];
+		w[i].pprev = &futures[i]->selectors;
+	}
+
+	block(&sel->blocked, NULL, UFIBER_WAIT_OTHER);
+
+	for (unsigned i = 0; i < n; i++) {
+		if (w[i].pprev == NULL)
+			continue;
+		if ((*w[i].pprev = w[i].next) != NULL)
+			w[i].next->pprev = w[i].pprev;
+	}
+	if (index)
+		*index = sel->index;
+	free(mem);
+	return 0;
+}
+
+int ufiber_wait_any(ufiber_future_t *const futures[], unsigned n,
+		unsigned *index)
+{
+	if (n == 0)
+		return EINVAL;
+	for (unsigned i = 0; i < n; i++) {
+		if (futures[i]->ready) {
+			if (index)
+				*index = i;
+			return 0;
+		}
+	}
+	return future_select(futures, n, 1, index);
+}
+
+int ufiber_wait_all(ufiber_future_t *const futures[], unsigned n)
+{
+	unsigned remaining = 0;
+
+	for (unsigned i = 0; i < n; i++)
+		remaining += !futures[i]->ready;
+	if (remaining == 0)
+		return 0;
+	return future_select(futures, n, remaining, NULL);
+}
+
+/*
+ * Fiber pools
+ *
+ * A pool's workers are long-lived, detached fibers that run submitted tasks
+ * one after another, so running a task costs a couple of context switches
+ * instead of a fiber's creation and exit.  Workers wait on 'idle' for tasks,
+ * and exit when there are more of them than 'target', or when the pool is
+ * shut down and its queue is empty.  'drained' is woken whenever the number
+ * of pending tasks or of workers drops to zero.
+ */
+
+static void *pool_worker(void *data)
+{
+	ufiber_pool_t *pool = data;
+	struct ufiber_task *task;
+
+	for (;;) {
+		while (UFIBER_SIMPLEQ_EMPTY(&pool->tasks) && !pool->shutdown
+				&& pool->workers <= pool->target)
+			block(&pool->idle, NULL, UFIBER_WAIT_OTHER);
+		if (pool->workers > pool->target
+				|| UFIBER_SIMPLEQ_EMPTY(&pool->tasks))
+			break;
+
+		task = UFIBER_SIMPLEQ_FIRST(&pool->tasks);
+		UFIBER_SIMPLEQ_REMOVE_HEAD(&pool->tasks, link);
+		task->rv = task->fn(task->arg);
+		task->done = 1;
+		wake_all(&task->joiners, task->rv);
+		if (--pool->pending == 0)
+			wake_all(&pool->drained, NULL);
+	}
+
+	if (--pool->workers == 0)
+		wake_all(&pool->drained, NULL);
+	return NULL;
+}
+
+static int pool_spawn(ufiber_pool_t *pool, unsigned n)
+{
+	int error;
+
+	error = ufiber_create_n(NULL, n, &pool->attr, pool_worker, pool, 0);
+	if (!error)
+		pool->workers += n;
+	return error;
+}
+
+int ufiber_pool_init(ufiber_pool_t *pool, unsigned workers,
+		const ufiber_attr_t *attr)
+{
+	if (workers == 0)
+		return EINVAL;
+
+	UFIBER_SIMPLEQ_INIT(&pool->tasks);
+	UFIBER_CIRCLEQ_INIT(&pool->idle);
+	UFIBER_CIRCLEQ_INIT(&pool->drained);
+	if (attr)
+		pool->attr = *attr;
+	else
+		ufiber_attr_init(&pool->attr);
+	pool->workers = 0;
+	pool->target = workers;
+	pool->pending = 0;
+	pool->shutdown = 0;
+	return pool_spawn(pool, workers);
+}
+
+int ufiber_pool_destroy(ufiber_pool_t *pool)
+{
+	pool->shutdown = 1;
+	wake_all(&pool->idle, NULL);
+	while (pool->workers)
+		block(&pool->drained, NULL, UFIBER_WAIT_OTHER);
+	return 0;
+}
+
+int ufiber_pool_resize(ufiber_pool_t *pool, unsigned workers)
+{
+	int error = 0;
+
+	if (workers == 0)
+		return EINVAL;
+	if (pool->shutdown)
+		return EPIPE;
+
+	/* Workers that are still on their way out count towards the old
+	 * target, so only spawn what they won't make up for. */
+	if (workers > pool->workers)
+		error = pool_spawn(pool, workers - pool->workers);
+	if (!error) {
+		pool->target = workers;
+		wake_all(&pool->idle, NULL);
+	}
+	return error;
+}
+
+int ufiber_pool_submit(ufiber_pool_t *pool, ufiber_task_t *task,
+		void *(*fn)(void*), void *arg)
+{
+	if (pool->shutdown)
+		return EPIPE;
+
+	task->fn = fn;
+	task->arg = arg;
+	task->done = 0;
+	UFIBER_CIRCLEQ_INIT(&task->joiners);
+	UFIBER_SIMPLEQ_INSERT_TAIL(&pool->tasks, task, link);
+	pool->pending++;
+	wake_one(&pool->idle, NULL);
+	return 0;
+}
+
+int ufiber_pool_drain(ufiber_pool_t *pool)
+{
+	while (pool->pending)
+		block(&pool->drained, NULL, UFIBER_WAIT_OTHER);
+	return 0;
+}
+
+int ufiber_task_join(ufiber_task_t *task, void **retval)
+{
+	void *rv = task->rv;
+
+	if (!task->done)
+		block(&task->joiners, &rv, UFIBER_WAIT_JOIN);
+	if (retval)
+		*retval = rv;
+	return 0;
+}
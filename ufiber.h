@@ -31,10 +31,59 @@
 #ifndef _UFIBER_H_
 #define _UFIBER_H_
 
+#include <stddef.h>
+
 #define UFIBER_DETACHED 1
+#define UFIBER_SHARED_STACK 2
+#define UFIBER_STEALABLE 4 // may be started by another worker
+#define UFIBER_NAME_MAX 16
 #define UFIBER_BARRIER_SERIAL_FIBER (-1)
 
+/* fiber-local storage */
+#define UFIBER_KEYS_MAX               1024
+#define UFIBER_DESTRUCTOR_ITERATIONS  4
+
+/* fiber priorities: higher values are scheduled first */
+#define UFIBER_PRIO_MIN     0
+#define UFIBER_PRIO_MAX     31
+#define UFIBER_PRIO_DEFAULT 16
+
+/* mutex policies; see ufiber_mutex_setpolicy(3) */
+#define UFIBER_MUTEX_FIFO    0 // hand the mutex to the first waiter
+#define UFIBER_MUTEX_HANDOFF 1 // ... and switch to it immediately
+#define UFIBER_MUTEX_STEAL   2 // release the mutex and let waiters retry
+
+/* ufiber_chan_init() flags */
+#define UFIBER_CHAN_SWITCH 1 // switch to a receiver when handing it a value
+
+/* kinds of waits, indexing ufiber_stats.blocked_ns; see ufiber_stats(3) */
+#define UFIBER_WAIT_JOIN    0
+#define UFIBER_WAIT_SLEEP   1
+#define UFIBER_WAIT_MUTEX   2
+#define UFIBER_WAIT_RWLOCK  3
+#define UFIBER_WAIT_COND    4
+#define UFIBER_WAIT_BARRIER 5 // barriers and wait groups
+#define UFIBER_WAIT_CHAN    6
+#define UFIBER_WAIT_IO      7
+#define UFIBER_WAIT_SEM     8
+#define UFIBER_WAIT_REMOTE  9 // ufiber_wait_remote()
+#define UFIBER_WAIT_OTHER   10
+#define UFIBER_NR_WAITS     11
+
+/* trace event types; see ufiber_trace_dump(3) */
+#define UFIBER_TRACE_CREATE 1 // 'fiber' was created by 'other'
+#define UFIBER_TRACE_SWITCH 2 // switch from 'fiber' to 'other'
+#define UFIBER_TRACE_BLOCK  3 // 'fiber' blocked; 'arg' is a UFIBER_WAIT_*
+#define UFIBER_TRACE_WAKE   4 // 'fiber' was woken by 'other'; 'arg' is 1 if
+                              // its timeout expired
+#define UFIBER_TRACE_EXIT   5 // 'fiber' exited
+#define UFIBER_TRACE_NONE   (~0U) // no fiber
+
+#define UFIBER_TRACE_MAGIC   "ufitrace"
+#define UFIBER_TRACE_VERSION 1
+
 struct ufiber;
+struct timespec;
 
 struct ufiber_waitlist {
 	struct ufiber *cqh_first;
@@ -46,52 +95,303 @@ struct ufiber_blocklist {
 	unsigned count;
 };
 
+struct ufiber_mutex {
+	struct ufiber_waitlist blocked;
+	unsigned count;
+	int policy;
+	int waking;
+	int lock; // taken when shared between workers
+};
+
+struct ufiber_sem {
+	struct ufiber_waitlist blocked;
+	unsigned long count; // permits available
+};
+
 struct ufiber_rwlock {
 	struct ufiber_waitlist rdblocked;
 	struct ufiber_waitlist wrblocked;
 	long reading;
 };
 
+struct ufiber_chan {
+	struct ufiber_waitlist sendq;
+	struct ufiber_waitlist recvq;
+	void **buf;
+	unsigned size;
+	unsigned head;
+	unsigned count;
+	unsigned flags;
+	int closed;
+	int lock; // taken when shared between workers
+};
+
+struct ufiber_attr {
+	void *stackaddr;
+	size_t stacksize;
+	size_t guardsize;
+	unsigned long flags;
+	const char *name;
+	int prio;
+};
+
+struct ufiber_fwait;
+
+struct ufiber_future {
+	struct ufiber_waitlist waiters;  // in ufiber_future_get()
+	struct ufiber_fwait *selectors; // in ufiber_wait_any(), ufiber_wait_all()
+	void *value;
+	int ready;
+};
+
+struct ufiber_promise {
+	struct ufiber_future future;
+};
+
+struct ufiber_task {
+	struct {
+		struct ufiber_task *sqe_next;
+	} link;
+	void *(*fn)(void*);
+	void *arg;
+	void *rv;
+	int done;
+	struct ufiber_waitlist joiners;
+};
+
+struct ufiber_taskq {
+	struct ufiber_task *sqh_first;
+	struct ufiber_task **sqh_last;
+};
+
+struct ufiber_pool {
+	struct ufiber_taskq tasks;      // submitted tasks not yet started
+	struct ufiber_waitlist idle;    // workers waiting for tasks
+	struct ufiber_waitlist drained; // in ufiber_pool_drain(), _destroy()
+	struct ufiber_attr attr;        // for new workers
+	unsigned workers;               // workers that have not exited
+	unsigned target;                // workers wanted
+	unsigned pending;               // tasks queued or running
+	int shutdown;
+};
+
+struct ufiber_mem_stats {
+	unsigned long fibers;      // fibers that have not exited
+	unsigned long tcbs_live;   // TCBs in use, including unjoined fibers
+	unsigned long tcbs_cached; // TCBs cached for reuse
+	size_t stack_reserved;     // bytes mapped for stacks, with guard pages
+	size_t stack_committed;    // bytes of stacks resident in memory
+	size_t stack_max_usage;    // largest stack high-water mark seen
+	size_t stack_saved;        // bytes of heap holding shared stack copies
+};
+
+struct ufiber_stats {
+	unsigned long long run_ns; // time spent running
+	unsigned long switches;    // times switched to
+	unsigned long yields;      // calls to ufiber_yield() and ufiber_yield_to()
+	unsigned long blocks;      // times blocked
+	int waiting;               // UFIBER_WAIT_* if blocked, otherwise -1
+	unsigned long long blocked_ns[UFIBER_NR_WAITS]; // time spent blocked
+};
+
+/* see ufiber_offload_stats(3); times are totals over all calls unless
+ * noted otherwise */
+struct ufiber_offload_stats {
+	unsigned long long calls;          // calls completed
+	unsigned long long rejected;       // calls refused with EAGAIN
+	unsigned long long wait_ns;        // time spent queued
+	unsigned long long run_ns;         // time spent running
+	unsigned long long latency_ns;     // time from call to resumption
+	unsigned long long max_wait_ns;    // longest single ...
+	unsigned long long max_run_ns;
+	unsigned long long max_latency_ns;
+	unsigned threads;                  // size of the thread pool
+	unsigned depth;                    // most calls that may be queued
+	unsigned queued;                   // calls waiting for a thread now
+	unsigned running;                  // calls being run now
+};
+
+/* A trace file is a header, followed by 'nr_events' events, oldest first,
+ * and 'nr_names' fiber names.  Fibers are identified by numbers that are
+ * unique within a thread, the initial fiber being 0. */
+struct ufiber_trace_header {
+	char magic[8];                // UFIBER_TRACE_MAGIC, not NUL-terminated
+	unsigned version;             // UFIBER_TRACE_VERSION
+	unsigned worker;              // ufiber_worker_id() of the traced thread
+	unsigned long long nr_events;
+	unsigned long long nr_names;
+	unsigned long long base_tick; // a time in ticks, and the same time in
+	unsigned long long base_ns;   // CLOCK_MONOTONIC nanoseconds
+	double ns_per_tick;
+};
+
+struct ufiber_trace_event {
+	unsigned long long time; // in ticks
+	unsigned fiber;
+	unsigned other;
+	unsigned short type;     // UFIBER_TRACE_*
+	unsigned short arg;
+	unsigned reserved;
+};
+
+struct ufiber_trace_name {
+	unsigned fiber;
+	char name[UFIBER_NAME_MAX];
+};
+
 typedef struct ufiber* ufiber_t;
-typedef struct ufiber_blocklist ufiber_mutex_t;
+typedef struct ufiber_attr ufiber_attr_t;
+typedef unsigned ufiber_key_t;
+typedef struct ufiber_mutex ufiber_mutex_t;
 typedef struct ufiber_blocklist ufiber_barrier_t;
+typedef struct ufiber_blocklist ufiber_waitgroup_t;
 typedef struct ufiber_rwlock ufiber_rwlock_t;
+typedef struct ufiber_sem ufiber_sem_t;
 typedef struct ufiber_waitlist ufiber_cond_t;
+typedef struct ufiber_chan ufiber_chan_t;
+typedef struct ufiber_future ufiber_future_t;
+typedef struct ufiber_promise ufiber_promise_t;
+typedef struct ufiber_task ufiber_task_t;
+typedef struct ufiber_pool ufiber_pool_t;
 
 int ufiber_init(void);
+int ufiber_set_cache_size(unsigned size);
+int ufiber_stack_usage(ufiber_t fiber, size_t *usage);
+int ufiber_mem_stats(struct ufiber_mem_stats *stats);
+int ufiber_stats(ufiber_t fiber, struct ufiber_stats *stats);
+int ufiber_foreach(int (*fn)(ufiber_t fiber, void *arg), void *arg);
+int ufiber_trace_dump(int fd);
+int ufiber_run_workers(unsigned nr_workers, void *(*start_routine)(void*),
+		void *arg);
+unsigned ufiber_worker_id(void);
 ufiber_t ufiber_self(void);
 int ufiber_create(ufiber_t *fiber, unsigned long flags,
 		void *(*start_routine)(void*), void *arg);
+int ufiber_create_attr(ufiber_t *fiber, const ufiber_attr_t *attr,
+		void *(*start_routine)(void*), void *arg);
+int ufiber_create_n(ufiber_t fibers[], unsigned n, const ufiber_attr_t *attr,
+		void *(*start_routine)(void*), void *arg, size_t stride);
 int ufiber_join(ufiber_t fiber, void **retval);
+int ufiber_timedjoin(ufiber_t fiber, void **retval,
+		const struct timespec *abstime);
+int ufiber_sleep(unsigned long msec);
 void ufiber_yield(void);
 int ufiber_yield_to(ufiber_t fiber);
+int ufiber_setprio(ufiber_t fiber, int prio);
+int ufiber_getprio(ufiber_t fiber);
 void ufiber_exit(void *retval);
+int ufiber_wait_remote(void **value);
+int ufiber_wake_remote(ufiber_t fiber, void *value);
 
 void ufiber_ref(ufiber_t fiber);
 void ufiber_unref(ufiber_t fiber);
+const char *ufiber_getname(ufiber_t fiber);
+
+int ufiber_key_create(ufiber_key_t *key, void (*destructor)(void*));
+int ufiber_key_delete(ufiber_key_t key);
+void *ufiber_getspecific(ufiber_key_t key);
+int ufiber_setspecific(ufiber_key_t key, const void *value);
+
+int ufiber_attr_init(ufiber_attr_t *attr);
+int ufiber_attr_destroy(ufiber_attr_t *attr);
+int ufiber_attr_setstacksize(ufiber_attr_t *attr, size_t stacksize);
+int ufiber_attr_getstacksize(const ufiber_attr_t *attr, size_t *stacksize);
+int ufiber_attr_setstack(ufiber_attr_t *attr, void *stackaddr,
+		size_t stacksize);
+int ufiber_attr_getstack(const ufiber_attr_t *attr, void **stackaddr,
+		size_t *stacksize);
+int ufiber_attr_setguardsize(ufiber_attr_t *attr, size_t guardsize);
+int ufiber_attr_getguardsize(const ufiber_attr_t *attr, size_t *guardsize);
+int ufiber_attr_setdetachstate(ufiber_attr_t *attr, int detachstate);
+int ufiber_attr_getdetachstate(const ufiber_attr_t *attr, int *detachstate);
+int ufiber_attr_setsharedstack(ufiber_attr_t *attr, int shared);
+int ufiber_attr_getsharedstack(const ufiber_attr_t *attr, int *shared);
+int ufiber_attr_setname(ufiber_attr_t *attr, const char *name);
+int ufiber_attr_getname(const ufiber_attr_t *attr, const char **name);
+int ufiber_attr_setprio(ufiber_attr_t *attr, int prio);
+int ufiber_attr_getprio(const ufiber_attr_t *attr, int *prio);
 
 int ufiber_mutex_init(ufiber_mutex_t *mutex);
 int ufiber_mutex_destroy(ufiber_mutex_t *mutex);
 int ufiber_mutex_lock(ufiber_mutex_t *mutex);
 int ufiber_mutex_unlock(ufiber_mutex_t *mutex);
 int ufiber_mutex_trylock(ufiber_mutex_t *mutex);
+int ufiber_mutex_timedlock(ufiber_mutex_t *mutex,
+		const struct timespec *abstime);
+int ufiber_mutex_setpolicy(ufiber_mutex_t *mutex, int policy);
+int ufiber_mutex_getpolicy(const ufiber_mutex_t *mutex, int *policy);
 
 int ufiber_barrier_init(ufiber_barrier_t *barrier, unsigned count);
 int ufiber_barrier_destroy(ufiber_barrier_t *barrier);
 int ufiber_barrier_wait(ufiber_barrier_t *barrier);
 
+int ufiber_waitgroup_init(ufiber_waitgroup_t *wg);
+int ufiber_waitgroup_destroy(ufiber_waitgroup_t *wg);
+int ufiber_waitgroup_add(ufiber_waitgroup_t *wg, unsigned n);
+int ufiber_waitgroup_done(ufiber_waitgroup_t *wg);
+int ufiber_waitgroup_wait(ufiber_waitgroup_t *wg);
+
+int ufiber_sem_init(ufiber_sem_t *sem, unsigned long value);
+int ufiber_sem_destroy(ufiber_sem_t *sem);
+int ufiber_sem_wait(ufiber_sem_t *sem);
+int ufiber_sem_wait_n(ufiber_sem_t *sem, unsigned long n);
+int ufiber_sem_timedwait(ufiber_sem_t *sem, const struct timespec *abstime);
+int ufiber_sem_timedwait_n(ufiber_sem_t *sem, unsigned long n,
+		const struct timespec *abstime);
+int ufiber_sem_trywait(ufiber_sem_t *sem);
+int ufiber_sem_post(ufiber_sem_t *sem);
+int ufiber_sem_post_n(ufiber_sem_t *sem, unsigned long n);
+int ufiber_sem_getvalue(const ufiber_sem_t *sem, unsigned long *value);
+
 int ufiber_rwlock_init(ufiber_rwlock_t *lock);
 int ufiber_rwlock_destroy(ufiber_rwlock_t *lock);
 int ufiber_rwlock_rdlock(ufiber_rwlock_t *lock);
 int ufiber_rwlock_wrlock(ufiber_rwlock_t *lock);
 int ufiber_rwlock_tryrdlock(ufiber_rwlock_t *lock);
 int ufiber_rwlock_trywrlock(ufiber_rwlock_t *lock);
+int ufiber_rwlock_timedrdlock(ufiber_rwlock_t *lock,
+		const struct timespec *abstime);
+int ufiber_rwlock_timedwrlock(ufiber_rwlock_t *lock,
+		const struct timespec *abstime);
 int ufiber_rwlock_unlock(ufiber_rwlock_t *lock);
 
 int ufiber_cond_init(ufiber_cond_t *cond);
 int ufiber_cond_destroy(ufiber_cond_t *cond);
 int ufiber_cond_wait(ufiber_cond_t *cond, ufiber_mutex_t *mutex);
+int ufiber_cond_timedwait(ufiber_cond_t *cond, ufiber_mutex_t *mutex,
+		const struct timespec *abstime);
 int ufiber_cond_broadcast(ufiber_cond_t *cond);
 int ufiber_cond_signal(ufiber_cond_t *cond);
 
+int ufiber_chan_init(ufiber_chan_t *chan, unsigned size, unsigned flags);
+int ufiber_chan_destroy(ufiber_chan_t *chan);
+int ufiber_chan_send(ufiber_chan_t *chan, void *value);
+int ufiber_chan_recv(ufiber_chan_t *chan, void **value);
+int ufiber_chan_trysend(ufiber_chan_t *chan, void *value);
+int ufiber_chan_tryrecv(ufiber_chan_t *chan, void **value);
+int ufiber_chan_close(ufiber_chan_t *chan);
+
+int ufiber_promise_init(ufiber_promise_t *promise);
+int ufiber_promise_destroy(ufiber_promise_t *promise);
+int ufiber_promise_set(ufiber_promise_t *promise, void *value);
+ufiber_future_t *ufiber_promise_future(ufiber_promise_t *promise);
+int ufiber_future_get(ufiber_future_t *future, void **value);
+int ufiber_future_tryget(ufiber_future_t *future, void **value);
+int ufiber_wait_any(ufiber_future_t *const futures[], unsigned n,
+		unsigned *index);
+int ufiber_wait_all(ufiber_future_t *const futures[], unsigned n);
+
+int ufiber_pool_init(ufiber_pool_t *pool, unsigned workers,
+		const ufiber_attr_t *attr);
+int ufiber_pool_destroy(ufiber_pool_t *pool);
+int ufiber_pool_resize(ufiber_pool_t *pool, unsigned workers);
+int ufiber_pool_submit(ufiber_pool_t *pool, ufiber_task_t *task,
+		void *(*fn)(void*), void *arg);
+int ufiber_pool_drain(ufiber_pool_t *pool);
+int ufiber_task_join(ufiber_task_t *task, void **retval);
+
+int ufiber_offload(void *(*fn)(void*), void *arg, void **retval);
+int ufiber_offload_setsize(unsigned threads, unsigned depth);
+int ufiber_offload_stats(struct ufiber_offload_stats *stats);
+
 #endif
@@ -0,0 +1,53 @@
+/* Copyright (c) 2013-2015, Drew Thoreson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _UFIBER_IO_H_
+#define _UFIBER_IO_H_
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "ufiber.h"
+
+#define UFIBER_POLLIN  0x001
+#define UFIBER_POLLOUT 0x004
+
+int ufiber_wait_fd(int fd, int events);
+ssize_t ufiber_read(int fd, void *buf, size_t count);
+ssize_t ufiber_write(int fd, const void *buf, size_t count);
+int ufiber_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+int ufiber_connect(int fd, const struct sockaddr *addr, socklen_t addrlen);
+int ufiber_close(int fd);
+
+ssize_t ufiber_pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t ufiber_pwrite(int fd, const void *buf, size_t count, off_t offset);
+ssize_t ufiber_send(int fd, const void *buf, size_t len, int flags);
+ssize_t ufiber_recv(int fd, void *buf, size_t len, int flags);
+
+#endif